@@ -10,12 +10,16 @@
 #include <Uefi.h>
 #include <Library/PcdLib.h>
 #include <Library/UefiLib.h>
+#include <Library/UefiBootServicesTableLib.h>
 #include <Library/UefiApplicationEntryPoint.h>
 #include <Library/DebugLib.h>
 #include <Library/BaseLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/HttpDownloadLib.h>
+#include <Library/PrintLib.h>
+#include <Protocol/Smbios.h>
+#include <Guid/SystemResourceTable.h>
 
 
 
@@ -34,6 +38,250 @@ HttpDownloadFileProgress (
   }
 }
 
+//
+// The /update response is received in a buffer of this size, a larger one is
+// allocated only if it does not fit.
+//
+#define UPDATE_JSON_SIZE  SIZE_4KB
+
+//
+// The message of the /update response, shown to the user. It holds the
+// version, of up to 256 characters.
+//
+#define MESSAGE_SIZE  320
+
+//
+// The update check. The board and its current BIOS version are added as
+// query parameters, the server answers 204 when the board is up to date.
+//
+#define UPDATE_URL       L"http://192.168.10.23:5000/update"
+#define UPDATE_URL_SIZE  512
+
+/**
+  Get a string of the first SMBIOS record of a type.
+
+  @param[in]  Smbios       The SMBIOS protocol.
+  @param[in]  Type         Type of the record.
+  @param[in]  StringField  Offset of the string number in the record.
+
+  @return  The string, or NULL if there is no such record or string.
+**/
+STATIC
+CONST CHAR8 *
+GetSmbiosString (
+  IN EFI_SMBIOS_PROTOCOL  *Smbios,
+  IN EFI_SMBIOS_TYPE      Type,
+  IN UINTN                StringField
+  )
+{
+  EFI_SMBIOS_HANDLE        Handle;
+  EFI_SMBIOS_TABLE_HEADER  *Record;
+  CONST CHAR8              *String;
+  UINT8                    StringNumber;
+
+  Handle = SMBIOS_HANDLE_PI_RESERVED;
+  if (EFI_ERROR (Smbios->GetNext (Smbios, &Handle, &Type, &Record, NULL))) {
+    return NULL;
+  }
+
+  if (Record->Length <= StringField) {
+    return NULL;
+  }
+
+  StringNumber = ((UINT8 *)Record)[StringField];
+  if (StringNumber == 0) {
+    return NULL;
+  }
+
+  //
+  // The strings follow the formatted area, the set ends with an empty one.
+  //
+  String = (CONST CHAR8 *)Record + Record->Length;
+  while (--StringNumber != 0 && *String != '\0') {
+    String += AsciiStrLen (String) + 1;
+  }
+
+  return (*String != '\0') ? String : NULL;
+}
+
+/**
+  Get the version of the system firmware from the ESRT.
+
+  @param[out]  Version  The firmware version.
+
+  @retval  TRUE   The ESRT has a system firmware entry.
+  @retval  FALSE  It has none, or there is no ESRT.
+**/
+STATIC
+BOOLEAN
+GetEsrtFirmwareVersion (
+  OUT UINT32  *Version
+  )
+{
+  EFI_SYSTEM_RESOURCE_TABLE  *Esrt;
+  EFI_SYSTEM_RESOURCE_ENTRY  *Entry;
+  UINTN                      Index;
+
+  if (EFI_ERROR (EfiGetSystemConfigurationTable (&gEfiSystemResourceTableGuid, (VOID **)&Esrt))) {
+    return FALSE;
+  }
+
+  Entry = (EFI_SYSTEM_RESOURCE_ENTRY *)(Esrt + 1);
+  for (Index = 0; Index < Esrt->FwResourceCount; Index++) {
+    if (Entry[Index].FwType == ESRT_FW_TYPE_SYSTEMFIRMWARE) {
+      *Version = Entry[Index].FwVersion;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+  Append a query parameter to a URL, escaping the characters that are not
+  unreserved in a URI. The value is cut if the URL is full.
+
+  @param[in, out]  Url      The URL.
+  @param[in]       UrlSize  Size of the URL buffer in characters.
+  @param[in]       Name     Name of the parameter.
+  @param[in]       Value    Value of the parameter.
+**/
+STATIC
+VOID
+AppendQuery (
+  IN OUT CHAR16       *Url,
+  IN     UINTN        UrlSize,
+  IN     CONST CHAR8  *Name,
+  IN     CONST CHAR8  *Value
+  )
+{
+  UINTN  Length;
+
+  Length = StrLen (Url);
+  if (Length + AsciiStrLen (Name) + 2 >= UrlSize) {
+    return;
+  }
+
+  Length += UnicodeSPrint (
+              &Url[Length],
+              (UrlSize - Length) * sizeof (CHAR16),
+              L"%c%a=",
+              (StrStr (Url, L"?") == NULL) ? L'?' : L'&',
+              Name
+              );
+  for ( ; *Value != '\0' && Length + 3 < UrlSize; Value++) {
+    if (  ((*Value >= '0') && (*Value <= '9'))
+       || ((*Value >= 'A') && (*Value <= 'Z'))
+       || ((*Value >= 'a') && (*Value <= 'z'))
+       || (*Value == '-') || (*Value == '.') || (*Value == '_') || (*Value == '~'))
+    {
+      Url[Length++] = *Value;
+    } else {
+      Length += UnicodeSPrint (&Url[Length], (UrlSize - Length) * sizeof (CHAR16), L"%%%02X", (UINT8)*Value);
+    }
+  }
+
+  Url[Length] = L'\0';
+}
+
+/**
+  Build the update check URL with the board ID, the product name of the
+  baseboard or else of the system, and the current BIOS version, from SMBIOS
+  or else from the ESRT. Parameters that cannot be found are left out.
+
+  @param[out]  Url      The URL.
+  @param[in]   UrlSize  Size of the URL buffer in characters.
+**/
+STATIC
+VOID
+BuildUpdateUrl (
+  OUT CHAR16  *Url,
+  IN  UINTN   UrlSize
+  )
+{
+  EFI_SMBIOS_PROTOCOL  *Smbios;
+  CONST CHAR8          *Board;
+  CONST CHAR8          *Version;
+  CHAR8                EsrtVersion[11];
+  UINT32               FwVersion;
+
+  Board   = NULL;
+  Version = NULL;
+  StrCpyS (Url, UrlSize, UPDATE_URL);
+
+  if (!EFI_ERROR (gBS->LocateProtocol (&gEfiSmbiosProtocolGuid, NULL, (VOID **)&Smbios))) {
+    Board = GetSmbiosString (Smbios, EFI_SMBIOS_TYPE_BASEBOARD_INFORMATION, OFFSET_OF (SMBIOS_TABLE_TYPE2, ProductName));
+    if (Board == NULL) {
+      Board = GetSmbiosString (Smbios, EFI_SMBIOS_TYPE_SYSTEM_INFORMATION, OFFSET_OF (SMBIOS_TABLE_TYPE1, ProductName));
+    }
+
+    Version = GetSmbiosString (Smbios, EFI_SMBIOS_TYPE_BIOS_INFORMATION, OFFSET_OF (SMBIOS_TABLE_TYPE0, BiosVersion));
+  }
+
+  if ((Version == NULL) && GetEsrtFirmwareVersion (&FwVersion)) {
+    AsciiSPrint (EsrtVersion, sizeof (EsrtVersion), "%u", FwVersion);
+    Version = EsrtVersion;
+  }
+
+  if (Board != NULL) {
+    AppendQuery (Url, UrlSize, "board", Board);
+  }
+
+  if (Version != NULL) {
+    AppendQuery (Url, UrlSize, "current", Version);
+  }
+}
+
+/**
+  Check the downloaded image against its block manifest. The blocks are
+  hashed on all the CPUs, so this takes a fraction of the download time.
+
+  @param[in]  ManifestLink  URL of the manifest.
+  @param[in]  Image         The image.
+  @param[in]  ImageSize     Size of the image in bytes.
+
+  @retval  EFI_SUCCESS             The image matches the manifest.
+  @retval  EFI_SECURITY_VIOLATION  A block of the image is corrupted.
+  @retval  Others                  The manifest could not be downloaded.
+**/
+STATIC
+EFI_STATUS
+VerifyImage (
+  IN CHAR16       *ManifestLink,
+  IN CONST CHAR8  *Image,
+  IN UINTN        ImageSize
+  )
+{
+  EFI_STATUS  Status;
+  CHAR8       *Manifest;
+  UINTN       ManifestSize;
+  UINTN       BadBlock;
+
+  Manifest     = NULL;
+  ManifestSize = 0;
+  Status       = HttpDownloadFile (ManifestLink, &ManifestSize, Manifest, NULL);
+  if (Status == EFI_BUFFER_TOO_SMALL) {
+    Manifest = AllocatePool (ManifestSize);
+    if (Manifest == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    Status = HttpDownloadFile (ManifestLink, &ManifestSize, Manifest, NULL);
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = HttpDownloadVerifyBlocks (Image, ImageSize, Manifest, ManifestSize, &BadBlock);
+    if (Status == EFI_SECURITY_VIOLATION) {
+      DEBUG ((DEBUG_ERROR, "Block %Lu of the image does not match the manifest\n", (UINT64)BadBlock));
+    }
+  }
+
+  if (Manifest != NULL) {
+    FreePool (Manifest);
+  }
+
+  return Status;
+}
 
 VOID
 BiosUpdateCheckHttp()
@@ -41,12 +289,26 @@ BiosUpdateCheckHttp()
   EFI_STATUS     Status;
   CHAR8          *DownloadBuffer = NULL;
   UINTN          DownloadSize = 0;
-  CHAR8          *SearchResult;
-  CHAR8          *MessageStr;
-  CHAR8          *BiosBinLinkStr;
-  UINTN          StringSize1, StringSize2;
-  CHAR16         *BiosLink, *NewMessage;
+  CHAR16         BiosLink[UPDATE_URL_SIZE];
+  CHAR16         NewMessage[MESSAGE_SIZE];
+  CHAR16         Multicast[32];
+  CHAR16         ManifestLink[UPDATE_URL_SIZE];
+  BOOLEAN        HasManifest;
+  CHAR16         MirrorUrls[HTTP_DOWNLOAD_MAX_MIRRORS][UPDATE_URL_SIZE];
+  CHAR16         *Mirrors[HTTP_DOWNLOAD_MAX_MIRRORS];
+  UINTN          MirrorCount;
+  BOOLEAN        HasMulticast;
+  STATIC CHAR8   UpdateJson[UPDATE_JSON_SIZE];
+  HTTP_DOWNLOAD_UPDATE_INFO  Update;
   EFI_INPUT_KEY  Key;
+  UINTN          Index;
+  EFI_STATUS     PrefetchStatus;
+  HTTP_DOWNLOAD_SESSION  *Session;
+  HTTP_DOWNLOAD_STATISTICS  Statistics;
+  CHAR16         UpdateUrl[UPDATE_URL_SIZE];
+
+  BuildUpdateUrl (UpdateUrl, UPDATE_URL_SIZE);
+  DEBUG ((DEBUG_INFO, "Checking %s\n", UpdateUrl));
 
   //
   // Check /update
@@ -54,85 +316,201 @@ BiosUpdateCheckHttp()
   // if success, return:
   // {
   //   "message": "New BIOS version available: V1R17",
-  //   "image_url": "http://192.168.10.23:5000/BIOS.bin"
+  //   "image_url": "http://192.168.10.23:5000/BIOS.bin",
+  //   "sha256": "2b412532360a7b7e...",
+  //   "mirrors": ["http://192.168.10.23:5000/BIOS.bin", "http://192.168.10.24:5000/BIOS.bin"],
+  //   "multicast": "239.255.0.1:5001",
+  //   ...
   // }
   //
-  Status = HttpDownloadFile (L"http://192.168.10.23:5000/update", &DownloadSize, DownloadBuffer, NULL);
+  // "mirrors" is only there when the server knows of mirrors, "multicast"
+  // when it also sends the image to a multicast group.
+  //
+  // The response is read into UpdateJson without a HEAD first. A board
+  // already running the published version gets 204 No Content, which
+  // succeeds with nothing downloaded. A larger response fails with
+  // EFI_BUFFER_TOO_SMALL and its size.
+  //
+  DownloadSize = sizeof (UpdateJson);
+  Status = HttpDownloadFile (UpdateUrl, &DownloadSize, UpdateJson, NULL);
   if (Status == EFI_BUFFER_TOO_SMALL) {
-    DownloadBuffer = AllocateZeroPool (DownloadSize + 1);
-    Status = HttpDownloadFile (L"http://192.168.10.23:5000/update", &DownloadSize, DownloadBuffer, NULL);
+    DownloadBuffer = AllocatePool (DownloadSize);
+    if (DownloadBuffer == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
+    } else {
+      Status = HttpDownloadFile (UpdateUrl, &DownloadSize, DownloadBuffer, NULL);
+    }
+  }
+
+  //
+  // Copy the strings needed out of the response, then it can be freed.
+  //
+  MirrorCount  = 0;
+  HasMulticast = FALSE;
+  HasManifest  = FALSE;
+  if (!EFI_ERROR (Status) && (DownloadSize != 0)) {
+    Status = HttpDownloadParseUpdate ((DownloadBuffer != NULL) ? DownloadBuffer : UpdateJson, DownloadSize, &Update);
+    if (!EFI_ERROR (Status)) {
+      Status = HttpDownloadJsonToUnicode (&Update.Message, NewMessage, ARRAY_SIZE (NewMessage));
+    }
+
+    if (!EFI_ERROR (Status)) {
+      Status = HttpDownloadJsonToUnicode (&Update.ImageUrl, BiosLink, ARRAY_SIZE (BiosLink));
+    }
+
+    if (!EFI_ERROR (Status)) {
+      HasMulticast = (BOOLEAN)(  Update.HasSha256
+                              && !EFI_ERROR (HttpDownloadJsonToUnicode (&Update.Multicast, Multicast, ARRAY_SIZE (Multicast))));
+      HasManifest  = (BOOLEAN)!EFI_ERROR (HttpDownloadJsonToUnicode (&Update.ManifestUrl, ManifestLink, ARRAY_SIZE (ManifestLink)));
+      for (Index = 0; Index < Update.MirrorCount; Index++) {
+        if (!EFI_ERROR (HttpDownloadJsonToUnicode (&Update.Mirrors[Index], MirrorUrls[MirrorCount], UPDATE_URL_SIZE))) {
+          Mirrors[MirrorCount] = MirrorUrls[MirrorCount];
+          MirrorCount++;
+        }
+      }
+    }
+
+    DEBUG ((DEBUG_INFO, "/update response of 0x%x bytes - %r\n", DownloadSize, Status));
   }
-  if (!EFI_ERROR(Status)) {
-    DEBUG ((DEBUG_INFO, "%a - 0x%x\n", DownloadBuffer, DownloadSize));
 
-    SearchResult = AsciiStrStr (DownloadBuffer, ", ");
-    if (SearchResult != NULL) {
-      StringSize1 = DownloadSize - 13 - AsciiStrLen (SearchResult) - 1;
-      MessageStr = AllocateZeroPool (StringSize1 + 1);
-      CopyMem (MessageStr, DownloadBuffer+13, StringSize1);
+  if (DownloadBuffer != NULL) {
+    FreePool (DownloadBuffer);
+    DownloadBuffer = NULL;
+  }
 
-      DEBUG ((DEBUG_INFO, "%a\n", MessageStr));
+  if (!EFI_ERROR (Status) && (DownloadSize != 0)) {
+    DownloadSize = 0;
 
-      StringSize2 = DownloadSize - 13 - StringSize1 - 17 - 2;
-      BiosBinLinkStr = AllocateZeroPool (StringSize2 + 1);
-      CopyMem (BiosBinLinkStr, DownloadBuffer+13+StringSize1+17, StringSize2);
-      DEBUG ((DEBUG_INFO, "%a\n", BiosBinLinkStr));
+    DEBUG ((DEBUG_INFO, "%s\n", NewMessage));
+    DEBUG ((DEBUG_INFO, "%s, %d mirrors, 0x%lx bytes\n", BiosLink, MirrorCount, Update.ImageSize));
 
-      if (DownloadBuffer != NULL) {
-        FreePool (DownloadBuffer);
-        DownloadBuffer = NULL;
-        DownloadSize = 0;
+    //
+    // Start fetching the image while the user reads the prompt. With
+    // mirrors, the fastest one is only picked once the user confirms.
+    // With multicast, the image is received from the group instead.
+    //
+    Session = NULL;
+    if ((MirrorCount < 2) && !HasMulticast) {
+      Status = HttpDownloadStart (BiosLink, &Session);
+      if (EFI_ERROR (Status)) {
+        Session = NULL;
       }
+    }
 
-      BiosLink = AllocateZeroPool ((AsciiStrLen (BiosBinLinkStr) + 1) * sizeof (CHAR16));
-      AsciiStrToUnicodeStrS (BiosBinLinkStr, BiosLink, (AsciiStrLen (BiosBinLinkStr) + 1) * sizeof (CHAR16));
+    PrefetchStatus = EFI_NOT_READY;
 
-      NewMessage = AllocateZeroPool ((AsciiStrLen (MessageStr) + 1) * sizeof (CHAR16));
-      AsciiStrToUnicodeStrS (MessageStr, NewMessage, (AsciiStrLen (MessageStr) + 1) * sizeof (CHAR16));
+    CreatePopUp (
+      EFI_LIGHTGRAY | EFI_BACKGROUND_BLUE,
+      NULL,
+      NewMessage,
+      BiosLink,
+      L"Press ENTER to continue update, Press ESC to cancel update",
+      NULL
+      );
+    gST->ConIn->Reset (gST->ConIn, FALSE);
+    while (TRUE) {
+      if ((Session != NULL) && (PrefetchStatus == EFI_NOT_READY)) {
+        PrefetchStatus = HttpDownloadPoll (Session);
+      } else {
+        gBS->WaitForEvent (1, &gST->ConIn->WaitForKey, &Index);
+      }
 
-      FreePool (MessageStr);
-      FreePool (BiosBinLinkStr);
+      Status = gST->ConIn->ReadKeyStroke (gST->ConIn, &Key);
+      if (!EFI_ERROR (Status) &&
+          ((Key.ScanCode == SCAN_ESC) || (Key.UnicodeChar == CHAR_CARRIAGE_RETURN)))
+      {
+        break;
+      }
+    }
 
-      do {
-        CreatePopUp (
-          EFI_LIGHTGRAY | EFI_BACKGROUND_BLUE,
-          &Key,
-          NewMessage,
-          BiosLink,
-          L"Press ENTER to continue update, Press ESC to cancel update",
-          NULL
-          );
-      } while ((Key.ScanCode != SCAN_ESC) && (Key.UnicodeChar != CHAR_CARRIAGE_RETURN));
+    if (Key.UnicodeChar == CHAR_CARRIAGE_RETURN) {
+      Status = EFI_NOT_STARTED;
+      if (Session != NULL) {
+        //
+        // Continue from whatever has already arrived.
+        //
+        Status  = HttpDownloadFinish (Session, &DownloadSize, (VOID **)&DownloadBuffer, HttpDownloadFileProgress);
+        Session = NULL;
+      }
 
-      FreePool (NewMessage);
+      if (EFI_ERROR (Status) && HasMulticast) {
+        //
+        // The image is identified in the group by the first 32 bits of
+        // its SHA-256.
+        //
+        DownloadBuffer = NULL;
+        DownloadSize   = 0;
+        Status = HttpDownloadFileMulticast (BiosLink, Multicast, SwapBytes32 (ReadUnaligned32 ((UINT32 *)Update.Sha256)), &DownloadSize, (VOID **)&DownloadBuffer, HttpDownloadFileProgress);
+      }
 
-      if (Key.UnicodeChar == CHAR_CARRIAGE_RETURN) {
-        Status = HttpDownloadFile (BiosLink, &DownloadSize, DownloadBuffer, NULL);
+      if (EFI_ERROR (Status) && (MirrorCount >= 2)) {
+        DownloadBuffer = NULL;
+        DownloadSize   = 0;
+        Status = HttpDownloadFileFromMirrors (Mirrors, MirrorCount, &DownloadSize, (VOID **)&DownloadBuffer, HttpDownloadFileProgress);
+      }
+
+      if (EFI_ERROR (Status)) {
+        //
+        // The size from /update saves the HEAD request probing it.
+        //
+        DownloadSize   = (UINTN)Update.ImageSize;
+        DownloadBuffer = (DownloadSize != 0) ? AllocatePool (DownloadSize) : NULL;
+        if (DownloadBuffer == NULL) {
+          DownloadSize = 0;
+        }
+
+        Status = HttpDownloadFile (BiosLink, &DownloadSize, DownloadBuffer, (DownloadBuffer != NULL) ? HttpDownloadFileProgress : NULL);
         if (Status == EFI_BUFFER_TOO_SMALL) {
+          //
+          // No size in /update, or the image changed since.
+          //
+          if (DownloadBuffer != NULL) {
+            FreePool (DownloadBuffer);
+          }
+
           DownloadBuffer = AllocateZeroPool (DownloadSize);
-          Status = HttpDownloadFile (BiosLink, &DownloadSize, DownloadBuffer, HttpDownloadFileProgress);
-          FreePool (BiosLink);
-          DEBUG ((DEBUG_INFO, "DownloadSize: 0x%x\n", DownloadSize));
+          if (DownloadBuffer == NULL) {
+            Status = EFI_OUT_OF_RESOURCES;
+          } else {
+            Status = HttpDownloadFile (BiosLink, &DownloadSize, DownloadBuffer, HttpDownloadFileProgress);
+          }
         }
+      }
+      DEBUG ((DEBUG_INFO, "DownloadSize: 0x%x\n", DownloadSize));
 
-        if (EFI_ERROR (Status)) {
-          HttpDownloadFileProgress (L"Download BIOS error");
+      if (EFI_ERROR (Status)) {
+        HttpDownloadFileProgress (L"Download BIOS error");
+      } else if (HasManifest) {
+        Status = VerifyImage (ManifestLink, DownloadBuffer, DownloadSize);
+        DEBUG ((DEBUG_INFO, "VerifyImage - %r\n", Status));
+        if (Status == EFI_SECURITY_VIOLATION) {
+          HttpDownloadFileProgress (L"BIOS image corrupted");
         }
+      }
 
-        //
-        // Call BIOS Update API!!!
-        //
+      //
+      // Call BIOS Update API!!!
+      //
 
-        if (DownloadBuffer != NULL) {
-          FreePool (DownloadBuffer);
-          DownloadBuffer = NULL;
-          DownloadSize = 0;
-        }
-      } else {
-        return;
+      if (DownloadBuffer != NULL) {
+        FreePool (DownloadBuffer);
+        DownloadBuffer = NULL;
+        DownloadSize = 0;
+      }
+    } else {
+      if (Session != NULL) {
+        HttpDownloadCancel (Session);
       }
     }
   } else {
+    if (!EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_INFO, "BIOS is up to date\n"));
+    } else if (!EFI_ERROR (HttpDownloadGetStatistics (&Statistics))) {
+      for (Index = 0; Index < Statistics.NicCount; Index++) {
+        DEBUG ((DEBUG_INFO, "%s: result %d - %r\n", Statistics.Nic[Index].Name, Statistics.Nic[Index].Result, Statistics.Nic[Index].Status));
+      }
+    }
+
     do {
       CreatePopUp (
         EFI_LIGHTGRAY | EFI_BACKGROUND_BLUE,
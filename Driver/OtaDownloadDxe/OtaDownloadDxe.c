@@ -0,0 +1,432 @@
+/** @file
+  OTA download service.
+
+  Serves the downloads of every HttpDownloadLib consumer of the boot, so
+  that the NIC found to reach the server, the HTTP connections kept alive
+  with it and the queue of background downloads are shared instead of being
+  rebuilt by each module.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/HttpDownloadLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/OtaDownload.h>
+
+//
+// Number of background downloads transferring at the same time, the others
+// wait in the queue in the order they were started.
+//
+#define OTA_MAX_ACTIVE_REQUESTS  2
+
+#define OTA_DOWNLOAD_REQUEST_SIGNATURE  SIGNATURE_32 ('O', 'T', 'A', 'R')
+
+typedef struct {
+  UINT32                   Signature;
+  LIST_ENTRY               Link;
+  CHAR16                   *Url;
+  //
+  // NULL while the request waits in the queue.
+  //
+  HTTP_DOWNLOAD_SESSION    *Session;
+  //
+  // EFI_NOT_READY until the transfer is over.
+  //
+  EFI_STATUS               Status;
+} OTA_DOWNLOAD_REQUEST;
+
+#define OTA_DOWNLOAD_REQUEST_FROM_LINK(a) \
+  CR (a, OTA_DOWNLOAD_REQUEST, Link, OTA_DOWNLOAD_REQUEST_SIGNATURE)
+
+STATIC LIST_ENTRY  mRequestQueue = INITIALIZE_LIST_HEAD_VARIABLE (mRequestQueue);
+STATIC UINTN       mActiveRequests = 0;
+
+/**
+  Check that a handle was returned by Start() and not released yet.
+
+  @param[in]  Request  Handle of the download.
+
+  @return  The request, or NULL if the handle is unknown.
+**/
+STATIC
+OTA_DOWNLOAD_REQUEST *
+FindRequest (
+  IN EFI_OTA_DOWNLOAD_REQUEST  Request
+  )
+{
+  LIST_ENTRY  *Entry;
+
+  BASE_LIST_FOR_EACH (Entry, &mRequestQueue) {
+    if ((VOID *)OTA_DOWNLOAD_REQUEST_FROM_LINK (Entry) == Request) {
+      return OTA_DOWNLOAD_REQUEST_FROM_LINK (Entry);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  Advance the transfers in progress and start the queued requests while
+  there is a free transfer slot.
+**/
+STATIC
+VOID
+ProcessRequestQueue (
+  VOID
+  )
+{
+  LIST_ENTRY            *Entry;
+  OTA_DOWNLOAD_REQUEST  *Request;
+
+  BASE_LIST_FOR_EACH (Entry, &mRequestQueue) {
+    Request = OTA_DOWNLOAD_REQUEST_FROM_LINK (Entry);
+    if ((Request->Session == NULL) || (Request->Status != EFI_NOT_READY)) {
+      continue;
+    }
+
+    Request->Status = HttpDownloadPoll (Request->Session);
+    if (Request->Status != EFI_NOT_READY) {
+      mActiveRequests--;
+    }
+  }
+
+  BASE_LIST_FOR_EACH (Entry, &mRequestQueue) {
+    if (mActiveRequests >= OTA_MAX_ACTIVE_REQUESTS) {
+      break;
+    }
+
+    Request = OTA_DOWNLOAD_REQUEST_FROM_LINK (Entry);
+    if ((Request->Session != NULL) || (Request->Status != EFI_NOT_READY)) {
+      continue;
+    }
+
+    Request->Status = HttpDownloadStart (Request->Url, &Request->Session);
+    if (EFI_ERROR (Request->Status)) {
+      DEBUG ((DEBUG_INFO, "OtaDownloadDxe: start %s - %r\n", Request->Url, Request->Status));
+      Request->Session = NULL;
+      continue;
+    }
+
+    Request->Status = EFI_NOT_READY;
+    mActiveRequests++;
+  }
+}
+
+/**
+  Remove a request from the queue and free it.
+
+  @param[in]  Request  The request, its session already released.
+**/
+STATIC
+VOID
+FreeRequest (
+  IN OTA_DOWNLOAD_REQUEST  *Request
+  )
+{
+  RemoveEntryList (&Request->Link);
+  FreePool (Request->Url);
+  FreePool (Request);
+}
+
+/**
+  Download a file, same semantics as HttpDownloadFile().
+
+  @param[in]      This              The protocol instance.
+  @param[in]      Url               Url like http://example.com/example.
+  @param[in, out] BufferSize        Size of Buffer; 0 with a NULL Buffer only
+                                    asks for the size of the file.
+  @param[in]      Buffer            Buffer receiving the file.
+  @param[in]      ProgressCallback  Reports the progress of the download.
+
+  @retval  EFI_SUCCESS           The file was downloaded.
+  @retval  EFI_BUFFER_TOO_SMALL  BufferSize was updated with the size needed.
+  @retval  Others                The download failed.
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+OtaDownloadFile (
+  IN     EFI_OTA_DOWNLOAD_PROTOCOL        *This,
+  IN     CHAR16                           *Url,
+  IN OUT UINTN                            *BufferSize,
+  IN     VOID                             *Buffer           OPTIONAL,
+  IN     HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback  OPTIONAL
+  )
+{
+  return HttpDownloadFile (Url, BufferSize, Buffer, ProgressCallback);
+}
+
+/**
+  Queue a background download, same semantics as HttpDownloadStart().
+
+  @param[in]   This     The protocol instance.
+  @param[in]   Url      Url like http://example.com/example.
+  @param[out]  Request  Handle of the queued download.
+
+  @retval  EFI_SUCCESS            The download is queued.
+  @retval  EFI_INVALID_PARAMETER  Url or Request is NULL.
+  @retval  EFI_OUT_OF_RESOURCES   A memory allocation failed.
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+OtaDownloadStart (
+  IN  EFI_OTA_DOWNLOAD_PROTOCOL  *This,
+  IN  CHAR16                     *Url,
+  OUT EFI_OTA_DOWNLOAD_REQUEST   *Request
+  )
+{
+  OTA_DOWNLOAD_REQUEST  *NewRequest;
+
+  if ((Url == NULL) || (Request == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  NewRequest = AllocateZeroPool (sizeof (OTA_DOWNLOAD_REQUEST));
+  if (NewRequest == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  NewRequest->Url = AllocateCopyPool (StrSize (Url), Url);
+  if (NewRequest->Url == NULL) {
+    FreePool (NewRequest);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  NewRequest->Signature = OTA_DOWNLOAD_REQUEST_SIGNATURE;
+  NewRequest->Status    = EFI_NOT_READY;
+  InsertTailList (&mRequestQueue, &NewRequest->Link);
+
+  ProcessRequestQueue ();
+
+  *Request = NewRequest;
+  return EFI_SUCCESS;
+}
+
+/**
+  Make progress on the queued downloads, same semantics as HttpDownloadPoll().
+
+  @param[in]  This     The protocol instance.
+  @param[in]  Request  Handle of the download.
+
+  @retval  EFI_NOT_READY          The download is queued or still in progress.
+  @retval  EFI_SUCCESS            The whole file has been downloaded.
+  @retval  EFI_INVALID_PARAMETER  Request is not a download of this service.
+  @retval  Others                 The download failed.
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+OtaDownloadPoll (
+  IN EFI_OTA_DOWNLOAD_PROTOCOL  *This,
+  IN EFI_OTA_DOWNLOAD_REQUEST   Request
+  )
+{
+  OTA_DOWNLOAD_REQUEST  *OtaRequest;
+
+  OtaRequest = FindRequest (Request);
+  if (OtaRequest == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  ProcessRequestQueue ();
+  return OtaRequest->Status;
+}
+
+/**
+  Wait for a queued download and release it, same semantics as
+  HttpDownloadFinish(). The caller owns the returned buffer.
+
+  @param[in]   This              The protocol instance.
+  @param[in]   Request           Handle of the download.
+  @param[out]  BufferSize        Size of the downloaded file.
+  @param[out]  Buffer            The downloaded file.
+  @param[in]   ProgressCallback  Reports the progress of the rest of the
+                                 download.
+
+  @retval  EFI_SUCCESS            The file was downloaded.
+  @retval  EFI_INVALID_PARAMETER  Request is not a download of this service.
+  @retval  Others                 The download failed; no buffer is returned.
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+OtaDownloadFinish (
+  IN  EFI_OTA_DOWNLOAD_PROTOCOL        *This,
+  IN  EFI_OTA_DOWNLOAD_REQUEST         Request,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback  OPTIONAL
+  )
+{
+  EFI_STATUS            Status;
+  OTA_DOWNLOAD_REQUEST  *OtaRequest;
+
+  OtaRequest = FindRequest (Request);
+  if ((OtaRequest == NULL) || (BufferSize == NULL) || (Buffer == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  //
+  // Keep the other transfers moving until this one gets a slot.
+  //
+  while ((OtaRequest->Session == NULL) && (OtaRequest->Status == EFI_NOT_READY)) {
+    ProcessRequestQueue ();
+  }
+
+  if (OtaRequest->Session == NULL) {
+    Status = OtaRequest->Status;
+  } else {
+    if (OtaRequest->Status == EFI_NOT_READY) {
+      mActiveRequests--;
+    }
+
+    Status              = HttpDownloadFinish (OtaRequest->Session, BufferSize, Buffer, ProgressCallback);
+    OtaRequest->Session = NULL;
+  }
+
+  FreeRequest (OtaRequest);
+  ProcessRequestQueue ();
+
+  return Status;
+}
+
+/**
+  Cancel a queued download and release it.
+
+  @param[in]  This     The protocol instance.
+  @param[in]  Request  Handle of the download.
+
+  @retval  EFI_SUCCESS            The download was cancelled.
+  @retval  EFI_INVALID_PARAMETER  Request is not a download of this service.
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+OtaDownloadCancel (
+  IN EFI_OTA_DOWNLOAD_PROTOCOL  *This,
+  IN EFI_OTA_DOWNLOAD_REQUEST   Request
+  )
+{
+  OTA_DOWNLOAD_REQUEST  *OtaRequest;
+
+  OtaRequest = FindRequest (Request);
+  if (OtaRequest == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (OtaRequest->Session != NULL) {
+    if (OtaRequest->Status == EFI_NOT_READY) {
+      mActiveRequests--;
+    }
+
+    HttpDownloadCancel (OtaRequest->Session);
+    OtaRequest->Session = NULL;
+  }
+
+  FreeRequest (OtaRequest);
+  ProcessRequestQueue ();
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Get the statistics of the last download started.
+
+  @param[in]   This        The protocol instance.
+  @param[out]  Statistics  The statistics.
+
+  @retval  EFI_SUCCESS            Statistics is filled.
+  @retval  EFI_INVALID_PARAMETER  Statistics is NULL.
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+OtaDownloadGetStatistics (
+  IN  EFI_OTA_DOWNLOAD_PROTOCOL  *This,
+  OUT HTTP_DOWNLOAD_STATISTICS   *Statistics
+  )
+{
+  return HttpDownloadGetStatistics (Statistics);
+}
+
+/**
+  Download a file from the fastest of several mirrors.
+
+  @param[in]   This              The protocol instance.
+  @param[in]   Urls              The URLs of the same file on each mirror.
+  @param[in]   UrlCount          Number of URLs.
+  @param[out]  BufferSize        Size of the downloaded file.
+  @param[out]  Buffer            The downloaded file, owned by the caller.
+  @param[in]   ProgressCallback  Reports the progress of the download.
+
+  @retval  EFI_SUCCESS  The file was downloaded.
+  @retval  Others       The download failed on every mirror.
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+OtaDownloadFromMirrors (
+  IN  EFI_OTA_DOWNLOAD_PROTOCOL        *This,
+  IN  CHAR16                           **Urls,
+  IN  UINTN                            UrlCount,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback  OPTIONAL
+  )
+{
+  return HttpDownloadFileFromMirrors (Urls, UrlCount, BufferSize, Buffer, ProgressCallback);
+}
+
+STATIC EFI_OTA_DOWNLOAD_PROTOCOL  mOtaDownload = {
+  EFI_OTA_DOWNLOAD_PROTOCOL_REVISION,
+  OtaDownloadFile,
+  OtaDownloadStart,
+  OtaDownloadPoll,
+  OtaDownloadFinish,
+  OtaDownloadCancel,
+  OtaDownloadGetStatistics,
+  OtaDownloadFromMirrors
+};
+
+/**
+  Install the OTA download service.
+
+  @param[in]  ImageHandle  The image handle of the driver.
+  @param[in]  SystemTable  The system table.
+
+  @retval  EFI_SUCCESS  The protocol is installed.
+  @retval  Others       The protocol could not be installed.
+**/
+EFI_STATUS
+EFIAPI
+OtaDownloadDxeEntryPoint (
+  IN EFI_HANDLE        ImageHandle,
+  IN EFI_SYSTEM_TABLE  *SystemTable
+  )
+{
+  EFI_STATUS  Status;
+  EFI_HANDLE  Handle;
+
+  //
+  // Serve the requests here instead of forwarding them to ourselves, and
+  // keep the NIC selection and the connections across requests.
+  //
+  gHttpDownloadServiceMode = TRUE;
+
+  Handle = NULL;
+  Status = gBS->InstallMultipleProtocolInterfaces (
+                  &Handle,
+                  &gEfiOtaDownloadProtocolGuid,
+                  &mOtaDownload,
+                  NULL
+                  );
+  DEBUG ((DEBUG_INFO, "OtaDownloadDxe: install protocol - %r\n", Status));
+
+  return Status;
+}
@@ -0,0 +1,21 @@
+/** @file
+  GUID of the variable where HttpDownloadLib remembers the NIC and the
+  IPv4 lease of the last successful download.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef __HTTP_DOWNLOAD_LAST_NIC_GUID_H__
+#define __HTTP_DOWNLOAD_LAST_NIC_GUID_H__
+
+#define HTTP_DOWNLOAD_LAST_NIC_VARIABLE_GUID \
+  { \
+    0x90041ed1, 0x325a, 0x4834, { 0x86, 0x94, 0xaf, 0xb9, 0x37, 0xe3, 0x00, 0xae } \
+  }
+
+#define HTTP_DOWNLOAD_LAST_NIC_VARIABLE_NAME  L"HttpDownloadLastNic"
+
+extern EFI_GUID  gHttpDownloadLastNicVariableGuid;
+
+#endif
@@ -19,6 +19,347 @@ HttpDownloadFile (
   IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback OPTIONAL
   );
 
+//
+// A download running in the background, see HttpDownloadStart().
+//
+typedef struct _HTTP_DOWNLOAD_SESSION HTTP_DOWNLOAD_SESSION;
+
+/**
+  Start downloading a file in the background.
+
+  The request is sent before returning; the caller then keeps calling
+  HttpDownloadPoll() while doing other work, e.g. waiting for a key.
+
+  @param[in]   Url      Url like http://example.com/example.
+  @param[out]  Session  The new download session.
+
+  @retval  EFI_SUCCESS  The download is running.
+  @retval  Others       The download could not be started.
+**/
+EFI_STATUS
+EFIAPI
+HttpDownloadStart (
+  IN  CHAR16                 *Url,
+  OUT HTTP_DOWNLOAD_SESSION  **Session
+  );
+
+/**
+  Wait in the background for an update to be published, with one long-poll
+  request to /update.
+
+  The server holds the request until it has an update for this board or
+  WaitSeconds elapse, so the board learns of a publish within seconds while
+  sending one request per WaitSeconds. The session is polled and finished
+  like a download: HttpDownloadFinish() returns the /update response, or an
+  empty buffer when no update came in time and the long poll can be sent
+  again. A module has at most one long poll outstanding.
+
+  @param[in]   Url          The /update URL, with its query parameters.
+  @param[in]   WaitSeconds  Longest time the server holds the request, it
+                            may hold it for less.
+  @param[out]  Session      The long-poll session.
+
+  @retval  EFI_SUCCESS            The request was sent.
+  @retval  EFI_INVALID_PARAMETER  A parameter is NULL or WaitSeconds is 0.
+  @retval  EFI_ALREADY_STARTED    The long poll of this module is outstanding.
+  @retval  Others                 The request could not be sent.
+**/
+EFI_STATUS
+EFIAPI
+HttpDownloadWaitForUpdate (
+  IN  CHAR16                 *Url,
+  IN  UINTN                  WaitSeconds,
+  OUT HTTP_DOWNLOAD_SESSION  **Session
+  );
+
+/**
+  Receive the part of a background download that has arrived so far.
+
+  @retval  EFI_NOT_READY  The download is still in progress.
+  @retval  EFI_SUCCESS    The whole file has been downloaded.
+  @retval  Others         The download failed.
+**/
+EFI_STATUS
+EFIAPI
+HttpDownloadPoll (
+  IN HTTP_DOWNLOAD_SESSION  *Session
+  );
+
+/**
+  Wait for a background download to complete and free the session.
+
+  On success the caller owns the returned buffer and frees it with FreePool().
+
+  @param[in]   Session           The download session.
+  @param[out]  BufferSize        Size of the downloaded file.
+  @param[out]  Buffer            The downloaded file.
+  @param[in]   ProgressCallback  Reports the progress of the rest of the
+                                 download.
+
+  @retval  EFI_SUCCESS  The file was downloaded.
+  @retval  Others       The download failed; no buffer is returned.
+**/
+EFI_STATUS
+EFIAPI
+HttpDownloadFinish (
+  IN  HTTP_DOWNLOAD_SESSION            *Session,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback OPTIONAL
+  );
+
+/**
+  Cancel a background download and free the session and its buffer.
+**/
+VOID
+EFIAPI
+HttpDownloadCancel (
+  IN HTTP_DOWNLOAD_SESSION  *Session
+  );
+
+/**
+  Download a file available on several mirrors from the fastest one.
+
+  Every mirror is probed with a small range request and the file is
+  downloaded from the one that answered first. Should that mirror fail, the
+  download resumes on the next one from the bytes already received.
+
+  @param[in]   Urls              The URLs of the same file on each mirror.
+  @param[in]   UrlCount          Number of URLs.
+  @param[out]  BufferSize        Size of the downloaded file.
+  @param[out]  Buffer            The downloaded file, to be freed with
+                                 FreePool().
+  @param[in]   ProgressCallback  Reports the progress of the download.
+
+  @retval  EFI_SUCCESS            The file was downloaded.
+  @retval  EFI_INVALID_PARAMETER  A parameter is NULL or UrlCount is 0.
+  @retval  EFI_NO_RESPONSE        No mirror answered.
+  @retval  Others                 The download failed on every mirror.
+**/
+EFI_STATUS
+EFIAPI
+HttpDownloadFileFromMirrors (
+  IN  CHAR16                           **Urls,
+  IN  UINTN                            UrlCount,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback OPTIONAL
+  );
+
+/**
+  Receive a file sent by the server to a UDP multicast group, for many boards
+  updating at once.
+
+  The group is joined on the NIC of the last download, so that the NIC has an
+  address; the update check is a download in this sense. The blocks lost are
+  downloaded from Url with range requests afterwards.
+
+  @param[in]   Url               The URL of the same file on the server.
+  @param[in]   MulticastAddress  The group and port from the server, like
+                                 L"239.255.0.1:5001".
+  @param[in]   SessionId         The first 32 bits of the SHA-256 of the
+                                 file, which identifies it in the group.
+  @param[out]  BufferSize        Size of the file.
+  @param[out]  Buffer            The file, to be freed with FreePool().
+  @param[in]   ProgressCallback  Reports the progress of the download.
+
+  @retval  EFI_SUCCESS            The file was received.
+  @retval  EFI_INVALID_PARAMETER  A parameter is NULL or MulticastAddress is
+                                  not a multicast address.
+  @retval  EFI_TIMEOUT            The file is not being sent to the group.
+  @retval  Others                 The reception or a repair failed, the file
+                                  can still be downloaded from Url.
+**/
+EFI_STATUS
+EFIAPI
+HttpDownloadFileMulticast (
+  IN  CHAR16                           *Url,
+  IN  CHAR16                           *MulticastAddress,
+  IN  UINT32                           SessionId,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback OPTIONAL
+  );
+
+//
+// What happened to each NIC during the last NIC selection.
+//
+typedef enum {
+  HttpNicNotTried,      // The download succeeded on an earlier NIC.
+  HttpNicAttempted,     // Status is the result of the download on it.
+  HttpNicNoMedia,       // Skipped, no link.
+  HttpNicNotSelected    // Skipped, not the NIC asked for by name.
+} HTTP_DOWNLOAD_NIC_RESULT;
+
+#define HTTP_DOWNLOAD_NIC_NAME_LENGTH  32
+#define HTTP_DOWNLOAD_MAX_NICS         8
+
+typedef struct {
+  CHAR16                      Name[HTTP_DOWNLOAD_NIC_NAME_LENGTH];
+  HTTP_DOWNLOAD_NIC_RESULT    Result;
+  EFI_STATUS                  Status;
+} HTTP_DOWNLOAD_NIC_STATISTICS;
+
+typedef struct {
+  //
+  // NICs in enumeration order, the first HTTP_DOWNLOAD_MAX_NICS of them.
+  //
+  UINTN                           NicCount;
+  HTTP_DOWNLOAD_NIC_STATISTICS    Nic[HTTP_DOWNLOAD_MAX_NICS];
+} HTTP_DOWNLOAD_STATISTICS;
+
+/**
+  Get the statistics of the last download started.
+
+  @param[out]  Statistics  The statistics.
+
+  @retval  EFI_SUCCESS            Statistics is filled.
+  @retval  EFI_INVALID_PARAMETER  Statistics is NULL.
+  @retval  EFI_UNSUPPORTED        The downloads are served by an OTA download
+                                  service without statistics.
+**/
+EFI_STATUS
+EFIAPI
+HttpDownloadGetStatistics (
+  OUT HTTP_DOWNLOAD_STATISTICS  *Statistics
+  );
+
+//
+// A string of a JSON text, pointing into the text: not NUL terminated, and
+// with its escape sequences still in, see HttpDownloadJsonToUnicode(). Data
+// is NULL when the member is absent.
+//
+typedef struct {
+  CONST CHAR8    *Data;
+  UINTN          Length;
+} HTTP_DOWNLOAD_JSON_STRING;
+
+#define HTTP_DOWNLOAD_MAX_MIRRORS    8
+#define HTTP_DOWNLOAD_MAX_ENCODINGS  4
+
+//
+// A compressed variant of the image, from the "artifacts" of /update.
+//
+typedef struct {
+  HTTP_DOWNLOAD_JSON_STRING    Encoding;    // "gzip", "xz"
+  HTTP_DOWNLOAD_JSON_STRING    Url;
+  UINT64                       Size;
+  BOOLEAN                      HasSha256;
+  UINT8                        Sha256[32];
+} HTTP_DOWNLOAD_ENCODING;
+
+//
+// The /update response. Members the response does not have are left zero.
+//
+typedef struct {
+  HTTP_DOWNLOAD_JSON_STRING    Message;
+  HTTP_DOWNLOAD_JSON_STRING    Version;
+  HTTP_DOWNLOAD_JSON_STRING    ImageUrl;
+  UINT64                       ImageSize;
+  BOOLEAN                      HasSha256;
+  UINT8                        Sha256[32];
+  HTTP_DOWNLOAD_JSON_STRING    Multicast;
+  //
+  // The first HTTP_DOWNLOAD_MAX_MIRRORS mirrors.
+  //
+  UINTN                        MirrorCount;
+  HTTP_DOWNLOAD_JSON_STRING    Mirrors[HTTP_DOWNLOAD_MAX_MIRRORS];
+  //
+  // The SHA-256 of each block of ManifestBlockSize bytes of the image.
+  //
+  HTTP_DOWNLOAD_JSON_STRING    ManifestUrl;
+  UINTN                        ManifestBlockSize;
+  UINTN                        EncodingCount;
+  HTTP_DOWNLOAD_ENCODING       Encodings[HTTP_DOWNLOAD_MAX_ENCODINGS];
+} HTTP_DOWNLOAD_UPDATE_INFO;
+
+/**
+  Parse the /update response in a single pass, without allocating memory.
+
+  The strings of Info point into Json, which must be kept while they are
+  used. Members of any order and spacing are accepted, and unknown ones are
+  skipped, so the server can add new ones.
+
+  @param[in]   Json      The response body, NUL terminated or not.
+  @param[in]   JsonSize  Size of the body in bytes.
+  @param[out]  Info      The members of the response.
+
+  @retval  EFI_SUCCESS            Info is filled.
+  @retval  EFI_INVALID_PARAMETER  A parameter is NULL.
+  @retval  EFI_COMPROMISED_DATA   The body is not a JSON object, or a known
+                                  member has a value of the wrong type.
+**/
+EFI_STATUS
+EFIAPI
+HttpDownloadParseUpdate (
+  IN  CONST VOID                 *Json,
+  IN  UINTN                      JsonSize,
+  OUT HTTP_DOWNLOAD_UPDATE_INFO  *Info
+  );
+
+/**
+  Copy a string of HttpDownloadParseUpdate() to a CHAR16 buffer, decoding
+  its escape sequences.
+
+  @param[in]   String      The string.
+  @param[out]  Buffer      The NUL terminated string.
+  @param[in]   BufferSize  Size of Buffer in characters.
+
+  @retval  EFI_SUCCESS            The string was copied.
+  @retval  EFI_NOT_FOUND          The member is absent.
+  @retval  EFI_BUFFER_TOO_SMALL   The string does not fit in Buffer.
+  @retval  EFI_INVALID_PARAMETER  A parameter is NULL, or the string has an
+                                  invalid escape sequence.
+**/
+EFI_STATUS
+EFIAPI
+HttpDownloadJsonToUnicode (
+  IN  CONST HTTP_DOWNLOAD_JSON_STRING  *String,
+  OUT CHAR16                           *Buffer,
+  IN  UINTN                            BufferSize
+  );
+
+/**
+  Check an image against its block manifest, the "manifest" artifact of
+  /update: a JSON object with the block size, and the SHA-256 of each block
+  in "blocks".
+
+  The blocks are hashed on all the processors when EFI_MP_SERVICES_PROTOCOL
+  is installed, on the calling processor otherwise. The caller must not be
+  using the APs itself.
+
+  @param[in]   Image         The image.
+  @param[in]   ImageSize     Size of the image in bytes.
+  @param[in]   Manifest      The manifest, NUL terminated or not.
+  @param[in]   ManifestSize  Size of the manifest in bytes.
+  @param[out]  BadBlock      The index of the first block not matching the
+                             manifest, optional.
+
+  @retval  EFI_SUCCESS             Every block matches.
+  @retval  EFI_INVALID_PARAMETER   Image or Manifest is NULL.
+  @retval  EFI_COMPROMISED_DATA    The manifest is malformed.
+  @retval  EFI_SECURITY_VIOLATION  A block does not match, or the manifest
+                                   is for an image of another size.
+  @retval  EFI_OUT_OF_RESOURCES    Out of memory.
+**/
+EFI_STATUS
+EFIAPI
+HttpDownloadVerifyBlocks (
+  IN  CONST VOID  *Image,
+  IN  UINTN       ImageSize,
+  IN  CONST VOID  *Manifest,
+  IN  UINTN       ManifestSize,
+  OUT UINTN       *BadBlock OPTIONAL
+  );
+
 extern HTTP_DOWNLOAD_PROGRESS_CALLBACK gHttpDownloadProgressCallback;
 
+//
+// Set by the module producing EFI_OTA_DOWNLOAD_PROTOCOL. The library then
+// serves the requests itself, keeping the selected NIC and the HTTP
+// connections alive across calls. Otherwise requests are forwarded to the
+// protocol when it is installed.
+//
+extern BOOLEAN gHttpDownloadServiceMode;
+
 #endif
@@ -0,0 +1,193 @@
+/** @file
+  OTA download service protocol.
+
+  Produced by OtaDownloadDxe so that every HttpDownloadLib consumer in a boot
+  shares one NIC selection, one pool of HTTP connections and one queue of
+  outstanding downloads.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef __OTA_DOWNLOAD_PROTOCOL_H__
+#define __OTA_DOWNLOAD_PROTOCOL_H__
+
+#include <Library/HttpDownloadLib.h>
+
+#define EFI_OTA_DOWNLOAD_PROTOCOL_GUID \
+  { \
+    0xec49d996, 0x584a, 0x414c, { 0x86, 0x08, 0x41, 0x4d, 0x2a, 0x05, 0xe9, 0xf9 } \
+  }
+
+//
+// Revisions of the protocol, each adding members at the end:
+// 0x00010001  GetStatistics
+// 0x00010002  DownloadFromMirrors
+//
+#define EFI_OTA_DOWNLOAD_PROTOCOL_REVISION_STATISTICS  0x00010001
+#define EFI_OTA_DOWNLOAD_PROTOCOL_REVISION_MIRRORS     0x00010002
+
+#define EFI_OTA_DOWNLOAD_PROTOCOL_REVISION  EFI_OTA_DOWNLOAD_PROTOCOL_REVISION_MIRRORS
+
+typedef struct _EFI_OTA_DOWNLOAD_PROTOCOL EFI_OTA_DOWNLOAD_PROTOCOL;
+
+//
+// Handle of a download queued with Start().
+//
+typedef VOID *EFI_OTA_DOWNLOAD_REQUEST;
+
+/**
+  Download a file, same semantics as HttpDownloadFile().
+
+  @param[in]      This              The protocol instance.
+  @param[in]      Url               Url like http://example.com/example.
+  @param[in, out] BufferSize        Size of Buffer; 0 with a NULL Buffer only
+                                    asks for the size of the file.
+  @param[in]      Buffer            Buffer receiving the file.
+  @param[in]      ProgressCallback  Reports the progress of the download.
+
+  @retval  EFI_SUCCESS           The file was downloaded.
+  @retval  EFI_BUFFER_TOO_SMALL  BufferSize was updated with the size needed.
+  @retval  Others                The download failed.
+**/
+typedef
+EFI_STATUS
+(EFIAPI *EFI_OTA_DOWNLOAD_FILE)(
+  IN     EFI_OTA_DOWNLOAD_PROTOCOL        *This,
+  IN     CHAR16                           *Url,
+  IN OUT UINTN                            *BufferSize,
+  IN     VOID                             *Buffer           OPTIONAL,
+  IN     HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback  OPTIONAL
+  );
+
+/**
+  Queue a background download, same semantics as HttpDownloadStart().
+
+  @param[in]   This     The protocol instance.
+  @param[in]   Url      Url like http://example.com/example.
+  @param[out]  Request  Handle of the queued download.
+
+  @retval  EFI_SUCCESS  The download is queued.
+  @retval  Others       The download could not be queued.
+**/
+typedef
+EFI_STATUS
+(EFIAPI *EFI_OTA_DOWNLOAD_START)(
+  IN  EFI_OTA_DOWNLOAD_PROTOCOL  *This,
+  IN  CHAR16                     *Url,
+  OUT EFI_OTA_DOWNLOAD_REQUEST   *Request
+  );
+
+/**
+  Make progress on the queued downloads, same semantics as HttpDownloadPoll().
+
+  @param[in]  This     The protocol instance.
+  @param[in]  Request  Handle of the download.
+
+  @retval  EFI_NOT_READY  The download is queued or still in progress.
+  @retval  EFI_SUCCESS    The whole file has been downloaded.
+  @retval  Others         The download failed.
+**/
+typedef
+EFI_STATUS
+(EFIAPI *EFI_OTA_DOWNLOAD_POLL)(
+  IN EFI_OTA_DOWNLOAD_PROTOCOL  *This,
+  IN EFI_OTA_DOWNLOAD_REQUEST   Request
+  );
+
+/**
+  Wait for a queued download and release it, same semantics as
+  HttpDownloadFinish(). The caller owns the returned buffer.
+
+  @param[in]   This              The protocol instance.
+  @param[in]   Request           Handle of the download.
+  @param[out]  BufferSize        Size of the downloaded file.
+  @param[out]  Buffer            The downloaded file.
+  @param[in]   ProgressCallback  Reports the progress of the rest of the
+                                 download.
+
+  @retval  EFI_SUCCESS  The file was downloaded.
+  @retval  Others       The download failed; no buffer is returned.
+**/
+typedef
+EFI_STATUS
+(EFIAPI *EFI_OTA_DOWNLOAD_FINISH)(
+  IN  EFI_OTA_DOWNLOAD_PROTOCOL        *This,
+  IN  EFI_OTA_DOWNLOAD_REQUEST         Request,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback  OPTIONAL
+  );
+
+/**
+  Cancel a queued download and release it.
+
+  @param[in]  This     The protocol instance.
+  @param[in]  Request  Handle of the download.
+
+  @retval  EFI_SUCCESS            The download was cancelled.
+  @retval  EFI_INVALID_PARAMETER  Request is not a download of this service.
+**/
+typedef
+EFI_STATUS
+(EFIAPI *EFI_OTA_DOWNLOAD_CANCEL)(
+  IN EFI_OTA_DOWNLOAD_PROTOCOL  *This,
+  IN EFI_OTA_DOWNLOAD_REQUEST   Request
+  );
+
+/**
+  Download a file from the fastest of several mirrors, same semantics as
+  HttpDownloadFileFromMirrors().
+
+  @param[in]   This              The protocol instance.
+  @param[in]   Urls              The URLs of the same file on each mirror.
+  @param[in]   UrlCount          Number of URLs.
+  @param[out]  BufferSize        Size of the downloaded file.
+  @param[out]  Buffer            The downloaded file, owned by the caller.
+  @param[in]   ProgressCallback  Reports the progress of the download.
+
+  @retval  EFI_SUCCESS  The file was downloaded.
+  @retval  Others       The download failed on every mirror.
+**/
+typedef
+EFI_STATUS
+(EFIAPI *EFI_OTA_DOWNLOAD_FROM_MIRRORS)(
+  IN  EFI_OTA_DOWNLOAD_PROTOCOL        *This,
+  IN  CHAR16                           **Urls,
+  IN  UINTN                            UrlCount,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback  OPTIONAL
+  );
+
+/**
+  Get the statistics of the last download started, same semantics as
+  HttpDownloadGetStatistics().
+
+  @param[in]   This        The protocol instance.
+  @param[out]  Statistics  The statistics.
+
+  @retval  EFI_SUCCESS            Statistics is filled.
+  @retval  EFI_INVALID_PARAMETER  Statistics is NULL.
+**/
+typedef
+EFI_STATUS
+(EFIAPI *EFI_OTA_DOWNLOAD_GET_STATISTICS)(
+  IN  EFI_OTA_DOWNLOAD_PROTOCOL  *This,
+  OUT HTTP_DOWNLOAD_STATISTICS   *Statistics
+  );
+
+struct _EFI_OTA_DOWNLOAD_PROTOCOL {
+  UINT64                             Revision;
+  EFI_OTA_DOWNLOAD_FILE              DownloadFile;
+  EFI_OTA_DOWNLOAD_START             Start;
+  EFI_OTA_DOWNLOAD_POLL              Poll;
+  EFI_OTA_DOWNLOAD_FINISH            Finish;
+  EFI_OTA_DOWNLOAD_CANCEL            Cancel;
+  EFI_OTA_DOWNLOAD_GET_STATISTICS    GetStatistics;
+  EFI_OTA_DOWNLOAD_FROM_MIRRORS      DownloadFromMirrors;
+};
+
+extern EFI_GUID  gEfiOtaDownloadProtocolGuid;
+
+#endif
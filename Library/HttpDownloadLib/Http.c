@@ -11,8 +11,6 @@
 
 #include "Http.h"
 
-#define IP4_CONFIG2_INTERFACE_INFO_NAME_LENGTH  32
-
 //
 // Constant strings and definitions related to the message
 // indicating the amount of progress in the dowloading of a HTTP file.
@@ -45,23 +43,12 @@
   && (Code <= HTTP_STATUS_307_TEMPORARY_REDIRECT)) \
   || (Code == HTTP_STATUS_308_PERMANENT_REDIRECT))
 
-#define CLOSE_HTTP_HANDLE(ControllerHandle, HttpChildHandle) \
-  do { \
-    if (HttpChildHandle) { \
-      CloseProtocolAndDestroyServiceChild ( \
-        ControllerHandle, \
-        &gEfiHttpServiceBindingProtocolGuid, \
-        &gEfiHttpProtocolGuid, \
-        HttpChildHandle \
-        ); \
-      HttpChildHandle = NULL; \
-    } \
-  } while (0)
-
 typedef enum {
   HdrHost,
   HdrConn,
   HdrAgent,
+  HdrClientId,
+  HdrRange,
   HdrMax
 } HDR_TYPE;
 
@@ -69,6 +56,19 @@ typedef enum {
 
 #define TIMER_MAX_TIMEOUT_S  10
 
+//
+// A request the server declines with 503 is retried up to
+// HTTP_RETRY_MAX_ATTEMPTS times, after an exponential backoff starting at
+// HTTP_RETRY_BASE_DELAY seconds, or the Retry-After of the server if longer,
+// capped at HTTP_RETRY_MAX_DELAY seconds, plus a random jitter of up to half
+// of it. The delays of one download add up to HTTP_RETRY_MAX_WAIT seconds
+// at most.
+//
+#define HTTP_RETRY_MAX_ATTEMPTS  8
+#define HTTP_RETRY_BASE_DELAY    2
+#define HTTP_RETRY_MAX_DELAY     120
+#define HTTP_RETRY_MAX_WAIT      600
+
 //
 // File name to use when Uri ends with "/".
 //
@@ -143,6 +143,8 @@ STATIC BOOLEAN  gResponseCallbackComplete = FALSE;
 
 STATIC BOOLEAN  gHttpError;
 
+HTTP_DOWNLOAD_STATISTICS  gHttpDownloadStatistics;
+
 //
 // Functions declarations.
 //
@@ -220,54 +222,12 @@ NicDhcp4 (
   IN   EFI_HANDLE  ControllerHandle
   );
 
-/**
-  Create a child for the service identified by its service binding protocol GUID
-  and get from the child the interface of the protocol identified by its GUID.
-
-  @param[in]   ControllerHandle            Controller handle.
-  @param[in]   ServiceBindingProtocolGuid  Service binding protocol GUID of the
-                                           service to be created.
-  @param[in]   ProtocolGuid                GUID of the protocol to be open.
-  @param[out]  ChildHandle                 Address where the handler of the
-                                           created child is returned. NULL is
-                                           returned in case of error.
-  @param[out]  Interface                   Address where a pointer to the
-                                           protocol interface is returned in
-                                           case of success.
-
-  @retval  EFI_SUCCESS  The child was created and the protocol opened.
-  @retval  Others       Either the creation of the child or the opening
-                        of the protocol failed.
-**/
-STATIC
-EFI_STATUS
-CreateServiceChildAndOpenProtocol (
-  IN   EFI_HANDLE  ControllerHandle,
-  IN   EFI_GUID    *ServiceBindingProtocolGuid,
-  IN   EFI_GUID    *ProtocolGuid,
-  OUT  EFI_HANDLE  *ChildHandle,
-  OUT  VOID        **Interface
-  );
-
-/**
-  Close the protocol identified by its GUID on the child handle of the service
-  identified by its service binding protocol GUID, then destroy the child
-  handle.
-
-  @param[in]  ControllerHandle            Controller handle.
-  @param[in]  ServiceBindingProtocolGuid  Service binding protocol GUID of the
-                                          service to be destroyed.
-  @param[in]  ProtocolGuid                GUID of the protocol to be closed.
-  @param[in]  ChildHandle                 Handle of the child to be destroyed.
-
-**/
 STATIC
 VOID
-CloseProtocolAndDestroyServiceChild (
-  IN  EFI_HANDLE  ControllerHandle,
-  IN  EFI_GUID    *ServiceBindingProtocolGuid,
-  IN  EFI_GUID    *ProtocolGuid,
-  IN  EFI_HANDLE  ChildHandle
+RememberContextRedirect (
+  IN HTTP_DOWNLOAD_CONTEXT  *Context,
+  IN CHAR16                 *RequestUrl,
+  IN EFI_HTTP_MESSAGE       *Response
   );
 
 /**
@@ -425,7 +385,6 @@ EfiGetEpochDays (
 
   @param[in] Time: a pointer to EFI_TIME abstraction.
  **/
-STATIC
 UINTN
 EFIAPI
 EfiTimeToEpoch (
@@ -448,67 +407,40 @@ EfiTimeToEpoch (
 }
 
 /**
-  Function for 'http' command.
+  Parse the URL to download and prepare the download context for it.
 
-  @param[in] DownloadUrl        Url like http://example.com/example.
-  @param[in] NicNameIn          Specific NIC name like "eth0".
-  @param[in] LocalPortIn        LocalPort for TCP connect, Decimal.
-  @param[in] BufferSizeIn       Specific BufferSize.
-  @param[in] TimeOutMillisecIn  Specific timeout value in millsecond, 0 means auto.
+  @param[in, out] Context      The download context to initialize.
+  @param[in]      IPv4Node     The IPv4 access point referenced by the HTTP
+                               configuration data. Must outlive Context.
+  @param[in]      DownloadUrl  Url like http://example.com/example.
 
-  @retval  SHELL_SUCCESS            The 'http' command completed successfully.
-  @retval  SHELL_ABORTED            The Shell Library initialization failed.
-  @retval  SHELL_INVALID_PARAMETER  At least one of the command's arguments is
-                                    not valid.
-  @retval  SHELL_OUT_OF_RESOURCES   A memory allocation failed.
-  @retval  SHELL_NOT_FOUND          Network Interface Card not found.
-  @retval  SHELL_UNSUPPORTED        Command was valid, but the server returned
-                                    a status code indicating some error.
-                                    Examine the file requested for error body.
+  @retval  EFI_SUCCESS            The context is ready for a request.
+  @retval  EFI_INVALID_PARAMETER  DownloadUrl is NULL.
+  @retval  EFI_OUT_OF_RESOURCES   A memory allocation failed.
 **/
+STATIC
 EFI_STATUS
-EFIAPI
-RunHttp (
-  IN  CHAR16    *DownloadUrl,
-  IN  CHAR16    *NicNameIn,        OPTIONAL
-  IN  CHAR16    *LocalPortIn,      OPTIONAL
-  IN  UINTN     BufferSizeIn,      OPTIONAL
-  IN  UINT32    TimeOutMillisecIn, OPTIONAL
-  IN OUT UINTN  *DownloadBufferSize,
-  OUT UINT8     *DownloadBuffer
+InitDownloadContext (
+  IN OUT HTTP_DOWNLOAD_CONTEXT    *Context,
+  IN     EFI_HTTPv4_ACCESS_POINT  *IPv4Node,
+  IN     CHAR16                   *DownloadUrl
   )
 {
-  EFI_STATUS               Status;
-  UINTN                    HandleCount;
-  UINTN                    NicNumber;
-  UINTN                    InitialSize;
-  UINTN                    StartSize;
-  CHAR16                   NicName[IP4_CONFIG2_INTERFACE_INFO_NAME_LENGTH];
-  CHAR16                   *Walker1;
-  CHAR16                   *VStr;
-  CONST CHAR16             *UserNicName;
-  CONST CHAR16             *ValueStr;
-  CONST CHAR16             *RemoteFilePath;
-  EFI_HTTPv4_ACCESS_POINT  IPv4Node;
-  EFI_HANDLE               *Handles;
-  EFI_HANDLE               ControllerHandle;
-  HTTP_DOWNLOAD_CONTEXT    Context;
-  BOOLEAN                  NicFound;
+  UINTN         InitialSize;
+  UINTN         StartSize;
+  CHAR16        *Walker1;
+  CHAR16        *VStr;
+  CONST CHAR16  *ValueStr;
+  CONST CHAR16  *RemoteFilePath;
 
   RemoteFilePath = NULL;
-  NicFound       = FALSE;
-  Handles        = NULL;
-
-  gHttpError  = FALSE;
 
-  ZeroMem (&Context, sizeof (Context));
-
-  ZeroMem (&Context.HttpConfigData, sizeof (Context.HttpConfigData));
-  ZeroMem (&IPv4Node, sizeof (IPv4Node));
-  IPv4Node.UseDefaultAddress = TRUE;
+  ZeroMem (&Context->HttpConfigData, sizeof (Context->HttpConfigData));
+  ZeroMem (IPv4Node, sizeof (*IPv4Node));
+  IPv4Node->UseDefaultAddress = TRUE;
 
-  Context.HttpConfigData.HttpVersion          = HttpVersion11;
-  Context.HttpConfigData.AccessPoint.IPv4Node = &IPv4Node;
+  Context->HttpConfigData.HttpVersion          = HttpVersion11;
+  Context->HttpConfigData.AccessPoint.IPv4Node = IPv4Node;
 
   //
   // Get the host address (not necessarily IPv4 format).
@@ -516,48 +448,47 @@ RunHttp (
   ValueStr = DownloadUrl;
   if (!ValueStr) {
     DEBUG ((DEBUG_INFO, "Invalid argument\n"));
-    goto Error;
-  } else {
-    StartSize = 0;
-    TrimSpaces ((CHAR16 *)ValueStr);
-    if (!StrStr (ValueStr, L"://")) {
-      Context.ServerAddrAndProto = LibStrnCatGrow (
-                                     &Context.ServerAddrAndProto,
-                                     &StartSize,
-                                     DEFAULT_HTTP_PROTO,
-                                     StrLen (DEFAULT_HTTP_PROTO)
-                                     );
-      Context.ServerAddrAndProto = LibStrnCatGrow (
-                                     &Context.ServerAddrAndProto,
-                                     &StartSize,
-                                     L"://",
-                                     StrLen (L"://")
-                                     );
-      VStr = (CHAR16 *)ValueStr;
-    } else {
-      VStr = StrStr (ValueStr, L"://") + StrLen (L"://");
-    }
+    return EFI_INVALID_PARAMETER;
+  }
 
-    for (Walker1 = VStr; *Walker1; Walker1++) {
-      if (*Walker1 == L'/') {
-        break;
-      }
-    }
+  StartSize = 0;
+  TrimSpaces ((CHAR16 *)ValueStr);
+  if (!StrStr (ValueStr, L"://")) {
+    Context->ServerAddrAndProto = LibStrnCatGrow (
+                                    &Context->ServerAddrAndProto,
+                                    &StartSize,
+                                    DEFAULT_HTTP_PROTO,
+                                    StrLen (DEFAULT_HTTP_PROTO)
+                                    );
+    Context->ServerAddrAndProto = LibStrnCatGrow (
+                                    &Context->ServerAddrAndProto,
+                                    &StartSize,
+                                    L"://",
+                                    StrLen (L"://")
+                                    );
+    VStr = (CHAR16 *)ValueStr;
+  } else {
+    VStr = StrStr (ValueStr, L"://") + StrLen (L"://");
+  }
 
+  for (Walker1 = VStr; *Walker1; Walker1++) {
     if (*Walker1 == L'/') {
-      RemoteFilePath = Walker1;
+      break;
     }
+  }
 
-    Context.ServerAddrAndProto = LibStrnCatGrow (
-                                   &Context.ServerAddrAndProto,
-                                   &StartSize,
-                                   ValueStr,
-                                   StrLen (ValueStr) - StrLen (Walker1)
-                                   );
-    if (!Context.ServerAddrAndProto) {
-      Status = EFI_OUT_OF_RESOURCES;
-      goto Error;
-    }
+  if (*Walker1 == L'/') {
+    RemoteFilePath = Walker1;
+  }
+
+  Context->ServerAddrAndProto = LibStrnCatGrow (
+                                  &Context->ServerAddrAndProto,
+                                  &StartSize,
+                                  ValueStr,
+                                  StrLen (ValueStr) - StrLen (Walker1)
+                                  );
+  if (!Context->ServerAddrAndProto) {
+    return EFI_OUT_OF_RESOURCES;
   }
 
   if (!RemoteFilePath) {
@@ -569,37 +500,125 @@ RunHttp (
 
   TrimSpaces ((CHAR16 *)RemoteFilePath);
 
-  InitialSize = 0;
-  Context.Uri = LibStrnCatGrow (
-                  &Context.Uri,
-                  &InitialSize,
-                  RemoteFilePath,
-                  StrLen (RemoteFilePath)
-                  );
-  if (!Context.Uri) {
-    Status = EFI_OUT_OF_RESOURCES;
-    goto Error;
+  InitialSize  = 0;
+  Context->Uri = LibStrnCatGrow (
+                   &Context->Uri,
+                   &InitialSize,
+                   RemoteFilePath,
+                   StrLen (RemoteFilePath)
+                   );
+  if (!Context->Uri) {
+    return EFI_OUT_OF_RESOURCES;
   }
 
-  //
-  // Get the name of the Network Interface Card to be used if any.
-  //
-  UserNicName = NicNameIn;
+  Context->BufferSize = DEFAULT_BUF_SIZE;
+
+  DEBUG ((DEBUG_INFO, "ServerAddrAndProto: %s\n", Context->ServerAddrAndProto));
+  DEBUG ((DEBUG_INFO, "Uri: %s\n", Context->Uri));
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Check cheaply whether a NIC has a link, through the Adapter Information
+  media state when the NIC produces it, else the Simple Network media status.
+
+  @param[in]  ControllerHandle  The NIC.
 
-  ValueStr = LocalPortIn;
-  if (ValueStr != NULL) {
-    Context.HttpConfigData.AccessPoint.IPv4Node->LocalPort = (UINT16)StrDecimalToUintn(ValueStr);
+  @retval  TRUE   The NIC has a link, or its media state is unknown.
+  @retval  FALSE  No cable or no link.
+**/
+STATIC
+BOOLEAN
+NicHasMedia (
+  IN EFI_HANDLE  ControllerHandle
+  )
+{
+  EFI_STATUS  Status;
+  EFI_STATUS  MediaState;
+
+  MediaState = EFI_SUCCESS;
+  Status     = NetLibDetectMediaWaitTimeout (ControllerHandle, 0, &MediaState);
+  if (EFI_ERROR (Status)) {
+    return TRUE;
   }
 
-  Context.BufferSize = DEFAULT_BUF_SIZE;
-  if (BufferSizeIn != 0x0 && BufferSizeIn <= MAX_BUF_SIZE) {
-    Context.BufferSize = BufferSizeIn;
+  return (BOOLEAN)(MediaState != EFI_NO_MEDIA);
+}
+
+/**
+  Record in the download statistics what happened to a NIC.
+
+  @param[in]  NicNumber  The NIC number in the enumeration.
+  @param[in]  NicName    The NIC name.
+  @param[in]  Result     What happened to the NIC.
+  @param[in]  Status     The status of the download on it.
+**/
+STATIC
+VOID
+RecordNicResult (
+  IN UINTN                     NicNumber,
+  IN CONST CHAR16              *NicName,
+  IN HTTP_DOWNLOAD_NIC_RESULT  Result,
+  IN EFI_STATUS                Status
+  )
+{
+  HTTP_DOWNLOAD_NIC_STATISTICS  *Nic;
+
+  if (NicNumber >= HTTP_DOWNLOAD_MAX_NICS) {
+    return;
   }
 
-  Context.HttpConfigData.TimeOutMillisec = TimeOutMillisecIn;
+  Nic = &gHttpDownloadStatistics.Nic[NicNumber];
+  StrCpyS (Nic->Name, HTTP_DOWNLOAD_NIC_NAME_LENGTH, NicName);
+  Nic->Result = Result;
+  Nic->Status = Status;
+}
 
-  DEBUG ((DEBUG_INFO, "ServerAddrAndProto: %s\n", Context.ServerAddrAndProto));
-  DEBUG ((DEBUG_INFO, "Uri: %s\n", Context.Uri));
+/**
+  Run a download worker on each network interface card in turn until one of
+  them succeeds.
+
+  @param[in]   Context      A pointer to the download context.
+  @param[in]   UserNicName  Specific NIC name like "eth0", NULL for any.
+  @param[in]   Worker       The function run on each candidate NIC.
+
+  @retval  EFI_SUCCESS           The worker succeeded on one NIC.
+  @retval  EFI_BUFFER_TOO_SMALL  The worker reported the buffer size needed.
+  @retval  EFI_NOT_FOUND         No usable network interface card was found.
+  @retval  EFI_NO_MEDIA          No network interface card has a link.
+  @retval  Others                The status of the last attempt.
+**/
+STATIC
+EFI_STATUS
+RunOnNics (
+  IN HTTP_DOWNLOAD_CONTEXT  *Context,
+  IN CONST CHAR16           *UserNicName  OPTIONAL,
+  IN HTTP_NIC_WORKER        Worker
+  )
+{
+  EFI_STATUS     Status;
+  EFI_STATUS     AttemptStatus;
+  UINTN          HandleCount;
+  UINTN          NicNumber;
+  UINTN          FirstNic;
+  UINTN          Attempt;
+  UINTN          Front;
+  UINTN          Back;
+  UINTN          *Order;
+  CHAR16         NicName[IP4_CONFIG2_INTERFACE_INFO_NAME_LENGTH];
+  EFI_HANDLE     *Handles;
+  EFI_HANDLE     ControllerHandle;
+  BOOLEAN        NicFound;
+  BOOLEAN        UseLastLease;
+  HTTP_LAST_NIC  *LastNic;
+
+  NicFound = FALSE;
+  Handles  = NULL;
+  Order    = NULL;
+  LastNic  = NULL;
+
+  ZeroMem (&gHttpDownloadStatistics, sizeof (gHttpDownloadStatistics));
 
   //
   // Locate all HTTP Service Binding protocols.
@@ -616,23 +635,72 @@ RunHttp (
     if (!EFI_ERROR (Status)) {
       Status = EFI_NOT_FOUND;
     }
-    goto Error;
+
+    return Status;
   }
 
-  Status = EFI_NOT_FOUND;
+  gHttpDownloadStatistics.NicCount = MIN (HandleCount, HTTP_DOWNLOAD_MAX_NICS);
 
-  Context.DownloadBufferSize = *DownloadBufferSize;
-  Context.DownloadBuffer = DownloadBuffer;
-  if (*DownloadBufferSize == 0 && DownloadBuffer == NULL) {
-    Context.HttpMethod = HttpMethodHead;
-  } else {
-    Context.HttpMethod = HttpMethodGet;
+  Order = AllocatePool (HandleCount * sizeof (UINTN));
+  if (Order == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto ON_EXIT;
+  }
+
+  //
+  // Start with the NIC that served the previous download, in this boot or
+  // else in a previous one. The NIC numbers used for the names stay those of
+  // the enumeration.
+  //
+  GetLastNic (&LastNic);
+
+  for (FirstNic = 0; FirstNic < HandleCount; FirstNic++) {
+    if (Handles[FirstNic] == gPreferredNicHandle) {
+      break;
+    }
+  }
+
+  if ((FirstNic == HandleCount) && (LastNic != NULL)) {
+    for (FirstNic = 0; FirstNic < HandleCount; FirstNic++) {
+      if (IsLastNic (LastNic, Handles[FirstNic])) {
+        break;
+      }
+    }
+  }
+
+  if (FirstNic == HandleCount) {
+    FirstNic = 0;
+  }
+
+  //
+  // NICs without a link go last instead of each waiting for the DHCP
+  // timeout, keeping the order among NICs of the same kind.
+  //
+  Front = 0;
+  Back  = HandleCount;
+  for (Attempt = 0; Attempt < HandleCount; Attempt++) {
+    NicNumber = (FirstNic + Attempt) % HandleCount;
+    if (NicHasMedia (Handles[NicNumber])) {
+      Order[Front++] = NicNumber;
+    } else {
+      Order[--Back] = NicNumber;
+    }
+  }
+
+  for (Attempt = 0; Attempt < (HandleCount - Front) / 2; Attempt++) {
+    NicNumber                        = Order[Front + Attempt];
+    Order[Front + Attempt]           = Order[HandleCount - 1 - Attempt];
+    Order[HandleCount - 1 - Attempt] = NicNumber;
   }
 
-  for (NicNumber = 0;
-       (NicNumber < HandleCount) && (Status != EFI_SUCCESS);
-       NicNumber++)
+  Status        = EFI_NOT_FOUND;
+  AttemptStatus = EFI_NO_MEDIA;
+
+  for (Attempt = 0;
+       (Attempt < HandleCount) && (Status != EFI_SUCCESS);
+       Attempt++)
   {
+    NicNumber        = Order[Attempt];
     ControllerHandle = Handles[NicNumber];
 
     Status = GetNicName (ControllerHandle, NicNumber, NicName);
@@ -641,10 +709,9 @@ RunHttp (
       continue;
     }
 
-    Status = NicDhcp4 (ControllerHandle);
-
     if (UserNicName != NULL) {
       if (StrCmp (NicName, UserNicName) != 0) {
+        RecordNicResult (NicNumber, NicName, HttpNicNotSelected, EFI_NOT_FOUND);
         Status = EFI_NOT_FOUND;
         continue;
       }
@@ -652,13 +719,63 @@ RunHttp (
       NicFound = TRUE;
     }
 
-    Status = DownloadFile (&Context, ControllerHandle, NicName);
+    //
+    // Check again, the link may have come up while other NICs were tried.
+    //
+    if (!NicHasMedia (ControllerHandle)) {
+      DEBUG ((DEBUG_INFO, "Skipping %s, no media\n", NicName));
+      RecordNicResult (NicNumber, NicName, HttpNicNoMedia, EFI_NO_MEDIA);
+      Status = AttemptStatus;
+      continue;
+    }
+
+    UseLastLease = (BOOLEAN)(  (LastNic != NULL)
+                            && IsLastNic (LastNic, ControllerHandle)
+                            && IsLastNicLeaseValid (LastNic, Context->ServerAddrAndProto));
+    Context->Report.DhcpMs = GetReportClock ();
+    if (UseLastLease) {
+      Status = ApplyLastNicLease (ControllerHandle, LastNic);
+      if (EFI_ERROR (Status)) {
+        UseLastLease = FALSE;
+      }
+    }
+
+    if (!UseLastLease) {
+      Status = NicDhcp4 (ControllerHandle);
+    }
+
+    Context->Report.DhcpMs      = GetReportClock () - Context->Report.DhcpMs;
+    Context->Report.CachedLease = UseLastLease;
+
+    Status = Worker (Context, ControllerHandle, NicName);
+    if (  UseLastLease && EFI_ERROR (Status)
+       && (Status != EFI_BUFFER_TOO_SMALL) && !gHttpError)
+    {
+      //
+      // The cached lease no longer reaches the server, get a new one.
+      //
+      DEBUG ((DEBUG_INFO, "Cached lease failed on %s - %r, falling back to DHCP\n", NicName, Status));
+      ForgetLastNic ();
+      LIB_FREE_NON_NULL (LastNic);
+      Context->Report.DhcpMs = GetReportClock ();
+      NicDhcp4 (ControllerHandle);
+      Context->Report.DhcpMs      = GetReportClock () - Context->Report.DhcpMs;
+      Context->Report.CachedLease = FALSE;
+      Status                      = Worker (Context, ControllerHandle, NicName);
+    }
+
+    RecordNicResult (NicNumber, NicName, HttpNicAttempted, Status);
+    AttemptStatus = Status;
+
+    if (!EFI_ERROR (Status)) {
+      gPreferredNicHandle = ControllerHandle;
+      SaveLastNic (ControllerHandle, Context->ServerAddrAndProto, LastNic);
+    }
 
     if (EFI_ERROR (Status)) {
-      DEBUG ((DEBUG_ERROR, "Unable to download the file %s on %s - %r\n", RemoteFilePath, NicName, Status));
+      DEBUG ((DEBUG_ERROR, "Unable to download the file %s on %s - %r\n", Context->Uri, NicName, Status));
       if (Status == EFI_BUFFER_TOO_SMALL) {
-        *DownloadBufferSize = Context.DownloadBufferSize;
-        goto Error;
+        break;
       }
     }
 
@@ -675,44 +792,134 @@ RunHttp (
     DEBUG ((DEBUG_INFO, "Network Interface Card %s not found.\n", UserNicName));
   }
 
-  if (!EFI_ERROR (Status)) {
-    DEBUG ((DEBUG_INFO, "DownloadedBufferSize: 0x%x\n", Context.ContentDownloaded));
-    *DownloadBufferSize = Context.ContentDownloaded;
-  }
-
-Error:
+ON_EXIT:
+  LIB_FREE_NON_NULL (Order);
   LIB_FREE_NON_NULL (Handles);
-  LIB_FREE_NON_NULL (Context.ServerAddrAndProto);
-  LIB_FREE_NON_NULL (Context.Uri);
+  LIB_FREE_NON_NULL (LastNic);
 
   return Status;
 }
 
-
 /**
-  Get the name of the NIC.
+  Function for 'http' command.
 
-  @param[in]   ControllerHandle  The network physical device handle.
-  @param[in]   NicNumber         The network physical device number.
-  @param[out]  NicName           Address where to store the NIC name.
-                                 The memory area has to be at least
-                                 IP4_CONFIG2_INTERFACE_INFO_NAME_LENGTH
-                                 double byte wide.
+  @param[in] DownloadUrl        Url like http://example.com/example.
+  @param[in] NicNameIn          Specific NIC name like "eth0".
+  @param[in] LocalPortIn        LocalPort for TCP connect, Decimal.
+  @param[in] BufferSizeIn       Specific BufferSize.
+  @param[in] TimeOutMillisecIn  Specific timeout value in millsecond, 0 means auto.
 
-  @retval  EFI_SUCCESS  The name of the NIC was returned.
-  @retval  Others       The creation of the child for the Managed
-                        Network Service failed or the opening of
-                        the Managed Network Protocol failed or
-                        the operational parameters for the
-                        Managed Network Protocol could not be
-                        read.
+  @retval  SHELL_SUCCESS            The 'http' command completed successfully.
+  @retval  SHELL_ABORTED            The Shell Library initialization failed.
+  @retval  SHELL_INVALID_PARAMETER  At least one of the command's arguments is
+                                    not valid.
+  @retval  SHELL_OUT_OF_RESOURCES   A memory allocation failed.
+  @retval  SHELL_NOT_FOUND          Network Interface Card not found.
+  @retval  SHELL_UNSUPPORTED        Command was valid, but the server returned
+                                    a status code indicating some error.
+                                    Examine the file requested for error body.
 **/
-STATIC
 EFI_STATUS
-GetNicName (
-  IN   EFI_HANDLE  ControllerHandle,
-  IN   UINTN       NicNumber,
-  OUT  CHAR16      *NicName
+EFIAPI
+RunHttp (
+  IN  CHAR16    *DownloadUrl,
+  IN  CHAR16    *NicNameIn,        OPTIONAL
+  IN  CHAR16    *LocalPortIn,      OPTIONAL
+  IN  UINTN     BufferSizeIn,      OPTIONAL
+  IN  UINT32    TimeOutMillisecIn, OPTIONAL
+  IN OUT UINTN  *DownloadBufferSize,
+  OUT UINT8     *DownloadBuffer
+  )
+{
+  EFI_STATUS               Status;
+  EFI_HTTPv4_ACCESS_POINT  IPv4Node;
+  HTTP_DOWNLOAD_CONTEXT    Context;
+  CHAR16                   *Redirected;
+
+  gHttpError  = FALSE;
+
+  ZeroMem (&Context, sizeof (Context));
+
+  //
+  // Go straight to the mirror a server redirected the same directory to.
+  //
+  Redirected = ResolveRedirect (DownloadUrl);
+  Context.CachedRedirect = (BOOLEAN)(Redirected != NULL);
+
+  Status = InitDownloadContext (&Context, &IPv4Node, (Redirected != NULL) ? Redirected : DownloadUrl);
+  if (EFI_ERROR (Status)) {
+    goto Error;
+  }
+
+  if (LocalPortIn != NULL) {
+    Context.HttpConfigData.AccessPoint.IPv4Node->LocalPort = (UINT16)StrDecimalToUintn(LocalPortIn);
+  }
+
+  if (BufferSizeIn != 0x0 && BufferSizeIn <= MAX_BUF_SIZE) {
+    Context.BufferSize = BufferSizeIn;
+  }
+
+  Context.HttpConfigData.TimeOutMillisec = TimeOutMillisecIn;
+  Context.ProgressCallback               = gHttpDownloadProgressCallback;
+
+  Context.DownloadBufferSize = *DownloadBufferSize;
+  Context.DownloadBuffer = DownloadBuffer;
+  if (*DownloadBufferSize == 0 && DownloadBuffer == NULL) {
+    Context.HttpMethod = HttpMethodHead;
+  } else {
+    Context.HttpMethod = HttpMethodGet;
+  }
+
+  Status = RunOnNics (&Context, NicNameIn, DownloadFile);
+  if (Status == EFI_BUFFER_TOO_SMALL) {
+    *DownloadBufferSize = Context.DownloadBufferSize;
+  } else if (!EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "DownloadedBufferSize: 0x%x\n", Context.ContentDownloaded));
+    *DownloadBufferSize = Context.ContentDownloaded;
+  }
+
+Error:
+  LIB_FREE_NON_NULL (Context.ServerAddrAndProto);
+  LIB_FREE_NON_NULL (Context.Uri);
+  LIB_FREE_NON_NULL (Redirected);
+
+  //
+  // The mirror may be gone before the redirection expired: ask the server
+  // again, once, since the redirection is forgotten.
+  //
+  if (Context.CachedRedirect && EFI_ERROR (Status) && (Status != EFI_BUFFER_TOO_SMALL) && !gHttpError) {
+    ForgetRedirect (DownloadUrl);
+    Status = RunHttp (DownloadUrl, NicNameIn, LocalPortIn, BufferSizeIn, TimeOutMillisecIn, DownloadBufferSize, DownloadBuffer);
+  }
+
+  return Status;
+}
+
+
+/**
+  Get the name of the NIC.
+
+  @param[in]   ControllerHandle  The network physical device handle.
+  @param[in]   NicNumber         The network physical device number.
+  @param[out]  NicName           Address where to store the NIC name.
+                                 The memory area has to be at least
+                                 IP4_CONFIG2_INTERFACE_INFO_NAME_LENGTH
+                                 double byte wide.
+
+  @retval  EFI_SUCCESS  The name of the NIC was returned.
+  @retval  Others       The creation of the child for the Managed
+                        Network Service failed or the opening of
+                        the Managed Network Protocol failed or
+                        the operational parameters for the
+                        Managed Network Protocol could not be
+                        read.
+**/
+STATIC
+EFI_STATUS
+GetNicName (
+  IN   EFI_HANDLE  ControllerHandle,
+  IN   UINTN       NicNumber,
+  OUT  CHAR16      *NicName
   )
 {
   EFI_STATUS                    Status;
@@ -923,7 +1130,6 @@ Error:
   @retval  Others       Either the creation of the child or the opening
                         of the protocol failed.
 **/
-STATIC
 EFI_STATUS
 CreateServiceChildAndOpenProtocol (
   IN   EFI_HANDLE  ControllerHandle,
@@ -976,7 +1182,6 @@ CreateServiceChildAndOpenProtocol (
   @param[in]  ProtocolGuid                GUID of the protocol to be closed.
   @param[in]  ChildHandle                 Handle of the child to be destroyed.
 **/
-STATIC
 VOID
 CloseProtocolAndDestroyServiceChild (
   IN  EFI_HANDLE  ControllerHandle,
@@ -1087,6 +1292,151 @@ WaitForCompletion (
   return Status;
 }
 
+/**
+  Get the identifier sent in the X-Client-Id header: the MAC address of the
+  NIC, as "xx:xx:xx:xx:xx:xx".
+
+  @param[in]   ControllerHandle  The NIC.
+  @param[out]  ClientId          The identifier.
+  @param[in]   ClientIdSize      Size of ClientId, at least
+                                 HTTP_CLIENT_ID_SIZE.
+
+  @retval  EFI_SUCCESS  The identifier was returned.
+  @retval  Others       The MAC address of the NIC is not known.
+**/
+EFI_STATUS
+GetClientId (
+  IN  EFI_HANDLE  ControllerHandle,
+  OUT CHAR8       *ClientId,
+  IN  UINTN       ClientIdSize
+  )
+{
+  EFI_STATUS       Status;
+  EFI_MAC_ADDRESS  MacAddress;
+  UINTN            HwAddressSize;
+  UINTN            Index;
+
+  if (ControllerHandle == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  Status = NetLibGetMacAddress (ControllerHandle, &MacAddress, &HwAddressSize);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if ((HwAddressSize == 0) || (HwAddressSize * 3 > ClientIdSize)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  for (Index = 0; Index < HwAddressSize; Index++) {
+    AsciiSPrint (ClientId + Index * 3, ClientIdSize - Index * 3, "%02x:", MacAddress.Addr[Index]);
+  }
+
+  //
+  // Drop the last colon.
+  //
+  ClientId[HwAddressSize * 3 - 1] = '\0';
+  return EFI_SUCCESS;
+}
+
+/**
+  Compute how long to wait before repeating a request the server declined
+  with 503.
+
+  The jitter mixes the time with the MAC address of the NIC, so that boards
+  declined together do not come back together.
+
+  @param[in]  Context  The download context, with the Retry-After of the
+                       server.
+  @param[in]  Attempt  Number of retries already done.
+  @param[in]  Waited   Seconds already waited before those retries.
+
+  @return  The delay in seconds, 0 when the request must not be retried.
+**/
+STATIC
+UINTN
+GetRetryDelay (
+  IN HTTP_DOWNLOAD_CONTEXT  *Context,
+  IN UINTN                  Attempt,
+  IN UINTN                  Waited
+  )
+{
+  UINTN            Delay;
+  UINT32           Random;
+  UINT32           Crc;
+  UINT64           Count;
+  EFI_TIME         Time;
+  EFI_MAC_ADDRESS  MacAddress;
+  UINTN            HwAddressSize;
+
+  if ((Attempt >= HTTP_RETRY_MAX_ATTEMPTS) || (Waited >= HTTP_RETRY_MAX_WAIT)) {
+    return 0;
+  }
+
+  Delay = HTTP_RETRY_BASE_DELAY << MIN (Attempt, 16);
+  Delay = MAX (Delay, Context->RetryAfter);
+  Delay = MIN (Delay, HTTP_RETRY_MAX_DELAY);
+
+  Random = 0;
+  if (!EFI_ERROR (gBS->GetNextMonotonicCount (&Count))) {
+    Random ^= (UINT32)Count;
+  }
+
+  if (!EFI_ERROR (gRT->GetTime (&Time, NULL))) {
+    Random ^= Time.Nanosecond ^ (Time.Second * 1103515245);
+  }
+
+  if (  (Context->ControllerHandle != NULL)
+     && !EFI_ERROR (NetLibGetMacAddress (Context->ControllerHandle, &MacAddress, &HwAddressSize))
+     && !EFI_ERROR (gBS->CalculateCrc32 (&MacAddress, HwAddressSize, &Crc)))
+  {
+    Random ^= Crc;
+  }
+
+  return MIN (Delay + Random % (Delay / 2 + 1), HTTP_RETRY_MAX_WAIT - Waited);
+}
+
+/**
+  Wait before repeating a request the server declined, giving up early when
+  ESC is pressed.
+
+  @param[in]  Seconds  Time to wait.
+
+  @retval  EFI_SUCCESS  The time elapsed.
+  @retval  EFI_ABORTED  ESC was pressed.
+  @retval  Others       The timer could not be created.
+**/
+STATIC
+EFI_STATUS
+WaitRetryDelay (
+  IN UINTN  Seconds
+  )
+{
+  EFI_STATUS     Status;
+  EFI_EVENT      Timer;
+  EFI_INPUT_KEY  Key;
+
+  Status = gBS->CreateEvent (EVT_TIMER, TPL_CALLBACK, NULL, NULL, &Timer);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  gBS->SetTimer (Timer, TimerRelative, EFI_TIMER_PERIOD_SECONDS (Seconds));
+  while (EFI_ERROR (gBS->CheckEvent (Timer))) {
+    if (  (gST->ConIn != NULL)
+       && !EFI_ERROR (gST->ConIn->ReadKeyStroke (gST->ConIn, &Key))
+       && (Key.ScanCode == SCAN_ESC))
+    {
+      Status = EFI_ABORTED;
+      break;
+    }
+  }
+
+  gBS->CloseEvent (Timer);
+  return Status;
+}
+
 /**
   Generate and send a request to the http server.
 
@@ -1114,6 +1464,8 @@ SendRequest (
   EFI_STATUS             Status;
   CHAR16                 *Host;
   UINTN                  StringSize;
+  CHAR8                  Range[48];
+  CHAR8                  ClientId[HTTP_CLIENT_ID_SIZE];
 
   ZeroMem (&RequestData, sizeof (RequestData));
   ZeroMem (&RequestHeader, sizeof (RequestHeader));
@@ -1154,9 +1506,30 @@ SendRequest (
     StringSize
     );
 
-  RequestHeader[HdrConn].FieldValue  = "close";
+  RequestHeader[HdrConn].FieldValue  = gHttpDownloadServiceMode ? "keep-alive" : "close";
   RequestHeader[HdrAgent].FieldValue = USER_AGENT_HDR;
-  RequestMessage.HeaderCount         = HdrMax;
+  RequestMessage.HeaderCount         = HdrClientId;
+
+  //
+  // Lets the server place this board in a rollout cohort.
+  //
+  if (!EFI_ERROR (GetClientId (Context->ControllerHandle, ClientId, sizeof (ClientId)))) {
+    RequestHeader[RequestMessage.HeaderCount].FieldName  = "X-Client-Id";
+    RequestHeader[RequestMessage.HeaderCount].FieldValue = ClientId;
+    RequestMessage.HeaderCount++;
+  }
+
+  if ((Context->RangeStart != 0) || (Context->RangeLength != 0)) {
+    if (Context->RangeLength != 0) {
+      AsciiSPrint (Range, sizeof (Range), "bytes=%Lu-%Lu", (UINT64)Context->RangeStart, (UINT64)(Context->RangeStart + Context->RangeLength - 1));
+    } else {
+      AsciiSPrint (Range, sizeof (Range), "bytes=%Lu-", (UINT64)Context->RangeStart);
+    }
+
+    RequestHeader[RequestMessage.HeaderCount].FieldName  = "Range";
+    RequestHeader[RequestMessage.HeaderCount].FieldValue = Range;
+    RequestMessage.HeaderCount++;
+  }
 
   RequestData.Method = Context->HttpMethod;
   RequestData.Url    = DownloadUrl;
@@ -1244,7 +1617,11 @@ SavePortion (
     // DEBUG ((DEBUG_INFO, "%s       0 Kb\n", HTTP_PROGR_FRAME));
   }
 
-  Context->ContentDownloaded += MIN (DownloadLen, Context->DownloadBufferSize - Context->ContentDownloaded);
+  //
+  // The bytes past the end of the buffer are counted but dropped, so that
+  // a body without a Content-Length reports the size it needs.
+  //
+  Context->ContentDownloaded += DownloadLen;
   NbOfKb                      = Context->ContentDownloaded >> 10;
 
   Progress[0] = L'\0';
@@ -1291,8 +1668,8 @@ SavePortion (
     NbOfKb
     );
 
-  if (gHttpDownloadProgressCallback != NULL) {
-    gHttpDownloadProgressCallback (Progress);
+  if (Context->ProgressCallback != NULL) {
+    Context->ProgressCallback (Progress);
   } else {
     DEBUG ((DEBUG_INFO, "%s\n", Progress));
   }
@@ -1515,6 +1892,8 @@ ParseMsg (
   @param[in]   DownloadUrl     A pointer to the fully qualified URL to download.
 
   @retval  EFI_SUCCESS         Valid file. Body successfully collected.
+  @retval  EFI_BUFFER_TOO_SMALL  The file is larger than the download buffer,
+                               whose size is updated to the file size.
   @retval  EFI_HTTP_ERROR      Response is a valid HTTP response, but the
                                HTTP server
                                indicated an error (HTTP code >= 400).
@@ -1548,6 +1927,7 @@ GetResponse (
   Context->ResponseToken.Message = &ResponseMessage;
   Context->ContentLength         = 0;
   Context->Status                = REQ_OK;
+  Context->ServerBusy            = FALSE;
   Status                         = EFI_SUCCESS;
   MsgParser                      = NULL;
   ResponseData.StatusCode        = HTTP_STATUS_UNSUPPORTED_STATUS;
@@ -1613,6 +1993,8 @@ GetResponse (
           Status = SetHostURI (Header->FieldValue, Context, DownloadUrl);
           if (Status == EFI_NO_MAPPING) {
             DEBUG ((DEBUG_WARN, "%s reports '%s' for %s\n", Context->ServerAddrAndProto, L"Recursive HTTP server relocation", Context->Uri));
+          } else if (!EFI_ERROR (Status)) {
+            RememberContextRedirect (Context, DownloadUrl, &ResponseMessage);
           }
         } else {
           //
@@ -1679,7 +2061,29 @@ GetResponse (
             DescNum[3] = '\0';
             Context->Status = StrDecimalToUintn (DescNum);
             Status          = ENCODE_ERROR (Context->Status);
+
+            if (ResponseData.StatusCode == HTTP_STATUS_503_SERVICE_UNAVAILABLE) {
+              //
+              // Only the delay-seconds form of Retry-After is honoured, an
+              // HTTP-date reads as 0 and leaves the backoff alone.
+              //
+              Context->ServerBusy = TRUE;
+              Header              = HttpFindHeader (
+                                      ResponseMessage.HeaderCount,
+                                      ResponseMessage.Headers,
+                                      "Retry-After"
+                                      );
+              Context->RetryAfter = (Header != NULL) ? AsciiStrDecimalToUintn (Header->FieldValue) : 0;
+            }
           }
+        } else if (Context->DownloadBufferSize < Context->ContentLength) {
+          //
+          // Give the size of the file rather than a part of it. The body is
+          // left unread, which leaves the connection unusable.
+          //
+          Context->DownloadBufferSize = Context->ContentLength;
+          Status                      = EFI_BUFFER_TOO_SMALL;
+          break;
         }
       } else {
         HttpGetEntityLength (MsgParser, &Context->ContentLength);
@@ -1707,6 +2111,16 @@ GetResponse (
           && !EFI_ERROR (Status)
           && ResponseMessage.BodyLength);
 
+  //
+  // A chunked body is only known too large once it is all read.
+  //
+  if (  !EFI_ERROR (Status) && !gHttpError && (Context->HttpMethod == HttpMethodGet)
+     && (Context->ContentDownloaded > Context->DownloadBufferSize))
+  {
+    Context->DownloadBufferSize = Context->ContentDownloaded;
+    Status                      = EFI_BUFFER_TOO_SMALL;
+  }
+
   LIB_FREE_NON_NULL (MsgParser);
   if (Context->ResponseToken.Event) {
     gBS->CloseEvent (Context->ResponseToken.Event);
@@ -1716,6 +2130,75 @@ GetResponse (
   return Status;
 }
 
+/**
+  Build the fully qualified URL of the current request from the server
+  address and the Uri held by the download context.
+
+  @param[in]   Context           A pointer to the HTTP download context.
+
+  @return  The URL, to be freed by the caller, or NULL if out of memory.
+**/
+STATIC
+CHAR16 *
+BuildDownloadUrl (
+  IN HTTP_DOWNLOAD_CONTEXT  *Context
+  )
+{
+  CHAR16  *DownloadUrl;
+  UINTN   UrlSize;
+
+  DownloadUrl = NULL;
+  UrlSize     = 0;
+  DownloadUrl = LibStrnCatGrow (
+                  &DownloadUrl,
+                  &UrlSize,
+                  Context->ServerAddrAndProto,
+                  StrLen (Context->ServerAddrAndProto)
+                  );
+  if (Context->Uri[0] != L'/') {
+    DownloadUrl = LibStrnCatGrow (
+                    &DownloadUrl,
+                    &UrlSize,
+                    L"/",
+                    StrLen (Context->ServerAddrAndProto)
+                    );
+  }
+
+  DownloadUrl = LibStrnCatGrow (
+                  &DownloadUrl,
+                  &UrlSize,
+                  Context->Uri,
+                  StrLen (Context->Uri)
+                  );
+
+  return DownloadUrl;
+}
+
+/**
+  Remember the redirection a server has just answered, for the next requests
+  of the same directory.
+
+  @param[in]  Context     The download context, with the new location.
+  @param[in]  RequestUrl  The URL of the request redirected.
+  @param[in]  Response    The redirection response.
+**/
+STATIC
+VOID
+RememberContextRedirect (
+  IN HTTP_DOWNLOAD_CONTEXT  *Context,
+  IN CHAR16                 *RequestUrl,
+  IN EFI_HTTP_MESSAGE       *Response
+  )
+{
+  CHAR16  *Target;
+
+  Target = BuildDownloadUrl (Context);
+  if (Target != NULL) {
+    RememberRedirect (RequestUrl, Target, Response);
+    FreePool (Target);
+  }
+}
+
 /**
   Worker function that downloads the data of a file from an HTTP server given
   the path of the file and its size.
@@ -1740,18 +2223,24 @@ DownloadFile (
   IN CHAR16                 *NicName
   )
 {
-  EFI_STATUS  Status;
-  CHAR16      *DownloadUrl;
-  UINTN       UrlSize;
-  EFI_HANDLE  HttpChildHandle;
+  EFI_STATUS       Status;
+  CHAR16           *DownloadUrl;
+  HTTP_CONNECTION  *Connection;
+  UINTN            Attempt;
+  UINTN            Waited;
+  UINTN            Delay;
+  CHAR16           Message[64];
+  BOOLEAN          Reusable;
 
   ASSERT (Context);
   if (Context == NULL) {
     return EFI_INVALID_PARAMETER;
   }
 
-  DownloadUrl     = NULL;
-  HttpChildHandle = NULL;
+  DownloadUrl = NULL;
+  Connection  = NULL;
+  Attempt     = 0;
+  Waited      = 0;
 
   Context->Buffer = AllocatePool (Context->BufferSize);
   if (Context->Buffer == NULL) {
@@ -1762,50 +2251,23 @@ DownloadFile (
   do {
     LIB_FREE_NON_NULL (DownloadUrl);
 
-    CLOSE_HTTP_HANDLE (ControllerHandle, HttpChildHandle);
-
-    Status = CreateServiceChildAndOpenProtocol (
-               ControllerHandle,
-               &gEfiHttpServiceBindingProtocolGuid,
-               &gEfiHttpProtocolGuid,
-               &HttpChildHandle,
-               (VOID **)&Context->Http
-               );
+    //
+    // A redirected request leaves the connection with an unread body.
+    //
+    ReleaseHttpConnection (Connection, FALSE);
 
+    Status = AcquireHttpConnection (Context, ControllerHandle, &Connection);
     if (EFI_ERROR (Status)) {
       DEBUG ((DEBUG_INFO, "Unable to open HTTP protocol on %s - %r\n", NicName, Status));
       goto ON_EXIT;
     }
 
-    Status = Context->Http->Configure (Context->Http, &Context->HttpConfigData);
-    if (EFI_ERROR (Status)) {
-      DEBUG ((DEBUG_INFO, "Unable to configure HTTP protocol on %s - %r\n", NicName, Status));
+    DownloadUrl = BuildDownloadUrl (Context);
+    if (DownloadUrl == NULL) {
+      Status = EFI_OUT_OF_RESOURCES;
       goto ON_EXIT;
     }
 
-    UrlSize     = 0;
-    DownloadUrl = LibStrnCatGrow (
-                    &DownloadUrl,
-                    &UrlSize,
-                    Context->ServerAddrAndProto,
-                    StrLen (Context->ServerAddrAndProto)
-                    );
-    if (Context->Uri[0] != L'/') {
-      DownloadUrl = LibStrnCatGrow (
-                      &DownloadUrl,
-                      &UrlSize,
-                      L"/",
-                      StrLen (Context->ServerAddrAndProto)
-                      );
-    }
-
-    DownloadUrl = LibStrnCatGrow (
-                    &DownloadUrl,
-                    &UrlSize,
-                    Context->Uri,
-                    StrLen (Context->Uri)
-                    );
-
     DEBUG ((DEBUG_INFO, "Downloading %s\n", DownloadUrl));
 
     Status = SendRequest (Context, DownloadUrl);
@@ -1815,6 +2277,41 @@ DownloadFile (
 
     Status = GetResponse (Context, DownloadUrl);
 
+    Delay = Context->ServerBusy ? GetRetryDelay (Context, Attempt, Waited) : 0;
+    if (Delay != 0) {
+      //
+      // Too many boards are downloading, come back later rather than
+      // reporting that there is nothing to download.
+      //
+      Attempt++;
+      Waited += Delay;
+
+      UnicodeSPrint (Message, sizeof (Message), L"Server busy, retrying in %d s, ESC to give up", Delay);
+      if (Context->ProgressCallback != NULL) {
+        Context->ProgressCallback (Message);
+      } else {
+        DEBUG ((DEBUG_INFO, "%s\n", Message));
+      }
+
+      //
+      // On ESC the 503 stands, and gHttpError keeps the other NICs from
+      // being tried.
+      //
+      Status = WaitRetryDelay (Delay);
+      if (EFI_ERROR (Status)) {
+        goto ON_EXIT;
+      }
+
+      //
+      // Drop the error body saved as if it was the file.
+      //
+      gHttpError                     = FALSE;
+      Context->ContentDownloaded     = 0;
+      Context->LastReportedNbOfBytes = 0;
+      Context->Status                = REQ_NEED_REPEAT;
+      continue;
+    }
+
     if (Status) {
       goto ON_EXIT;
     }
@@ -1829,11 +2326,872 @@ ON_EXIT:
   LIB_FREE_NON_NULL (DownloadUrl);
   LIB_FREE_NON_NULL (Context->Buffer);
 
-  CLOSE_HTTP_HANDLE (ControllerHandle, HttpChildHandle);
+  Reusable = (BOOLEAN)(!EFI_ERROR (Status) || (Status == EFI_BUFFER_TOO_SMALL));
+  if (  (Status == EFI_BUFFER_TOO_SMALL) && (Context->HttpMethod == HttpMethodGet)
+     && (Context->ContentDownloaded != Context->DownloadBufferSize))
+  {
+    //
+    // The GET was answered from the headers, its body is left unread.
+    //
+    Reusable = FALSE;
+  }
+
+  ReleaseHttpConnection (Connection, Reusable);
 
   return Status;
 }
 
+/**
+  Callback to set the response completion flag of a download session.
+
+  @param[in] Event:   The event.
+  @param[in] Context: pointer to the download session.
+ **/
+STATIC
+VOID
+EFIAPI
+SessionResponseCallback (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  ((HTTP_DOWNLOAD_SESSION *)Context)->ResponseComplete = TRUE;
+}
+
+/**
+  Release the network resources held by a download session: the pending
+  response token, the message parser and the HTTP child.
+
+  @param[in]  Session  The download session.
+**/
+STATIC
+VOID
+CloseSessionHttp (
+  IN HTTP_DOWNLOAD_SESSION  *Session
+  )
+{
+  HTTP_DOWNLOAD_CONTEXT  *Context;
+  BOOLEAN                Reusable;
+
+  Context = &Session->Context;
+
+  if (Session->ResponsePending) {
+    Context->Http->Cancel (Context->Http, &Context->ResponseToken);
+    Session->ResponsePending = FALSE;
+  }
+
+  if (Session->IdleTimer != NULL) {
+    gBS->SetTimer (Session->IdleTimer, TimerCancel, 0);
+  }
+
+  //
+  // The connection can only serve another request once the whole response
+  // has been read.
+  //
+  Reusable = (BOOLEAN)(  (Session->Status == EFI_SUCCESS)
+                      && (Session->MsgParser != NULL)
+                      && HttpIsMessageComplete (Session->MsgParser));
+
+  LIB_FREE_NON_NULL (Session->ResponseMessage.Headers);
+  LIB_FREE_NON_NULL (Session->MsgParser);
+  LIB_FREE_NON_NULL (Context->Buffer);
+
+  ReleaseHttpConnection (Session->Connection, Reusable);
+  Session->Connection = NULL;
+}
+
+/**
+  Queue a response token on the HTTP child of a download session, so that
+  the next portion of the response is received in the background.
+
+  @param[in]  Session  The download session.
+
+  @retval  EFI_SUCCESS  The response token is queued.
+  @retval  Others       The HTTP driver rejected the token.
+**/
+STATIC
+EFI_STATUS
+ArmSessionResponse (
+  IN HTTP_DOWNLOAD_SESSION  *Session
+  )
+{
+  EFI_STATUS             Status;
+  HTTP_DOWNLOAD_CONTEXT  *Context;
+
+  Context = &Session->Context;
+
+  LIB_FREE_NON_NULL (Session->ResponseMessage.Headers);
+  Session->ResponseMessage.HeaderCount = 0;
+  Session->ResponseMessage.BodyLength  = Context->BufferSize;
+  Session->ResponseMessage.Body        = Context->Buffer;
+
+  Session->ResponseComplete      = FALSE;
+  Context->ResponseToken.Status  = EFI_SUCCESS;
+  Context->ResponseToken.Message = &Session->ResponseMessage;
+
+  Status = Context->Http->Response (Context->Http, &Context->ResponseToken);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Session->ResponsePending = TRUE;
+
+  //
+  // The download fails if the server stays silent for too long.
+  //
+  gBS->SetTimer (
+         Session->IdleTimer,
+         TimerRelative,
+         EFI_TIMER_PERIOD_SECONDS (Session->IdleTimeout)
+         );
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Open an HTTP child on the NIC of a download session, send the request and
+  queue the token for the response headers.
+
+  @param[in]  Session  The download session.
+
+  @retval  EFI_SUCCESS  The request was sent.
+  @retval  Others       The request could not be sent.
+**/
+STATIC
+EFI_STATUS
+SendSessionRequest (
+  IN HTTP_DOWNLOAD_SESSION  *Session
+  )
+{
+  EFI_STATUS             Status;
+  HTTP_DOWNLOAD_CONTEXT  *Context;
+
+  Context = &Session->Context;
+
+  ReleaseHttpConnection (Session->Connection, FALSE);
+  Session->Connection = NULL;
+  LIB_FREE_NON_NULL (Session->DownloadUrl);
+
+  Status = AcquireHttpConnection (Context, Session->ControllerHandle, &Session->Connection);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Session->DownloadUrl = BuildDownloadUrl (Context);
+  if (Session->DownloadUrl == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto ON_EXIT;
+  }
+
+  DEBUG ((DEBUG_INFO, "Prefetching %s\n", Session->DownloadUrl));
+
+  Context->Report.RequestMs = GetReportClock ();
+
+  Status = SendRequest (Context, Session->DownloadUrl);
+  if (EFI_ERROR (Status)) {
+    goto ON_EXIT;
+  }
+
+  ZeroMem (&Session->ResponseData, sizeof (Session->ResponseData));
+  Session->ResponseData.StatusCode       = HTTP_STATUS_UNSUPPORTED_STATUS;
+  Session->ResponseMessage.Data.Response = &Session->ResponseData;
+
+  Status = ArmSessionResponse (Session);
+
+ON_EXIT:
+  if (EFI_ERROR (Status)) {
+    ReleaseHttpConnection (Session->Connection, FALSE);
+    Session->Connection = NULL;
+  }
+
+  return Status;
+}
+
+/**
+  NIC worker that starts a download session on the given NIC.
+
+  @param[in]   Context           The context embedded in the download session.
+  @param[in]   ControllerHandle  The handle of the network interface controller
+  @param[in]   NicName           NIC name
+
+  @retval  EFI_SUCCESS  The request was sent.
+  @retval  Others       The request could not be sent on this NIC.
+**/
+STATIC
+EFI_STATUS
+StartSessionOnNic (
+  IN HTTP_DOWNLOAD_CONTEXT  *Context,
+  IN EFI_HANDLE             ControllerHandle,
+  IN CHAR16                 *NicName
+  )
+{
+  HTTP_DOWNLOAD_SESSION  *Session;
+
+  Session                   = BASE_CR (Context, HTTP_DOWNLOAD_SESSION, Context);
+  Session->ControllerHandle = ControllerHandle;
+  StrCpyS (Session->NicName, ARRAY_SIZE (Session->NicName), NicName);
+
+  return SendSessionRequest (Session);
+}
+
+/**
+  Start downloading a byte range of a file in the background.
+
+  A 206 response must start at RangeStart. A server ignoring the Range
+  header answers 200: the whole file is then received from the start, except
+  for a probe that completes with the headers alone, TotalLength set from
+  Content-Length.
+
+  @param[in]   DownloadUrl  Url like http://example.com/example.
+  @param[in]   RangeStart   First byte to download.
+  @param[in]   RangeLength  Number of bytes to download, 0 up to the end.
+  @param[in]   Buffer       Buffer receiving the whole file at its offset,
+                            owned by the caller. NULL to allocate one sized
+                            after the response.
+  @param[in]   BufferSize   Size of Buffer.
+  @param[in]   IdleTimeout  Seconds the server may stay silent.
+  @param[in]   Probe        Only the size of the file is wanted.
+  @param[in]   Report       Report the download to the server once completed.
+  @param[out]  Session      The new download session.
+
+  @retval  EFI_SUCCESS           The request was sent.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                No network interface card could send the request.
+**/
+STATIC
+EFI_STATUS
+CreateHttpSession (
+  IN  CHAR16                 *DownloadUrl,
+  IN  UINTN                  RangeStart,
+  IN  UINTN                  RangeLength,
+  IN  UINT8                  *Buffer  OPTIONAL,
+  IN  UINTN                  BufferSize,
+  IN  UINTN                  IdleTimeout,
+  IN  BOOLEAN                Probe,
+  IN  BOOLEAN                Report,
+  OUT HTTP_DOWNLOAD_SESSION  **Session
+  )
+{
+  EFI_STATUS             Status;
+  HTTP_DOWNLOAD_SESSION  *NewSession;
+  HTTP_DOWNLOAD_CONTEXT  *Context;
+  CHAR16                 *Redirected;
+
+  gHttpError = FALSE;
+
+  NewSession = AllocateZeroPool (sizeof (HTTP_DOWNLOAD_SESSION));
+  if (NewSession == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  //
+  // The clock times the download for its report, until the session is freed.
+  //
+  StartReportClock ();
+
+  NewSession->Status      = EFI_NOT_READY;
+  NewSession->IdleTimeout = IdleTimeout;
+  NewSession->Probe       = Probe;
+  Context                 = &NewSession->Context;
+
+  if (Report) {
+    Context->ReportServer = GetReportServer (DownloadUrl);
+  }
+
+  Redirected              = ResolveRedirect (DownloadUrl);
+  Context->CachedRedirect = (BOOLEAN)(Redirected != NULL);
+
+  Status = InitDownloadContext (Context, &NewSession->IPv4Node, (Redirected != NULL) ? Redirected : DownloadUrl);
+  LIB_FREE_NON_NULL (Redirected);
+  if (EFI_ERROR (Status)) {
+    goto ON_EXIT;
+  }
+
+  Context->HttpMethod  = HttpMethodGet;
+  Context->RangeStart  = RangeStart;
+  Context->RangeLength = RangeLength;
+  if (Buffer != NULL) {
+    NewSession->ExternalBuffer  = TRUE;
+    Context->DownloadBuffer     = Buffer;
+    Context->DownloadBufferSize = BufferSize;
+    Context->ContentDownloaded  = RangeStart;
+  }
+
+  Context->Buffer = AllocatePool (Context->BufferSize);
+  if (Context->Buffer == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto ON_EXIT;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER,
+                  TPL_CALLBACK,
+                  NULL,
+                  NULL,
+                  &NewSession->IdleTimer
+                  );
+  if (EFI_ERROR (Status)) {
+    goto ON_EXIT;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  SessionResponseCallback,
+                  NewSession,
+                  &Context->ResponseToken.Event
+                  );
+  if (EFI_ERROR (Status)) {
+    goto ON_EXIT;
+  }
+
+  Status = RunOnNics (Context, NULL, StartSessionOnNic);
+
+ON_EXIT:
+  if (EFI_ERROR (Status)) {
+    if (Context->CachedRedirect && !gHttpError) {
+      //
+      // The mirror is not reachable any more, ask the server again.
+      //
+      FreeHttpSession (NewSession);
+      ForgetRedirect (DownloadUrl);
+      return CreateHttpSession (DownloadUrl, RangeStart, RangeLength, Buffer, BufferSize, IdleTimeout, Probe, Report, Session);
+    }
+
+    FreeHttpSession (NewSession);
+    return Status;
+  }
+
+  *Session = NewSession;
+  return EFI_SUCCESS;
+}
+
+/**
+  Start downloading a byte range of a file in the background.
+
+  A 206 response must start at RangeStart. A server ignoring the Range
+  header answers 200: the whole file is then received from the start, except
+  for a probe that completes with the headers alone, TotalLength set from
+  Content-Length.
+
+  @param[in]   DownloadUrl  Url like http://example.com/example.
+  @param[in]   RangeStart   First byte to download.
+  @param[in]   RangeLength  Number of bytes to download, 0 up to the end.
+  @param[in]   Buffer       Buffer receiving the whole file at its offset,
+                            owned by the caller. NULL to allocate one sized
+                            after the response.
+  @param[in]   BufferSize   Size of Buffer.
+  @param[out]  Session      The new download session.
+
+  @retval  EFI_SUCCESS           The request was sent.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                No network interface card could send the request.
+**/
+EFI_STATUS
+StartHttpRangeSession (
+  IN  CHAR16                 *DownloadUrl,
+  IN  UINTN                  RangeStart,
+  IN  UINTN                  RangeLength,
+  IN  UINT8                  *Buffer  OPTIONAL,
+  IN  UINTN                  BufferSize,
+  OUT HTTP_DOWNLOAD_SESSION  **Session
+  )
+{
+  return CreateHttpSession (DownloadUrl, RangeStart, RangeLength, Buffer, BufferSize, TIMER_MAX_TIMEOUT_S, FALSE, TRUE, Session);
+}
+
+/**
+  Request the first bytes of a file in the background, to learn its size.
+
+  The session completes with TotalLength set, from the Content-Range of a
+  206 response or the Content-Length of a 200 one. The body of a 200
+  response is not received.
+
+  @param[in]   DownloadUrl  Url like http://example.com/example.
+  @param[in]   ProbeSize    Number of bytes to request.
+  @param[out]  Session      The new download session.
+
+  @retval  EFI_SUCCESS           The request was sent.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                No network interface card could send the request.
+**/
+EFI_STATUS
+StartHttpProbeSession (
+  IN  CHAR16                 *DownloadUrl,
+  IN  UINTN                  ProbeSize,
+  OUT HTTP_DOWNLOAD_SESSION  **Session
+  )
+{
+  return CreateHttpSession (DownloadUrl, 0, ProbeSize, NULL, 0, TIMER_MAX_TIMEOUT_S, TRUE, FALSE, Session);
+}
+
+/**
+  NIC worker that only checks the NIC got an address.
+
+  @param[in]   Context           Unused.
+  @param[in]   ControllerHandle  The handle of the network interface controller
+  @param[in]   NicName           Unused.
+
+  @retval  EFI_SUCCESS     The NIC has an address.
+  @retval  EFI_NO_MAPPING  The NIC has no address.
+  @retval  Others          The address of the NIC could not be read.
+**/
+STATIC
+EFI_STATUS
+CheckNicAddress (
+  IN HTTP_DOWNLOAD_CONTEXT  *Context,
+  IN EFI_HANDLE             ControllerHandle,
+  IN CHAR16                 *NicName
+  )
+{
+  EFI_STATUS                      Status;
+  EFI_IP4_CONFIG2_PROTOCOL        *Ip4Config2;
+  EFI_IP4_CONFIG2_INTERFACE_INFO  *Ip4Info;
+  UINTN                           DataSize;
+
+  Status = gBS->HandleProtocol (ControllerHandle, &gEfiIp4Config2ProtocolGuid, (VOID **)&Ip4Config2);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  DataSize = 0;
+  Status   = Ip4Config2->GetData (Ip4Config2, Ip4Config2DataTypeInterfaceInfo, &DataSize, NULL);
+  if (Status != EFI_BUFFER_TOO_SMALL) {
+    return EFI_ERROR (Status) ? Status : EFI_DEVICE_ERROR;
+  }
+
+  Ip4Info = AllocateZeroPool (DataSize);
+  if (Ip4Info == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = Ip4Config2->GetData (Ip4Config2, Ip4Config2DataTypeInterfaceInfo, &DataSize, Ip4Info);
+  if (!EFI_ERROR (Status) && EFI_IP4_EQUAL (&Ip4Info->StationAddress, &mZeroIp4Addr)) {
+    Status = EFI_NO_MAPPING;
+  }
+
+  FreePool (Ip4Info);
+  return Status;
+}
+
+/**
+  Bring up the NIC the requests to a URL go out of, getting its address by
+  DHCP or from the cached lease, without sending anything to the server.
+  The requests timed afterwards do not include the address configuration.
+
+  @param[in]  DownloadUrl  Url like http://example.com/example.
+
+  @retval  EFI_SUCCESS           A NIC has an address.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                No network interface card got an address.
+**/
+EFI_STATUS
+StartHttpNic (
+  IN CHAR16  *DownloadUrl
+  )
+{
+  EFI_STATUS               Status;
+  HTTP_DOWNLOAD_CONTEXT    Context;
+  EFI_HTTPv4_ACCESS_POINT  IPv4Node;
+
+  gHttpError = FALSE;
+
+  ZeroMem (&Context, sizeof (Context));
+  Status = InitDownloadContext (&Context, &IPv4Node, DownloadUrl);
+  if (!EFI_ERROR (Status)) {
+    Status = RunOnNics (&Context, NULL, CheckNicAddress);
+  }
+
+  LIB_FREE_NON_NULL (Context.ServerAddrAndProto);
+  LIB_FREE_NON_NULL (Context.Uri);
+  return Status;
+}
+
+/**
+  Send a long-poll request, that the server holds until it has something new
+  or up to WaitSeconds.
+
+  @param[in]   DownloadUrl  Url of the request, with the wait parameter.
+  @param[in]   WaitSeconds  Longest time the server holds the request.
+  @param[out]  Session      The new download session.
+
+  @retval  EFI_SUCCESS           The request was sent.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                No network interface card could send the request.
+**/
+EFI_STATUS
+StartHttpLongPollSession (
+  IN  CHAR16                 *DownloadUrl,
+  IN  UINTN                  WaitSeconds,
+  OUT HTTP_DOWNLOAD_SESSION  **Session
+  )
+{
+  return CreateHttpSession (DownloadUrl, 0, 0, NULL, 0, WaitSeconds + TIMER_MAX_TIMEOUT_S, FALSE, FALSE, Session);
+}
+
+/**
+  Start downloading a file in the background.
+
+  The network interface card is selected and the GET request is sent before
+  returning. The response is consumed by PollHttpSession().
+
+  @param[in]   DownloadUrl  Url like http://example.com/example.
+  @param[out]  Session      The new download session.
+
+  @retval  EFI_SUCCESS           The request was sent.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                No network interface card could send the request.
+**/
+EFI_STATUS
+StartHttpSession (
+  IN  CHAR16                 *DownloadUrl,
+  OUT HTTP_DOWNLOAD_SESSION  **Session
+  )
+{
+  return StartHttpRangeSession (DownloadUrl, 0, 0, NULL, 0, Session);
+}
+
+/**
+  Get the first byte and the file size from the Content-Range header of a
+  206 response, like "bytes 0-4095/1048576".
+
+  @param[in]   ResponseMessage  The response.
+  @param[out]  RangeStart       The first byte of the body.
+  @param[out]  TotalLength      The size of the whole file.
+
+  @retval  EFI_SUCCESS           The header was parsed.
+  @retval  EFI_PROTOCOL_ERROR    The header is missing or malformed.
+**/
+STATIC
+EFI_STATUS
+ParseContentRange (
+  IN  EFI_HTTP_MESSAGE  *ResponseMessage,
+  OUT UINTN             *RangeStart,
+  OUT UINTN             *TotalLength
+  )
+{
+  EFI_HTTP_HEADER  *Header;
+  CHAR8            *Walker;
+
+  Header = HttpFindHeader (
+             ResponseMessage->HeaderCount,
+             ResponseMessage->Headers,
+             "Content-Range"
+             );
+  if ((Header == NULL) || (AsciiStrnCmp (Header->FieldValue, "bytes ", 6) != 0)) {
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  if (  RETURN_ERROR (AsciiStrDecimalToUintnS (Header->FieldValue + 6, &Walker, RangeStart))
+     || (*Walker != '-'))
+  {
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  Walker = AsciiStrStr (Walker, "/");
+  if (  (Walker == NULL)
+     || RETURN_ERROR (AsciiStrDecimalToUintnS (Walker + 1, &Walker, TotalLength)))
+  {
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Consume the part of the response that has arrived so far.
+
+  @param[in]  Session  The download session.
+
+  @retval  EFI_NOT_READY  The download is still in progress.
+  @retval  EFI_SUCCESS    The whole file has been downloaded.
+  @retval  Others         The download failed.
+**/
+EFI_STATUS
+PollHttpSession (
+  IN HTTP_DOWNLOAD_SESSION  *Session
+  )
+{
+  EFI_STATUS              Status;
+  HTTP_DOWNLOAD_CONTEXT   *Context;
+  EFI_HTTP_MESSAGE        *ResponseMessage;
+  EFI_HTTP_STATUS_CODE    StatusCode;
+  EFI_HTTP_HEADER         *Header;
+  UINTN                   RangeStart;
+  UINTN                   Delay;
+  BOOLEAN                 SendReport;
+
+  if (Session->Status != EFI_NOT_READY) {
+    return Session->Status;
+  }
+
+  Context         = &Session->Context;
+  ResponseMessage = &Session->ResponseMessage;
+
+  if (Session->RetryPending) {
+    if (EFI_ERROR (gBS->CheckEvent (Session->IdleTimer))) {
+      return EFI_NOT_READY;
+    }
+
+    Session->RetryPending = FALSE;
+    Status                = SendSessionRequest (Session);
+    if (EFI_ERROR (Status)) {
+      goto ON_EXIT;
+    }
+
+    return EFI_NOT_READY;
+  }
+
+  Context->Http->Poll (Context->Http);
+  if (!Session->ResponseComplete) {
+    if (!EFI_ERROR (gBS->CheckEvent (Session->IdleTimer))) {
+      Status = EFI_TIMEOUT;
+      goto ON_EXIT;
+    }
+
+    return EFI_NOT_READY;
+  }
+
+  Session->ResponsePending = FALSE;
+
+  Status = Context->ResponseToken.Status;
+  if (EFI_ERROR (Status)) {
+    goto ON_EXIT;
+  }
+
+  if (Session->MsgParser == NULL) {
+    //
+    // This is the first portion of the response, with the headers.
+    //
+    Context->Report.FirstByteMs = GetReportClock ();
+    StatusCode                  = Session->ResponseData.StatusCode;
+    if (NEED_REDIRECTION (StatusCode)) {
+      Header = HttpFindHeader (
+                 ResponseMessage->HeaderCount,
+                 ResponseMessage->Headers,
+                 "Location"
+                 );
+      if (Header == NULL) {
+        Status = EFI_NOT_FOUND;
+        goto ON_EXIT;
+      }
+
+      Status = SetHostURI (Header->FieldValue, Context, Session->DownloadUrl);
+      if (!EFI_ERROR (Status)) {
+        RememberContextRedirect (Context, Session->DownloadUrl, ResponseMessage);
+        Status = SendSessionRequest (Session);
+      }
+
+      if (EFI_ERROR (Status)) {
+        goto ON_EXIT;
+      }
+
+      return EFI_NOT_READY;
+    }
+
+    if (StatusCode == HTTP_STATUS_503_SERVICE_UNAVAILABLE) {
+      //
+      // Too many boards are downloading: come back after Retry-After,
+      // without blocking the caller. A probe only notes that the server is
+      // busy.
+      //
+      Header = HttpFindHeader (
+                 ResponseMessage->HeaderCount,
+                 ResponseMessage->Headers,
+                 "Retry-After"
+                 );
+      Context->ServerBusy = TRUE;
+      Context->RetryAfter = (Header != NULL) ? AsciiStrDecimalToUintn (Header->FieldValue) : 0;
+
+      Delay = Session->Probe ? 0 : GetRetryDelay (Context, Context->Report.Retries, Session->RetryWaited);
+      if (Delay != 0) {
+        DEBUG ((DEBUG_INFO, "%s busy, retrying %s in %d s\n", Context->ServerAddrAndProto, Context->Uri, Delay));
+        Context->Report.Retries++;
+        Session->RetryWaited += Delay;
+
+        //
+        // The body of the 503 is left unread.
+        //
+        ReleaseHttpConnection (Session->Connection, FALSE);
+        Session->Connection   = NULL;
+        Session->RetryPending = TRUE;
+        gBS->SetTimer (Session->IdleTimer, TimerRelative, EFI_TIMER_PERIOD_SECONDS (Delay));
+        return EFI_NOT_READY;
+      }
+    }
+
+    if (StatusCode >= HTTP_STATUS_400_BAD_REQUEST) {
+      DEBUG ((DEBUG_WARN, "%s reports error %d for %s\n", Context->ServerAddrAndProto, StatusCode, Context->Uri));
+      Status = EFI_HTTP_ERROR;
+      goto ON_EXIT;
+    }
+
+    if (StatusCode == HTTP_STATUS_204_NO_CONTENT) {
+      //
+      // Nothing to download, e.g. a long poll that timed out.
+      //
+      Context->ContentDownloaded = 0;
+      Status                     = EFI_SUCCESS;
+      goto ON_EXIT;
+    }
+
+    if (StatusCode == HTTP_STATUS_206_PARTIAL_CONTENT) {
+      Status = ParseContentRange (ResponseMessage, &RangeStart, &Context->TotalLength);
+      if (!EFI_ERROR (Status) && (RangeStart != Context->RangeStart)) {
+        Status = EFI_PROTOCOL_ERROR;
+      }
+
+      if (EFI_ERROR (Status)) {
+        goto ON_EXIT;
+      }
+    } else if ((Context->RangeStart != 0) || (Context->RangeLength != 0)) {
+      //
+      // The server ignored the Range header and sends the whole file.
+      //
+      DEBUG ((DEBUG_INFO, "%s does not support ranges\n", Context->ServerAddrAndProto));
+      if (Session->Probe) {
+        Header = HttpFindHeader (ResponseMessage->HeaderCount, ResponseMessage->Headers, "Content-Length");
+        if (Header != NULL) {
+          Context->TotalLength = AsciiStrDecimalToUintn (Header->FieldValue);
+        }
+
+        Status = (Context->TotalLength != 0) ? EFI_SUCCESS : EFI_UNSUPPORTED;
+        goto ON_EXIT;
+      }
+
+      Context->RangeStart        = 0;
+      Context->ContentDownloaded = 0;
+    }
+
+    Status = HttpInitMsgParser (
+               HttpMethodGet,
+               StatusCode,
+               ResponseMessage->HeaderCount,
+               ResponseMessage->Headers,
+               ParseMsg,
+               Context,
+               &Session->MsgParser
+               );
+    if (EFI_ERROR (Status)) {
+      goto ON_EXIT;
+    }
+
+    //
+    // The file is kept in one buffer, so its size must be known up front.
+    //
+    Status = HttpGetEntityLength (Session->MsgParser, &Context->ContentLength);
+    if (EFI_ERROR (Status) || (Context->ContentLength == 0)) {
+      Status = EFI_UNSUPPORTED;
+      goto ON_EXIT;
+    }
+
+    if (Session->ExternalBuffer) {
+      if (Context->ContentDownloaded + Context->ContentLength != Context->DownloadBufferSize) {
+        DEBUG ((DEBUG_WARN, "%s serves a file of another size\n", Session->DownloadUrl));
+        Status = EFI_BAD_BUFFER_SIZE;
+        goto ON_EXIT;
+      }
+
+      //
+      // Report the progress against the whole file.
+      //
+      Context->ContentLength         = Context->DownloadBufferSize;
+      Context->LastReportedNbOfBytes = Context->ContentDownloaded;
+    } else {
+      Context->DownloadBuffer = AllocatePool (Context->ContentLength);
+      if (Context->DownloadBuffer == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto ON_EXIT;
+      }
+
+      Context->DownloadBufferSize = Context->ContentLength;
+    }
+
+    ResponseMessage->Data.Response = NULL;
+  }
+
+  if (ResponseMessage->BodyLength != 0) {
+    Status = HttpParseMessageBody (
+               Session->MsgParser,
+               ResponseMessage->BodyLength,
+               ResponseMessage->Body
+               );
+    if (EFI_ERROR (Status)) {
+      goto ON_EXIT;
+    }
+  }
+
+  if (HttpIsMessageComplete (Session->MsgParser)) {
+    DEBUG ((DEBUG_INFO, "Prefetched 0x%x bytes from %s\n", Context->ContentDownloaded, Session->DownloadUrl));
+    Context->Report.DoneMs = GetReportClock ();
+    Status                 = EFI_SUCCESS;
+    goto ON_EXIT;
+  }
+
+  Status = ArmSessionResponse (Session);
+  if (!EFI_ERROR (Status)) {
+    return EFI_NOT_READY;
+  }
+
+ON_EXIT:
+  if (EFI_ERROR (Status) && Context->CachedRedirect && (Session->DownloadUrl != NULL)) {
+    ForgetRedirect (Session->DownloadUrl);
+  }
+
+  //
+  // Only a file actually received is reported, not a 204 or a probe.
+  //
+  SendReport = (BOOLEAN)(  !EFI_ERROR (Status) && (Session->MsgParser != NULL)
+                        && (Context->ReportServer != NULL));
+
+  Session->Status = Status;
+  CloseSessionHttp (Session);
+
+  if (SendReport) {
+    SendDownloadReport (Context, Session->NicName);
+  }
+
+  return Status;
+}
+
+/**
+  Abort a download session if still running and free all its resources,
+  including the download buffer.
+
+  @param[in]  Session  The download session.
+**/
+VOID
+FreeHttpSession (
+  IN HTTP_DOWNLOAD_SESSION  *Session
+  )
+{
+  if (Session == NULL) {
+    return;
+  }
+
+  CloseSessionHttp (Session);
+  StopReportClock ();
+
+  if (Session->Context.ResponseToken.Event != NULL) {
+    gBS->CloseEvent (Session->Context.ResponseToken.Event);
+  }
+
+  if (Session->IdleTimer != NULL) {
+    gBS->CloseEvent (Session->IdleTimer);
+  }
+
+  if (!Session->ExternalBuffer) {
+    LIB_FREE_NON_NULL (Session->Context.DownloadBuffer);
+  }
+
+  LIB_FREE_NON_NULL (Session->Context.ServerAddrAndProto);
+  LIB_FREE_NON_NULL (Session->Context.Uri);
+  LIB_FREE_NON_NULL (Session->Context.ReportServer);
+  LIB_FREE_NON_NULL (Session->DownloadUrl);
+
+  FreePool (Session);
+}
+
 /**
   Safely append with automatic string resizing given length of Destination and
   desired length of copy from Source.
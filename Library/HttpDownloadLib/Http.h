@@ -17,6 +17,7 @@
 #include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
+#include <Library/DevicePathLib.h>
 #include <Library/HttpLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/NetLib.h>
@@ -29,8 +30,13 @@
 #include <Protocol/HttpUtilities.h>
 #include <Protocol/ServiceBinding.h>
 #include <Protocol/Ip4Config2.h>
+#include <Protocol/Dhcp4.h>
+#include <Protocol/Udp4.h>
+
+#include <Guid/HttpDownloadLastNic.h>
 
 #include <Library/HttpDownloadLib.h>
+#include <Protocol/OtaDownload.h>
 
 #define LIB_FREE_NON_NULL(Pointer)  \
   do {                                \
@@ -45,6 +51,35 @@
 #define REQ_OK           0
 #define REQ_NEED_REPEAT  1
 
+#define IP4_CONFIG2_INTERFACE_INFO_NAME_LENGTH  32
+
+//
+// "xx:xx:...", enough for the longest hardware address.
+//
+#define HTTP_CLIENT_ID_SIZE  (sizeof (EFI_MAC_ADDRESS) * 3)
+
+//
+// Timings of a download, in milliseconds of the clock started by
+// StartReportClock(), sent to the server by SendDownloadReport().
+//
+typedef struct {
+  //
+  // Time to get an address, by DHCP or from the cached lease.
+  //
+  UINT64                  DhcpMs;
+  BOOLEAN                 CachedLease;
+  //
+  // When the last request was sent, its response began to arrive, and the
+  // download completed.
+  //
+  UINT64                  RequestMs;
+  UINT64                  FirstByteMs;
+  UINT64                  DoneMs;
+  //
+  // Number of requests answered 503 before the download.
+  //
+  UINTN                   Retries;
+} HTTP_DOWNLOAD_REPORT;
 
 typedef struct {
   UINTN                   ContentDownloaded;
@@ -62,8 +97,163 @@ typedef struct {
   EFI_HTTP_CONFIG_DATA    HttpConfigData;
   UINTN                   DownloadBufferSize;
   UINT8                   *DownloadBuffer;
+  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback;
+  //
+  // Byte range requested, "RangeStart-" when RangeLength is 0. No Range
+  // header is sent when both are 0.
+  //
+  UINTN                   RangeStart;
+  UINTN                   RangeLength;
+  //
+  // Size of the whole file, from the Content-Range of a 206 response.
+  //
+  UINTN                   TotalLength;
+  //
+  // NIC of the connection, set by AcquireHttpConnection().
+  //
+  EFI_HANDLE              ControllerHandle;
+  //
+  // Set when the URL was rewritten by a remembered redirection.
+  //
+  BOOLEAN                 CachedRedirect;
+  //
+  // Set when the server answered 503, with its Retry-After in seconds, 0
+  // if none.
+  //
+  BOOLEAN                 ServerBusy;
+  UINTN                   RetryAfter;
+  //
+  // Server the file was asked from, before any redirection, that the
+  // download is reported to once completed. NULL not to report it.
+  //
+  CHAR16                  *ReportServer;
+  HTTP_DOWNLOAD_REPORT    Report;
 } HTTP_DOWNLOAD_CONTEXT;
 
+//
+// An HTTP child configured for one server on one NIC.
+//
+#define HTTP_CONNECTION_SIGNATURE  SIGNATURE_32 ('H', 'c', 'o', 'n')
+
+typedef struct {
+  UINT32                  Signature;
+  LIST_ENTRY              Link;
+  EFI_HANDLE              ControllerHandle;
+  EFI_HANDLE              HttpChildHandle;
+  EFI_HTTP_PROTOCOL       *Http;
+  CHAR16                  *ServerAddrAndProto;
+} HTTP_CONNECTION;
+
+#define HTTP_CONNECTION_FROM_LINK(a) \
+  CR (a, HTTP_CONNECTION, Link, HTTP_CONNECTION_SIGNATURE)
+
+typedef
+EFI_STATUS
+(*HTTP_NIC_WORKER)(
+  IN HTTP_DOWNLOAD_CONTEXT  *Context,
+  IN EFI_HANDLE             ControllerHandle,
+  IN CHAR16                 *NicName
+  );
+
+//
+// A download that runs in the background while the caller keeps polling it.
+// The request is sent on start, then each poll consumes whatever part of the
+// response has arrived and re-arms the response token.
+//
+struct _HTTP_DOWNLOAD_SESSION {
+  HTTP_DOWNLOAD_CONTEXT    Context;
+  EFI_HTTPv4_ACCESS_POINT  IPv4Node;
+  EFI_HANDLE               ControllerHandle;
+  CHAR16                   NicName[IP4_CONFIG2_INTERFACE_INFO_NAME_LENGTH];
+  HTTP_CONNECTION          *Connection;
+  CHAR16                   *DownloadUrl;
+  EFI_HTTP_RESPONSE_DATA   ResponseData;
+  EFI_HTTP_MESSAGE         ResponseMessage;
+  VOID                     *MsgParser;
+  EFI_EVENT                IdleTimer;
+  //
+  // Seconds the server may stay silent before the download fails.
+  //
+  UINTN                    IdleTimeout;
+  BOOLEAN                  ResponseComplete;
+  BOOLEAN                  ResponsePending;
+  EFI_STATUS               Status;
+  //
+  // Context.DownloadBuffer belongs to the caller, see StartHttpRangeSession().
+  //
+  BOOLEAN                  ExternalBuffer;
+  //
+  // Only the size of the file is wanted, see StartHttpProbeSession().
+  //
+  BOOLEAN                  Probe;
+  //
+  // Set while waiting to repeat a request the server declined with 503,
+  // IdleTimer then signaling the end of the wait. RetryWaited sums the
+  // waits so far.
+  //
+  BOOLEAN                  RetryPending;
+  UINTN                    RetryWaited;
+  //
+  // Set when the download is served by the OTA download service instead.
+  //
+  EFI_OTA_DOWNLOAD_PROTOCOL  *Service;
+  EFI_OTA_DOWNLOAD_REQUEST   ServiceRequest;
+};
+
+extern EFI_HANDLE  gPreferredNicHandle;
+
+//
+// Statistics of the last NIC selection, see HttpDownloadGetStatistics().
+//
+extern HTTP_DOWNLOAD_STATISTICS  gHttpDownloadStatistics;
+
+//
+// Content of the HttpDownloadLastNic variable, followed by the device path
+// of the NIC.
+//
+#define HTTP_LAST_NIC_REVISION  1
+
+typedef struct {
+  UINT32                  Revision;
+  UINT32                  HwAddressSize;
+  EFI_MAC_ADDRESS         MacAddress;
+  EFI_IPv4_ADDRESS        StationAddress;
+  EFI_IPv4_ADDRESS        SubnetMask;
+  EFI_IPv4_ADDRESS        Gateway;
+  //
+  // DHCP lease in seconds, 0 if unknown and MAX_UINT32 if infinite,
+  // starting at LeaseStart seconds since the epoch.
+  //
+  UINT32                  LeaseTime;
+  UINT64                  LeaseStart;
+  //
+  // CRC32 of the ServerAddrAndProto reached with this lease.
+  //
+  UINT32                  ServerCrc;
+} HTTP_LAST_NIC;
+
+/**
+  Converts EFI_TIME to Epoch seconds
+  (elapsed since 1970 JANUARY 01, 00:00:00 UTC).
+
+  @param[in] Time: a pointer to EFI_TIME abstraction.
+ **/
+UINTN
+EFIAPI
+EfiTimeToEpoch (
+  IN  EFI_TIME  *Time
+  );
+
+/**
+  Get the current time in seconds since the epoch.
+
+  @return  The time, 0 if the real time clock could not be read.
+**/
+UINT64
+GetEpochNow (
+  VOID
+  );
+
 /**
   Function for 'http' command.
 
@@ -95,4 +285,621 @@ RunHttp (
   OUT UINT8     *DownloadBuffer
   );
 
+/**
+  Create a child for the service identified by its service binding protocol GUID
+  and get from the child the interface of the protocol identified by its GUID.
+
+  @param[in]   ControllerHandle            Controller handle.
+  @param[in]   ServiceBindingProtocolGuid  Service binding protocol GUID of the
+                                           service to be created.
+  @param[in]   ProtocolGuid                GUID of the protocol to be open.
+  @param[out]  ChildHandle                 Address where the handler of the
+                                           created child is returned. NULL is
+                                           returned in case of error.
+  @param[out]  Interface                   Address where a pointer to the
+                                           protocol interface is returned in
+                                           case of success.
+
+  @retval  EFI_SUCCESS  The child was created and the protocol opened.
+  @retval  Others       Either the creation of the child or the opening
+                        of the protocol failed.
+**/
+EFI_STATUS
+CreateServiceChildAndOpenProtocol (
+  IN   EFI_HANDLE  ControllerHandle,
+  IN   EFI_GUID    *ServiceBindingProtocolGuid,
+  IN   EFI_GUID    *ProtocolGuid,
+  OUT  EFI_HANDLE  *ChildHandle,
+  OUT  VOID        **Interface
+  );
+
+/**
+  Close the protocol identified by its GUID on the child handle of the service
+  identified by its service binding protocol GUID, then destroy the child
+  handle.
+
+  @param[in]  ControllerHandle            Controller handle.
+  @param[in]  ServiceBindingProtocolGuid  Service binding protocol GUID of the
+                                          service to be destroyed.
+  @param[in]  ProtocolGuid                GUID of the protocol to be closed.
+  @param[in]  ChildHandle                 Handle of the child to be destroyed.
+**/
+VOID
+CloseProtocolAndDestroyServiceChild (
+  IN  EFI_HANDLE  ControllerHandle,
+  IN  EFI_GUID    *ServiceBindingProtocolGuid,
+  IN  EFI_GUID    *ProtocolGuid,
+  IN  EFI_HANDLE  ChildHandle
+  );
+
+/**
+  Get a configured HTTP child on the given NIC for the server of the
+  download context, reusing an idle one from the pool when possible.
+
+  @param[in]   Context           The download context. Context->Http is
+                                 set to the HTTP protocol of the connection.
+  @param[in]   ControllerHandle  The NIC to use.
+  @param[out]  Connection        The connection, to be released with
+                                 ReleaseHttpConnection().
+
+  @retval  EFI_SUCCESS           The connection is ready for a request.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                The HTTP child could not be created or
+                                 configured.
+**/
+EFI_STATUS
+AcquireHttpConnection (
+  IN  HTTP_DOWNLOAD_CONTEXT  *Context,
+  IN  EFI_HANDLE             ControllerHandle,
+  OUT HTTP_CONNECTION        **Connection
+  );
+
+/**
+  Give back a connection obtained with AcquireHttpConnection().
+
+  @param[in]  Connection  The connection, NULL is ignored.
+  @param[in]  Reusable    TRUE if the last response was fully received, so
+                          that the connection can serve another request.
+                          It is only kept in service mode.
+**/
+VOID
+ReleaseHttpConnection (
+  IN HTTP_CONNECTION  *Connection  OPTIONAL,
+  IN BOOLEAN          Reusable
+  );
+
+/**
+  Close the idle connections of a NIC, before its address changes.
+
+  @param[in]  ControllerHandle  The NIC.
+**/
+VOID
+FlushHttpConnections (
+  IN EFI_HANDLE  ControllerHandle
+  );
+
+/**
+  Start downloading a byte range of a file in the background.
+
+  A 206 response must start at RangeStart. A server ignoring the Range
+  header answers 200: the whole file is then received from the start, except
+  for a probe that completes with the headers alone, TotalLength set from
+  Content-Length.
+
+  @param[in]   DownloadUrl  Url like http://example.com/example.
+  @param[in]   RangeStart   First byte to download.
+  @param[in]   RangeLength  Number of bytes to download, 0 up to the end.
+  @param[in]   Buffer       Buffer receiving the whole file at its offset,
+                            owned by the caller. NULL to allocate one sized
+                            after the response.
+  @param[in]   BufferSize   Size of Buffer.
+  @param[out]  Session      The new download session.
+
+  @retval  EFI_SUCCESS           The request was sent.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                No network interface card could send the request.
+**/
+EFI_STATUS
+StartHttpRangeSession (
+  IN  CHAR16                 *DownloadUrl,
+  IN  UINTN                  RangeStart,
+  IN  UINTN                  RangeLength,
+  IN  UINT8                  *Buffer  OPTIONAL,
+  IN  UINTN                  BufferSize,
+  OUT HTTP_DOWNLOAD_SESSION  **Session
+  );
+
+/**
+  Bring up the NIC the requests to a URL go out of, getting its address by
+  DHCP or from the cached lease, without sending anything to the server.
+  The requests timed afterwards do not include the address configuration.
+
+  @param[in]  DownloadUrl  Url like http://example.com/example.
+
+  @retval  EFI_SUCCESS           A NIC has an address.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                No network interface card got an address.
+**/
+EFI_STATUS
+StartHttpNic (
+  IN CHAR16  *DownloadUrl
+  );
+
+/**
+  Request the first bytes of a file in the background, to learn its size.
+
+  The session completes with TotalLength set, from the Content-Range of a
+  206 response or the Content-Length of a 200 one. The body of a 200
+  response is not received.
+
+  @param[in]   DownloadUrl  Url like http://example.com/example.
+  @param[in]   ProbeSize    Number of bytes to request.
+  @param[out]  Session      The new download session.
+
+  @retval  EFI_SUCCESS           The request was sent.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                No network interface card could send the request.
+**/
+EFI_STATUS
+StartHttpProbeSession (
+  IN  CHAR16                 *DownloadUrl,
+  IN  UINTN                  ProbeSize,
+  OUT HTTP_DOWNLOAD_SESSION  **Session
+  );
+
+/**
+  Send a long-poll request, that the server holds until it has something new
+  or up to WaitSeconds.
+
+  @param[in]   DownloadUrl  Url of the request, with the wait parameter.
+  @param[in]   WaitSeconds  Longest time the server holds the request.
+  @param[out]  Session      The new download session.
+
+  @retval  EFI_SUCCESS           The request was sent.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                No network interface card could send the request.
+**/
+EFI_STATUS
+StartHttpLongPollSession (
+  IN  CHAR16                 *DownloadUrl,
+  IN  UINTN                  WaitSeconds,
+  OUT HTTP_DOWNLOAD_SESSION  **Session
+  );
+
+/**
+  Start downloading a file in the background.
+
+  The network interface card is selected and the GET request is sent before
+  returning. The response is consumed by PollHttpSession().
+
+  @param[in]   DownloadUrl  Url like http://example.com/example.
+  @param[out]  Session      The new download session.
+
+  @retval  EFI_SUCCESS           The request was sent.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                No network interface card could send the request.
+**/
+EFI_STATUS
+StartHttpSession (
+  IN  CHAR16                 *DownloadUrl,
+  OUT HTTP_DOWNLOAD_SESSION  **Session
+  );
+
+/**
+  Consume the part of the response that has arrived so far.
+
+  @param[in]  Session  The download session.
+
+  @retval  EFI_NOT_READY  The download is still in progress.
+  @retval  EFI_SUCCESS    The whole file has been downloaded.
+  @retval  Others         The download failed.
+**/
+EFI_STATUS
+PollHttpSession (
+  IN HTTP_DOWNLOAD_SESSION  *Session
+  );
+
+/**
+  Abort a download session if still running and free all its resources,
+  including the download buffer.
+
+  @param[in]  Session  The download session.
+**/
+VOID
+FreeHttpSession (
+  IN HTTP_DOWNLOAD_SESSION  *Session
+  );
+
+/**
+  Download a file from the fastest of several mirrors serving the same file,
+  failing over to the next mirror without downloading again the bytes
+  already received.
+
+  @param[in]   Urls              The URLs of the file on each mirror.
+  @param[in]   UrlCount          Number of URLs.
+  @param[out]  BufferSize        Size of the downloaded file.
+  @param[out]  Buffer            The downloaded file, to be freed by the
+                                 caller with FreePool().
+  @param[in]   ProgressCallback  Reports the progress of the download.
+
+  @retval  EFI_SUCCESS           The file was downloaded.
+  @retval  EFI_NO_RESPONSE       No mirror answered the probe.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                The download failed on every mirror.
+**/
+EFI_STATUS
+DownloadFromMirrors (
+  IN  CHAR16                           **Urls,
+  IN  UINTN                            UrlCount,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback  OPTIONAL
+  );
+
+/**
+  Receive a file from a multicast group, repairing the missing blocks from
+  the HTTP server.
+
+  @param[in]   Url               The URL of the file on the HTTP server.
+  @param[in]   Address           The multicast group and port, like
+                                 L"239.255.0.1:5001".
+  @param[in]   SessionId         The first 32 bits of the SHA-256 of the
+                                 file.
+  @param[out]  BufferSize        Size of the file.
+  @param[out]  Buffer            The file, to be freed with FreePool().
+  @param[in]   ProgressCallback  Reports the progress.
+
+  @retval  EFI_SUCCESS            The file was received.
+  @retval  EFI_INVALID_PARAMETER  Address is not a multicast address.
+  @retval  EFI_NOT_FOUND          No NIC produces UDP4.
+  @retval  EFI_NO_MAPPING         The NIC has no address yet.
+  @retval  EFI_TIMEOUT            Nothing of the file was sent to the group.
+  @retval  Others                 The reception or a repair failed.
+**/
+EFI_STATUS
+DownloadMulticast (
+  IN  CHAR16                           *Url,
+  IN  CONST CHAR16                     *Address,
+  IN  UINT32                           SessionId,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback  OPTIONAL
+  );
+
+/**
+  Read the NIC of the last successful download.
+
+  @param[out]  LastNic  The record, to be freed with FreePool().
+
+  @retval  EFI_SUCCESS    LastNic is valid.
+  @retval  EFI_NOT_FOUND  No usable record is stored.
+  @retval  Others         The variable could not be read.
+**/
+EFI_STATUS
+GetLastNic (
+  OUT HTTP_LAST_NIC  **LastNic
+  );
+
+/**
+  Check whether a NIC is the one of the record.
+
+  @param[in]  LastNic           The record.
+  @param[in]  ControllerHandle  The NIC.
+
+  @retval  TRUE   Same device path, or same MAC address.
+  @retval  FALSE  Another NIC.
+**/
+BOOLEAN
+IsLastNic (
+  IN HTTP_LAST_NIC  *LastNic,
+  IN EFI_HANDLE     ControllerHandle
+  );
+
+/**
+  Check whether the lease of the record can still be used to reach a server
+  without a new DHCP exchange.
+
+  @param[in]  LastNic             The record.
+  @param[in]  ServerAddrAndProto  The server to download from.
+
+  @retval  TRUE   The NIC can be configured statically with the lease.
+  @retval  FALSE  The NIC has to go through DHCP.
+**/
+BOOLEAN
+IsLastNicLeaseValid (
+  IN HTTP_LAST_NIC  *LastNic,
+  IN CONST CHAR16   *ServerAddrAndProto
+  );
+
+/**
+  Configure a NIC statically with the lease of the record.
+
+  @param[in]  ControllerHandle  The NIC of the record.
+  @param[in]  LastNic           The record.
+
+  @retval  EFI_SUCCESS  The NIC has an address.
+  @retval  Others       The configuration failed.
+**/
+EFI_STATUS
+ApplyLastNicLease (
+  IN EFI_HANDLE     ControllerHandle,
+  IN HTTP_LAST_NIC  *LastNic
+  );
+
+/**
+  Record the NIC a download has just succeeded on.
+
+  @param[in]  ControllerHandle    The NIC.
+  @param[in]  ServerAddrAndProto  The server reached through the NIC.
+  @param[in]  LastNic             The current record, NULL if none.
+**/
+VOID
+SaveLastNic (
+  IN EFI_HANDLE     ControllerHandle,
+  IN CONST CHAR16   *ServerAddrAndProto,
+  IN HTTP_LAST_NIC  *LastNic  OPTIONAL
+  );
+
+/**
+  Delete the record, after its lease failed to reach the server.
+**/
+VOID
+ForgetLastNic (
+  VOID
+  );
+
+/**
+  Put the NIC configured with the cached lease back to DHCP, if any.
+**/
+VOID
+RestoreCachedLeaseNic (
+  VOID
+  );
+
+/**
+  Remember a redirection for as long as the response allows it to be cached.
+
+  @param[in]  Url       The URL requested.
+  @param[in]  Target    The URL redirected to.
+  @param[in]  Response  The redirection response.
+**/
+VOID
+RememberRedirect (
+  IN CONST CHAR16      *Url,
+  IN CONST CHAR16      *Target,
+  IN EFI_HTTP_MESSAGE  *Response
+  );
+
+/**
+  Apply the remembered redirection covering a URL.
+
+  @param[in]  Url  The URL to download.
+
+  @return  The URL to download instead, to be freed with FreePool(), or NULL
+           if no redirection is remembered for it.
+**/
+CHAR16 *
+ResolveRedirect (
+  IN CONST CHAR16  *Url
+  );
+
+/**
+  Forget the redirection covering a URL, after a download from its target
+  failed.
+
+  @param[in]  Url  The URL requested, or the URL it was redirected to.
+**/
+VOID
+ForgetRedirect (
+  IN CONST CHAR16  *Url
+  );
+
+/**
+  Get the identifier sent in the X-Client-Id header: the MAC address of the
+  NIC, as "xx:xx:xx:xx:xx:xx".
+
+  @param[in]   ControllerHandle  The NIC.
+  @param[out]  ClientId          The identifier.
+  @param[in]   ClientIdSize      Size of ClientId, at least
+                                 HTTP_CLIENT_ID_SIZE.
+
+  @retval  EFI_SUCCESS  The identifier was returned.
+  @retval  Others       The MAC address of the NIC is not known.
+**/
+EFI_STATUS
+GetClientId (
+  IN  EFI_HANDLE  ControllerHandle,
+  OUT CHAR8       *ClientId,
+  IN  UINTN       ClientIdSize
+  );
+
+/**
+  Start the clock timing the downloads, or count one more user of it.
+**/
+VOID
+StartReportClock (
+  VOID
+  );
+
+/**
+  Stop the clock timing the downloads once its last user is done.
+**/
+VOID
+StopReportClock (
+  VOID
+  );
+
+/**
+  Read the clock timing the downloads. Only differences of readings taken
+  while the clock runs are meaningful.
+
+  @return  Milliseconds counted by the clock.
+**/
+UINT64
+GetReportClock (
+  VOID
+  );
+
+/**
+  Get the server of a URL, e.g. "http://10.0.0.1:8080" for
+  "http://10.0.0.1:8080/bios.bin", to report the download of the URL to.
+
+  @param[in]  Url  The URL, "http://" assumed when it has no scheme.
+
+  @return  The server, to be freed with FreePool(), or NULL if out of
+           resources.
+**/
+CHAR16 *
+GetReportServer (
+  IN CONST CHAR16  *Url
+  );
+
+/**
+  Post the report of a completed download to Context->ReportServer, on a
+  connection of its own. The answer of the server is not awaited.
+
+  @param[in]  Context  The download context.
+  @param[in]  NicName  The name of the NIC of the download.
+**/
+VOID
+SendDownloadReport (
+  IN HTTP_DOWNLOAD_CONTEXT  *Context,
+  IN CONST CHAR16           *NicName
+  );
+
+/**
+  Parse the /update response in a single pass, without allocating memory.
+
+  @param[in]   Json      The response body.
+  @param[in]   JsonSize  Size of the body in bytes.
+  @param[out]  Info      The members of the response, the strings pointing
+                         into Json.
+
+  @retval  EFI_SUCCESS           Info is filled.
+  @retval  EFI_COMPROMISED_DATA  The body is not a JSON object, or a known
+                                 member has a value of the wrong type.
+**/
+EFI_STATUS
+ParseUpdateJson (
+  IN  CONST CHAR8                *Json,
+  IN  UINTN                      JsonSize,
+  OUT HTTP_DOWNLOAD_UPDATE_INFO  *Info
+  );
+
+/**
+  Copy a JSON string to a CHAR16 buffer, decoding its escape sequences.
+
+  @param[in]   String      The string.
+  @param[out]  Buffer      The NUL terminated string.
+  @param[in]   BufferSize  Size of Buffer in characters.
+
+  @retval  EFI_SUCCESS            The string was copied.
+  @retval  EFI_NOT_FOUND          The member is absent.
+  @retval  EFI_BUFFER_TOO_SMALL   The string does not fit in Buffer.
+  @retval  EFI_INVALID_PARAMETER  The string has an invalid escape sequence.
+**/
+EFI_STATUS
+JsonStringToUnicode (
+  IN  CONST HTTP_DOWNLOAD_JSON_STRING  *String,
+  OUT CHAR16                           *Buffer,
+  IN  UINTN                            BufferSize
+  );
+
+/**
+  Parse a block manifest: the block size, and the SHA-256 of each block.
+
+  @param[in]   Json        The manifest.
+  @param[in]   JsonSize    Size of the manifest in bytes.
+  @param[out]  BlockSize   The block size.
+  @param[out]  Digests     The digests, 32 bytes each.
+  @param[in]   MaxBlocks   Number of digests Digests can hold.
+  @param[out]  BlockCount  Number of blocks of the manifest.
+
+  @retval  EFI_SUCCESS           The manifest is parsed.
+  @retval  EFI_COMPROMISED_DATA  The manifest is malformed, or has more than
+                                 MaxBlocks blocks.
+**/
+EFI_STATUS
+ParseManifestJson (
+  IN  CONST CHAR8  *Json,
+  IN  UINTN        JsonSize,
+  OUT UINTN        *BlockSize,
+  OUT UINT8        *Digests,
+  IN  UINTN        MaxBlocks,
+  OUT UINTN        *BlockCount
+  );
+
+//
+// A job of the worker pool. It runs on an AP, so it must not call any UEFI
+// service.
+//
+typedef
+VOID
+(EFIAPI *HTTP_WORKER_PROCEDURE)(
+  IN OUT VOID  *Argument
+  );
+
+/**
+  Start a worker on each enabled AP.
+
+  @return  The number of workers started, 0 when the jobs run on the BSP.
+**/
+UINTN
+StartWorkers (
+  VOID
+  );
+
+/**
+  Queue a job to the next worker with room for it, or run it on the BSP
+  when there is none.
+
+  @param[in]  Procedure  The job.
+  @param[in]  Argument   Its argument.
+**/
+VOID
+SubmitWork (
+  IN HTTP_WORKER_PROCEDURE  Procedure,
+  IN VOID                   *Argument
+  );
+
+/**
+  Wait until the workers have run every job submitted.
+**/
+VOID
+WaitForWorkers (
+  VOID
+  );
+
+/**
+  Run the jobs left, then stop the workers and give the APs back to MP
+  services.
+**/
+VOID
+StopWorkers (
+  VOID
+  );
+
+/**
+  Check an image against its block manifest.
+
+  @param[in]   Image         The image.
+  @param[in]   ImageSize     Size of the image in bytes.
+  @param[in]   Manifest      The manifest.
+  @param[in]   ManifestSize  Size of the manifest in bytes.
+  @param[out]  BadBlock      The first block not matching the manifest.
+
+  @retval  EFI_SUCCESS             Every block matches.
+  @retval  EFI_COMPROMISED_DATA    The manifest is malformed.
+  @retval  EFI_SECURITY_VIOLATION  A block does not match.
+  @retval  EFI_OUT_OF_RESOURCES    Out of memory.
+**/
+EFI_STATUS
+VerifyBlocks (
+  IN  CONST UINT8  *Image,
+  IN  UINTN        ImageSize,
+  IN  CONST CHAR8  *Manifest,
+  IN  UINTN        ManifestSize,
+  OUT UINTN        *BadBlock
+  );
+
 #endif // _HTTP_DOWNLOAD_LIB_HTTP_H_
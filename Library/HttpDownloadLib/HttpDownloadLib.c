@@ -12,6 +12,37 @@
 
 HTTP_DOWNLOAD_PROGRESS_CALLBACK gHttpDownloadProgressCallback = NULL;
 
+//
+// The long poll of this module, see HttpDownloadWaitForUpdate().
+//
+STATIC HTTP_DOWNLOAD_SESSION  *mLongPollSession = NULL;
+
+/**
+  Get the OTA download service to forward the requests to.
+
+  @return  The service, or NULL if this module serves its requests itself.
+**/
+STATIC
+EFI_OTA_DOWNLOAD_PROTOCOL *
+GetOtaDownloadService (
+  VOID
+  )
+{
+  EFI_STATUS                 Status;
+  EFI_OTA_DOWNLOAD_PROTOCOL  *Service;
+
+  if (gHttpDownloadServiceMode) {
+    return NULL;
+  }
+
+  Status = gBS->LocateProtocol (&gEfiOtaDownloadProtocolGuid, NULL, (VOID **)&Service);
+  if (EFI_ERROR (Status)) {
+    return NULL;
+  }
+
+  return Service;
+}
+
 EFI_STATUS
 EFIAPI
 HttpDownloadFile (
@@ -21,12 +52,20 @@ HttpDownloadFile (
   IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback OPTIONAL
   )
 {
-  EFI_STATUS  Status;
+  EFI_STATUS                 Status;
+  EFI_OTA_DOWNLOAD_PROTOCOL  *Service;
 
   if ((*BufferSize != 0) && (Buffer == NULL)) {
     return EFI_INVALID_PARAMETER;
   }
 
+  Service = GetOtaDownloadService ();
+  if (Service != NULL) {
+    Status = Service->DownloadFile (Service, Url, BufferSize, Buffer, ProgressCallback);
+    DEBUG ((DEBUG_INFO, "HttpDownloadFile() OTA download service return %r\n", Status));
+    return Status;
+  }
+
   if (ProgressCallback != NULL) {
     gHttpDownloadProgressCallback = ProgressCallback;
   }
@@ -39,3 +78,330 @@ HttpDownloadFile (
   return Status;
 }
 
+EFI_STATUS
+EFIAPI
+HttpDownloadStart (
+  IN  CHAR16                 *Url,
+  OUT HTTP_DOWNLOAD_SESSION  **Session
+  )
+{
+  EFI_STATUS                 Status;
+  EFI_OTA_DOWNLOAD_PROTOCOL  *Service;
+  HTTP_DOWNLOAD_SESSION      *ServiceSession;
+
+  if ((Url == NULL) || (Session == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Service = GetOtaDownloadService ();
+  if (Service != NULL) {
+    ServiceSession = AllocateZeroPool (sizeof (HTTP_DOWNLOAD_SESSION));
+    if (ServiceSession == NULL) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    Status = Service->Start (Service, Url, &ServiceSession->ServiceRequest);
+    DEBUG ((DEBUG_INFO, "HttpDownloadStart() OTA download service return %r\n", Status));
+    if (EFI_ERROR (Status)) {
+      FreePool (ServiceSession);
+      return Status;
+    }
+
+    ServiceSession->Service = Service;
+    *Session                = ServiceSession;
+    return EFI_SUCCESS;
+  }
+
+  Status = StartHttpSession (Url, Session);
+  DEBUG ((DEBUG_INFO, "HttpDownloadStart() StartHttpSession return %r\n", Status));
+  return Status;
+}
+
+EFI_STATUS
+EFIAPI
+HttpDownloadWaitForUpdate (
+  IN  CHAR16                 *Url,
+  IN  UINTN                  WaitSeconds,
+  OUT HTTP_DOWNLOAD_SESSION  **Session
+  )
+{
+  EFI_STATUS  Status;
+  CHAR16      *LongPollUrl;
+  UINTN       LongPollUrlSize;
+
+  if ((Url == NULL) || (WaitSeconds == 0) || (Session == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (mLongPollSession != NULL) {
+    return EFI_ALREADY_STARTED;
+  }
+
+  LongPollUrlSize = StrSize (Url) + 32 * sizeof (CHAR16);
+  LongPollUrl     = AllocatePool (LongPollUrlSize);
+  if (LongPollUrl == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  UnicodeSPrint (
+    LongPollUrl,
+    LongPollUrlSize,
+    L"%s%cwait=%d",
+    Url,
+    (StrStr (Url, L"?") != NULL) ? L'&' : L'?',
+    WaitSeconds
+    );
+
+  //
+  // Sent from this module even when the download service is installed, the
+  // request is not a download to queue.
+  //
+  Status = StartHttpLongPollSession (LongPollUrl, WaitSeconds, Session);
+  DEBUG ((DEBUG_INFO, "HttpDownloadWaitForUpdate() StartHttpLongPollSession return %r\n", Status));
+  FreePool (LongPollUrl);
+
+  if (!EFI_ERROR (Status)) {
+    mLongPollSession = *Session;
+  }
+
+  return Status;
+}
+
+EFI_STATUS
+EFIAPI
+HttpDownloadPoll (
+  IN HTTP_DOWNLOAD_SESSION  *Session
+  )
+{
+  if (Session == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (Session->Service != NULL) {
+    return Session->Service->Poll (Session->Service, Session->ServiceRequest);
+  }
+
+  return PollHttpSession (Session);
+}
+
+EFI_STATUS
+EFIAPI
+HttpDownloadFinish (
+  IN  HTTP_DOWNLOAD_SESSION            *Session,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback OPTIONAL
+  )
+{
+  EFI_STATUS  Status;
+
+  if ((Session == NULL) || (BufferSize == NULL) || (Buffer == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (Session->Service != NULL) {
+    Status = Session->Service->Finish (
+                                 Session->Service,
+                                 Session->ServiceRequest,
+                                 BufferSize,
+                                 Buffer,
+                                 ProgressCallback
+                                 );
+    FreePool (Session);
+    return Status;
+  }
+
+  Session->Context.ProgressCallback = ProgressCallback;
+
+  do {
+    Status = PollHttpSession (Session);
+  } while (Status == EFI_NOT_READY);
+
+  DEBUG ((DEBUG_INFO, "HttpDownloadFinish() PollHttpSession return %r\n", Status));
+  if (!EFI_ERROR (Status)) {
+    *Buffer                         = Session->Context.DownloadBuffer;
+    *BufferSize                     = Session->Context.ContentDownloaded;
+    Session->Context.DownloadBuffer = NULL;
+  }
+
+  if (Session == mLongPollSession) {
+    mLongPollSession = NULL;
+  }
+
+  FreeHttpSession (Session);
+  return Status;
+}
+
+VOID
+EFIAPI
+HttpDownloadCancel (
+  IN HTTP_DOWNLOAD_SESSION  *Session
+  )
+{
+  if ((Session != NULL) && (Session->Service != NULL)) {
+    Session->Service->Cancel (Session->Service, Session->ServiceRequest);
+    FreePool (Session);
+    return;
+  }
+
+  if (Session == mLongPollSession) {
+    mLongPollSession = NULL;
+  }
+
+  FreeHttpSession (Session);
+}
+
+EFI_STATUS
+EFIAPI
+HttpDownloadFileFromMirrors (
+  IN  CHAR16                           **Urls,
+  IN  UINTN                            UrlCount,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback OPTIONAL
+  )
+{
+  EFI_STATUS                 Status;
+  EFI_OTA_DOWNLOAD_PROTOCOL  *Service;
+
+  if ((Urls == NULL) || (UrlCount == 0) || (BufferSize == NULL) || (Buffer == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  //
+  // A service older than the mirrors leaves them to this module.
+  //
+  Service = GetOtaDownloadService ();
+  if ((Service != NULL) && (Service->Revision >= EFI_OTA_DOWNLOAD_PROTOCOL_REVISION_MIRRORS)) {
+    return Service->DownloadFromMirrors (Service, Urls, UrlCount, BufferSize, Buffer, ProgressCallback);
+  }
+
+  Status = DownloadFromMirrors (Urls, UrlCount, BufferSize, Buffer, ProgressCallback);
+  DEBUG ((DEBUG_INFO, "HttpDownloadFileFromMirrors() DownloadFromMirrors return %r\n", Status));
+
+  return Status;
+}
+
+EFI_STATUS
+EFIAPI
+HttpDownloadFileMulticast (
+  IN  CHAR16                           *Url,
+  IN  CHAR16                           *MulticastAddress,
+  IN  UINT32                           SessionId,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback OPTIONAL
+  )
+{
+  EFI_STATUS  Status;
+
+  if ((Url == NULL) || (MulticastAddress == NULL) || (BufferSize == NULL) || (Buffer == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  //
+  // Received here even when the download service is installed, only the
+  // repairs go through HTTP.
+  //
+  Status = DownloadMulticast (Url, MulticastAddress, SessionId, BufferSize, Buffer, ProgressCallback);
+  DEBUG ((DEBUG_INFO, "HttpDownloadFileMulticast() DownloadMulticast return %r\n", Status));
+
+  return Status;
+}
+
+EFI_STATUS
+EFIAPI
+HttpDownloadParseUpdate (
+  IN  CONST VOID                 *Json,
+  IN  UINTN                      JsonSize,
+  OUT HTTP_DOWNLOAD_UPDATE_INFO  *Info
+  )
+{
+  if ((Json == NULL) || (Info == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  return ParseUpdateJson (Json, JsonSize, Info);
+}
+
+EFI_STATUS
+EFIAPI
+HttpDownloadJsonToUnicode (
+  IN  CONST HTTP_DOWNLOAD_JSON_STRING  *String,
+  OUT CHAR16                           *Buffer,
+  IN  UINTN                            BufferSize
+  )
+{
+  if ((String == NULL) || (Buffer == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  return JsonStringToUnicode (String, Buffer, BufferSize);
+}
+
+EFI_STATUS
+EFIAPI
+HttpDownloadVerifyBlocks (
+  IN  CONST VOID  *Image,
+  IN  UINTN       ImageSize,
+  IN  CONST VOID  *Manifest,
+  IN  UINTN       ManifestSize,
+  OUT UINTN       *BadBlock OPTIONAL
+  )
+{
+  UINTN  Block;
+
+  if ((Image == NULL) || (Manifest == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  return VerifyBlocks (Image, ImageSize, Manifest, ManifestSize, (BadBlock != NULL) ? BadBlock : &Block);
+}
+
+EFI_STATUS
+EFIAPI
+HttpDownloadGetStatistics (
+  OUT HTTP_DOWNLOAD_STATISTICS  *Statistics
+  )
+{
+  EFI_OTA_DOWNLOAD_PROTOCOL  *Service;
+
+  if (Statistics == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  //
+  // A service older than the statistics has none to return.
+  //
+  Service = GetOtaDownloadService ();
+  if (Service != NULL) {
+    if (Service->Revision < EFI_OTA_DOWNLOAD_PROTOCOL_REVISION_STATISTICS) {
+      return EFI_UNSUPPORTED;
+    }
+
+    return Service->GetStatistics (Service, Statistics);
+  }
+
+  CopyMem (Statistics, &gHttpDownloadStatistics, sizeof (HTTP_DOWNLOAD_STATISTICS));
+  return EFI_SUCCESS;
+}
+
+/**
+  Put the NIC configured with the cached lease back to DHCP when the module
+  is unloaded.
+
+  @param[in]  ImageHandle  The image handle of the module.
+  @param[in]  SystemTable  The EFI system table.
+
+  @retval  EFI_SUCCESS  Always.
+**/
+EFI_STATUS
+EFIAPI
+HttpDownloadLibDestructor (
+  IN EFI_HANDLE        ImageHandle,
+  IN EFI_SYSTEM_TABLE  *SystemTable
+  )
+{
+  RestoreCachedLeaseNic ();
+  return EFI_SUCCESS;
+}
@@ -0,0 +1,807 @@
+/** @file
+  Parse the /update response and the block manifest in place.
+
+  A small tokenizer walks the JSON text once, and the parser keeps from the
+  tokens the members it knows. Strings are returned as pointers into the
+  text, so nothing is allocated: the caller converts the ones it needs, and
+  can allocate the image buffer once from the size in the response.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+#include "Http.h"
+
+typedef enum {
+  JsonTokenEnd,
+  JsonTokenError,
+  JsonTokenObjectStart,
+  JsonTokenObjectEnd,
+  JsonTokenArrayStart,
+  JsonTokenArrayEnd,
+  JsonTokenColon,
+  JsonTokenComma,
+  JsonTokenString,
+  JsonTokenNumber,
+  JsonTokenLiteral
+} JSON_TOKEN_TYPE;
+
+typedef struct {
+  JSON_TOKEN_TYPE    Type;
+  //
+  // The text of the token, without the quotes of a string.
+  //
+  CONST CHAR8        *Start;
+  UINTN              Length;
+} JSON_TOKEN;
+
+typedef struct {
+  CONST CHAR8    *Pos;
+  CONST CHAR8    *End;
+} JSON_TOKENIZER;
+
+/**
+  Read the next token.
+
+  @param[in, out]  Tokenizer  The tokenizer.
+  @param[out]      Token      The token.
+
+  @return  The type of the token, JsonTokenEnd at the end of the text.
+**/
+STATIC
+JSON_TOKEN_TYPE
+JsonNextToken (
+  IN OUT JSON_TOKENIZER  *Tokenizer,
+  OUT    JSON_TOKEN      *Token
+  )
+{
+  CONST CHAR8  *Pos;
+  CHAR8        Char;
+
+  Pos = Tokenizer->Pos;
+  while ((Pos < Tokenizer->End) && ((*Pos == ' ') || (*Pos == '\t') || (*Pos == '\r') || (*Pos == '\n'))) {
+    Pos++;
+  }
+
+  Token->Start  = Pos;
+  Token->Length = 1;
+  if ((Pos == Tokenizer->End) || (*Pos == '\0')) {
+    Token->Type    = JsonTokenEnd;
+    Token->Length  = 0;
+    Tokenizer->Pos = Pos;
+    return Token->Type;
+  }
+
+  Char = *Pos++;
+  switch (Char) {
+    case '{':
+      Token->Type = JsonTokenObjectStart;
+      break;
+    case '}':
+      Token->Type = JsonTokenObjectEnd;
+      break;
+    case '[':
+      Token->Type = JsonTokenArrayStart;
+      break;
+    case ']':
+      Token->Type = JsonTokenArrayEnd;
+      break;
+    case ':':
+      Token->Type = JsonTokenColon;
+      break;
+    case ',':
+      Token->Type = JsonTokenComma;
+      break;
+
+    case '"':
+      //
+      // Up to the first quote not escaped, escapes are decoded by
+      // JsonStringToUnicode().
+      //
+      Token->Type  = JsonTokenError;
+      Token->Start = Pos;
+      while ((Pos < Tokenizer->End) && (*Pos != '"') && ((UINT8)*Pos >= 0x20)) {
+        if ((*Pos == '\\') && (Pos + 1 < Tokenizer->End)) {
+          Pos++;
+        }
+
+        Pos++;
+      }
+
+      if ((Pos < Tokenizer->End) && (*Pos == '"')) {
+        Token->Type   = JsonTokenString;
+        Token->Length = Pos - Token->Start;
+        Pos++;
+      }
+
+      break;
+
+    default:
+      if ((Char == '-') || ((Char >= '0') && (Char <= '9'))) {
+        Token->Type = JsonTokenNumber;
+        while ((Pos < Tokenizer->End) && (((*Pos >= '0') && (*Pos <= '9')) ||
+                                          (*Pos == '.') || (*Pos == 'e') || (*Pos == 'E') ||
+                                          (*Pos == '+') || (*Pos == '-')))
+        {
+          Pos++;
+        }
+      } else if ((Char >= 'a') && (Char <= 'z')) {
+        //
+        // true, false or null.
+        //
+        Token->Type = JsonTokenLiteral;
+        while ((Pos < Tokenizer->End) && (*Pos >= 'a') && (*Pos <= 'z')) {
+          Pos++;
+        }
+
+        Token->Length = Pos - Token->Start;
+        if (  !((Token->Length == 4) && (CompareMem (Token->Start, "true", 4) == 0))
+           && !((Token->Length == 5) && (CompareMem (Token->Start, "false", 5) == 0))
+           && !((Token->Length == 4) && (CompareMem (Token->Start, "null", 4) == 0)))
+        {
+          Token->Type = JsonTokenError;
+        }
+      } else {
+        Token->Type = JsonTokenError;
+      }
+
+      Token->Length = Pos - Token->Start;
+      break;
+  }
+
+  Tokenizer->Pos = Pos;
+  return Token->Type;
+}
+
+/**
+  Read the next member of an object.
+
+  @param[in, out]  Tokenizer  The tokenizer, after the opening brace.
+  @param[in, out]  First      TRUE before the first member, cleared.
+  @param[out]      Key        The key of the member.
+  @param[out]      Value      The first token of the value.
+
+  @retval  EFI_SUCCESS           Key and Value are read.
+  @retval  EFI_NOT_FOUND         The object ended.
+  @retval  EFI_COMPROMISED_DATA  The object is malformed.
+**/
+STATIC
+EFI_STATUS
+JsonNextMember (
+  IN OUT JSON_TOKENIZER  *Tokenizer,
+  IN OUT BOOLEAN         *First,
+  OUT    JSON_TOKEN      *Key,
+  OUT    JSON_TOKEN      *Value
+  )
+{
+  JsonNextToken (Tokenizer, Key);
+  if (Key->Type == JsonTokenObjectEnd) {
+    return EFI_NOT_FOUND;
+  }
+
+  if (!*First) {
+    if (Key->Type != JsonTokenComma) {
+      return EFI_COMPROMISED_DATA;
+    }
+
+    JsonNextToken (Tokenizer, Key);
+  }
+
+  *First = FALSE;
+  if (  (Key->Type != JsonTokenString)
+     || (JsonNextToken (Tokenizer, Value) != JsonTokenColon))
+  {
+    return EFI_COMPROMISED_DATA;
+  }
+
+  JsonNextToken (Tokenizer, Value);
+  return EFI_SUCCESS;
+}
+
+/**
+  Read the next item of an array.
+
+  @param[in, out]  Tokenizer  The tokenizer, after the opening bracket.
+  @param[in, out]  First      TRUE before the first item, cleared.
+  @param[out]      Value      The first token of the item.
+
+  @retval  EFI_SUCCESS           Value is read.
+  @retval  EFI_NOT_FOUND         The array ended.
+  @retval  EFI_COMPROMISED_DATA  The array is malformed.
+**/
+STATIC
+EFI_STATUS
+JsonNextItem (
+  IN OUT JSON_TOKENIZER  *Tokenizer,
+  IN OUT BOOLEAN         *First,
+  OUT    JSON_TOKEN      *Value
+  )
+{
+  JsonNextToken (Tokenizer, Value);
+  if (Value->Type == JsonTokenArrayEnd) {
+    return EFI_NOT_FOUND;
+  }
+
+  if (!*First) {
+    if (Value->Type != JsonTokenComma) {
+      return EFI_COMPROMISED_DATA;
+    }
+
+    JsonNextToken (Tokenizer, Value);
+  }
+
+  *First = FALSE;
+  return EFI_SUCCESS;
+}
+
+/**
+  Skip a value the parser does not know, whatever its nesting.
+
+  @param[in, out]  Tokenizer  The tokenizer, after the first token.
+  @param[in]       Value      The first token of the value.
+
+  @retval  EFI_SUCCESS           The value is skipped.
+  @retval  EFI_COMPROMISED_DATA  The value is malformed.
+**/
+STATIC
+EFI_STATUS
+JsonSkipValue (
+  IN OUT JSON_TOKENIZER  *Tokenizer,
+  IN     JSON_TOKEN      *Value
+  )
+{
+  JSON_TOKEN  Token;
+  UINTN       Depth;
+
+  switch (Value->Type) {
+    case JsonTokenString:
+    case JsonTokenNumber:
+    case JsonTokenLiteral:
+      return EFI_SUCCESS;
+
+    case JsonTokenObjectStart:
+    case JsonTokenArrayStart:
+      //
+      // The brackets are only counted, the separators inside are not
+      // checked.
+      //
+      for (Depth = 1; Depth > 0;) {
+        switch (JsonNextToken (Tokenizer, &Token)) {
+          case JsonTokenObjectStart:
+          case JsonTokenArrayStart:
+            Depth++;
+            break;
+          case JsonTokenObjectEnd:
+          case JsonTokenArrayEnd:
+            Depth--;
+            break;
+          case JsonTokenEnd:
+          case JsonTokenError:
+            return EFI_COMPROMISED_DATA;
+          default:
+            break;
+        }
+      }
+
+      return EFI_SUCCESS;
+
+    default:
+      return EFI_COMPROMISED_DATA;
+  }
+}
+
+/**
+  Check whether a token is a string equal to Text, escapes not decoded.
+
+  @param[in]  Token  The token.
+  @param[in]  Text   The text.
+
+  @retval  TRUE   The token is the string.
+  @retval  FALSE  Another token.
+**/
+STATIC
+BOOLEAN
+JsonIs (
+  IN CONST JSON_TOKEN  *Token,
+  IN CONST CHAR8       *Text
+  )
+{
+  return (BOOLEAN)(  (Token->Type == JsonTokenString)
+                  && (Token->Length == AsciiStrLen (Text))
+                  && (CompareMem (Token->Start, Text, Token->Length) == 0));
+}
+
+/**
+  Get a string value.
+
+  @param[in]   Token   The value.
+  @param[out]  String  The string.
+
+  @retval  EFI_SUCCESS           String is set.
+  @retval  EFI_COMPROMISED_DATA  The value is not a string.
+**/
+STATIC
+EFI_STATUS
+JsonGetString (
+  IN  CONST JSON_TOKEN           *Token,
+  OUT HTTP_DOWNLOAD_JSON_STRING  *String
+  )
+{
+  if (Token->Type != JsonTokenString) {
+    return EFI_COMPROMISED_DATA;
+  }
+
+  String->Data   = Token->Start;
+  String->Length = Token->Length;
+  return EFI_SUCCESS;
+}
+
+/**
+  Get a non-negative integer value.
+
+  @param[in]   Token  The value.
+  @param[out]  Value  The integer.
+
+  @retval  EFI_SUCCESS           Value is set.
+  @retval  EFI_COMPROMISED_DATA  The value is not such an integer, or does
+                                 not fit in 64 bits.
+**/
+STATIC
+EFI_STATUS
+JsonGetUint64 (
+  IN  CONST JSON_TOKEN  *Token,
+  OUT UINT64            *Value
+  )
+{
+  UINTN  Index;
+
+  if (Token->Type != JsonTokenNumber) {
+    return EFI_COMPROMISED_DATA;
+  }
+
+  *Value = 0;
+  for (Index = 0; Index < Token->Length; Index++) {
+    if (  (Token->Start[Index] < '0') || (Token->Start[Index] > '9')
+       || (*Value > DivU64x32 (MAX_UINT64 - (Token->Start[Index] - '0'), 10)))
+    {
+      return EFI_COMPROMISED_DATA;
+    }
+
+    *Value = MultU64x32 (*Value, 10) + (Token->Start[Index] - '0');
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Get a SHA-256 value, 64 hexadecimal digits.
+
+  @param[in]   Token   The value.
+  @param[out]  Digest  The 32 bytes of the digest.
+
+  @retval  EFI_SUCCESS           Digest is set.
+  @retval  EFI_COMPROMISED_DATA  The value is not a SHA-256.
+**/
+STATIC
+EFI_STATUS
+JsonGetSha256 (
+  IN  CONST JSON_TOKEN  *Token,
+  OUT UINT8             *Digest
+  )
+{
+  UINTN  Index;
+  CHAR8  Char;
+  UINT8  Nibble;
+
+  if ((Token->Type != JsonTokenString) || (Token->Length != 64)) {
+    return EFI_COMPROMISED_DATA;
+  }
+
+  for (Index = 0; Index < 64; Index++) {
+    Char = Token->Start[Index];
+    if ((Char >= '0') && (Char <= '9')) {
+      Nibble = (UINT8)(Char - '0');
+    } else if ((Char >= 'a') && (Char <= 'f')) {
+      Nibble = (UINT8)(Char - 'a' + 10);
+    } else if ((Char >= 'A') && (Char <= 'F')) {
+      Nibble = (UINT8)(Char - 'A' + 10);
+    } else {
+      return EFI_COMPROMISED_DATA;
+    }
+
+    if ((Index % 2) == 0) {
+      Digest[Index / 2] = (UINT8)(Nibble << 4);
+    } else {
+      Digest[Index / 2] |= Nibble;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Parse an entry of "artifacts": the block manifest, or a compressed image.
+  Other entries are skipped.
+
+  @param[in, out]  Tokenizer  The tokenizer, after the opening brace.
+  @param[in]       Name       The key of the entry.
+  @param[in, out]  Info       The members of the response.
+
+  @retval  EFI_SUCCESS           The entry is parsed.
+  @retval  EFI_COMPROMISED_DATA  The entry is malformed.
+**/
+STATIC
+EFI_STATUS
+ParseArtifact (
+  IN OUT JSON_TOKENIZER             *Tokenizer,
+  IN     CONST JSON_TOKEN           *Name,
+  IN OUT HTTP_DOWNLOAD_UPDATE_INFO  *Info
+  )
+{
+  EFI_STATUS              Status;
+  BOOLEAN                 First;
+  JSON_TOKEN              Key;
+  JSON_TOKEN              Value;
+  HTTP_DOWNLOAD_ENCODING  Encoding;
+  UINT64                  BlockSize;
+
+  ZeroMem (&Encoding, sizeof (Encoding));
+  BlockSize = 0;
+  First     = TRUE;
+  while (!EFI_ERROR (Status = JsonNextMember (Tokenizer, &First, &Key, &Value))) {
+    if (JsonIs (&Key, "encoding")) {
+      Status = JsonGetString (&Value, &Encoding.Encoding);
+    } else if (JsonIs (&Key, "url")) {
+      Status = JsonGetString (&Value, &Encoding.Url);
+    } else if (JsonIs (&Key, "size")) {
+      Status = JsonGetUint64 (&Value, &Encoding.Size);
+    } else if (JsonIs (&Key, "sha256")) {
+      Status             = JsonGetSha256 (&Value, Encoding.Sha256);
+      Encoding.HasSha256 = (BOOLEAN)!EFI_ERROR (Status);
+    } else if (JsonIs (&Key, "block_size")) {
+      Status = JsonGetUint64 (&Value, &BlockSize);
+    } else {
+      Status = JsonSkipValue (Tokenizer, &Value);
+    }
+
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  if (Status != EFI_NOT_FOUND) {
+    return Status;
+  }
+
+  if (JsonIs (Name, "manifest")) {
+    Info->ManifestUrl       = Encoding.Url;
+    Info->ManifestBlockSize = (UINTN)BlockSize;
+  } else if ((Encoding.Encoding.Data != NULL) && (Encoding.Url.Data != NULL) &&
+             (Info->EncodingCount < HTTP_DOWNLOAD_MAX_ENCODINGS))
+  {
+    CopyMem (&Info->Encodings[Info->EncodingCount++], &Encoding, sizeof (Encoding));
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Parse the /update response in a single pass, without allocating memory.
+
+  @param[in]   Json      The response body.
+  @param[in]   JsonSize  Size of the body in bytes.
+  @param[out]  Info      The members of the response, the strings pointing
+                         into Json.
+
+  @retval  EFI_SUCCESS           Info is filled.
+  @retval  EFI_COMPROMISED_DATA  The body is not a JSON object, or a known
+                                 member has a value of the wrong type.
+**/
+EFI_STATUS
+ParseUpdateJson (
+  IN  CONST CHAR8                *Json,
+  IN  UINTN                      JsonSize,
+  OUT HTTP_DOWNLOAD_UPDATE_INFO  *Info
+  )
+{
+  EFI_STATUS      Status;
+  JSON_TOKENIZER  Tokenizer;
+  JSON_TOKEN      Key;
+  JSON_TOKEN      Value;
+  JSON_TOKEN      Name;
+  BOOLEAN         First;
+  BOOLEAN         FirstItem;
+
+  ZeroMem (Info, sizeof (*Info));
+  Tokenizer.Pos = Json;
+  Tokenizer.End = Json + JsonSize;
+
+  if (JsonNextToken (&Tokenizer, &Value) != JsonTokenObjectStart) {
+    return EFI_COMPROMISED_DATA;
+  }
+
+  First = TRUE;
+  while (!EFI_ERROR (Status = JsonNextMember (&Tokenizer, &First, &Key, &Value))) {
+    if (JsonIs (&Key, "message")) {
+      Status = JsonGetString (&Value, &Info->Message);
+    } else if (JsonIs (&Key, "version")) {
+      Status = JsonGetString (&Value, &Info->Version);
+    } else if (JsonIs (&Key, "image_url")) {
+      Status = JsonGetString (&Value, &Info->ImageUrl);
+    } else if (JsonIs (&Key, "size")) {
+      Status = JsonGetUint64 (&Value, &Info->ImageSize);
+    } else if (JsonIs (&Key, "sha256")) {
+      Status          = JsonGetSha256 (&Value, Info->Sha256);
+      Info->HasSha256 = (BOOLEAN)!EFI_ERROR (Status);
+    } else if (JsonIs (&Key, "multicast")) {
+      Status = JsonGetString (&Value, &Info->Multicast);
+    } else if (JsonIs (&Key, "mirrors") && (Value.Type == JsonTokenArrayStart)) {
+      //
+      // Mirrors past HTTP_DOWNLOAD_MAX_MIRRORS are dropped.
+      //
+      FirstItem = TRUE;
+      while (!EFI_ERROR (Status = JsonNextItem (&Tokenizer, &FirstItem, &Value))) {
+        if (Value.Type != JsonTokenString) {
+          return EFI_COMPROMISED_DATA;
+        }
+
+        if (Info->MirrorCount < HTTP_DOWNLOAD_MAX_MIRRORS) {
+          JsonGetString (&Value, &Info->Mirrors[Info->MirrorCount++]);
+        }
+      }
+
+      Status = (Status == EFI_NOT_FOUND) ? EFI_SUCCESS : Status;
+    } else if (JsonIs (&Key, "artifacts") && (Value.Type == JsonTokenObjectStart)) {
+      FirstItem = TRUE;
+      while (!EFI_ERROR (Status = JsonNextMember (&Tokenizer, &FirstItem, &Name, &Value))) {
+        if (Value.Type == JsonTokenObjectStart) {
+          Status = ParseArtifact (&Tokenizer, &Name, Info);
+        } else {
+          Status = JsonSkipValue (&Tokenizer, &Value);
+        }
+
+        if (EFI_ERROR (Status)) {
+          return Status;
+        }
+      }
+
+      Status = (Status == EFI_NOT_FOUND) ? EFI_SUCCESS : Status;
+    } else if (JsonIs (&Key, "mirrors") || JsonIs (&Key, "artifacts")) {
+      Status = EFI_COMPROMISED_DATA;
+    } else {
+      Status = JsonSkipValue (&Tokenizer, &Value);
+    }
+
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  if (Status != EFI_NOT_FOUND) {
+    return Status;
+  }
+
+  //
+  // Nothing but spaces may follow the object.
+  //
+  if (JsonNextToken (&Tokenizer, &Value) != JsonTokenEnd) {
+    return EFI_COMPROMISED_DATA;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Parse a block manifest: the block size, and the SHA-256 of each block.
+
+  @param[in]   Json        The manifest.
+  @param[in]   JsonSize    Size of the manifest in bytes.
+  @param[out]  BlockSize   The block size.
+  @param[out]  Digests     The digests, 32 bytes each.
+  @param[in]   MaxBlocks   Number of digests Digests can hold.
+  @param[out]  BlockCount  Number of blocks of the manifest.
+
+  @retval  EFI_SUCCESS           The manifest is parsed.
+  @retval  EFI_COMPROMISED_DATA  The manifest is malformed, or has more than
+                                 MaxBlocks blocks.
+**/
+EFI_STATUS
+ParseManifestJson (
+  IN  CONST CHAR8  *Json,
+  IN  UINTN        JsonSize,
+  OUT UINTN        *BlockSize,
+  OUT UINT8        *Digests,
+  IN  UINTN        MaxBlocks,
+  OUT UINTN        *BlockCount
+  )
+{
+  EFI_STATUS      Status;
+  JSON_TOKENIZER  Tokenizer;
+  JSON_TOKEN      Key;
+  JSON_TOKEN      Value;
+  BOOLEAN         First;
+  BOOLEAN         FirstItem;
+  UINT64          Size;
+
+  *BlockSize    = 0;
+  *BlockCount   = 0;
+  Tokenizer.Pos = Json;
+  Tokenizer.End = Json + JsonSize;
+
+  if (JsonNextToken (&Tokenizer, &Value) != JsonTokenObjectStart) {
+    return EFI_COMPROMISED_DATA;
+  }
+
+  First = TRUE;
+  while (!EFI_ERROR (Status = JsonNextMember (&Tokenizer, &First, &Key, &Value))) {
+    if (JsonIs (&Key, "block_size")) {
+      Status = JsonGetUint64 (&Value, &Size);
+      if (!EFI_ERROR (Status) && ((Size == 0) || (Size > MAX_UINT32))) {
+        Status = EFI_COMPROMISED_DATA;
+      }
+
+      *BlockSize = (UINTN)Size;
+    } else if (JsonIs (&Key, "blocks") && (Value.Type == JsonTokenArrayStart)) {
+      FirstItem = TRUE;
+      while (!EFI_ERROR (Status = JsonNextItem (&Tokenizer, &FirstItem, &Value))) {
+        if (*BlockCount == MaxBlocks) {
+          return EFI_COMPROMISED_DATA;
+        }
+
+        Status = JsonGetSha256 (&Value, Digests + *BlockCount * 32);
+        if (EFI_ERROR (Status)) {
+          return Status;
+        }
+
+        (*BlockCount)++;
+      }
+
+      Status = (Status == EFI_NOT_FOUND) ? EFI_SUCCESS : Status;
+    } else if (JsonIs (&Key, "blocks")) {
+      Status = EFI_COMPROMISED_DATA;
+    } else {
+      Status = JsonSkipValue (&Tokenizer, &Value);
+    }
+
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  if ((Status != EFI_NOT_FOUND) || (*BlockSize == 0)) {
+    return EFI_COMPROMISED_DATA;
+  }
+
+  if (JsonNextToken (&Tokenizer, &Value) != JsonTokenEnd) {
+    return EFI_COMPROMISED_DATA;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Get the value of a hexadecimal digit.
+
+  @param[in]  Char  The digit.
+
+  @return  The value, or MAX_UINTN if Char is not a hexadecimal digit.
+**/
+STATIC
+UINTN
+HexValue (
+  IN CHAR8  Char
+  )
+{
+  if ((Char >= '0') && (Char <= '9')) {
+    return Char - '0';
+  }
+
+  if ((Char >= 'a') && (Char <= 'f')) {
+    return Char - 'a' + 10;
+  }
+
+  if ((Char >= 'A') && (Char <= 'F')) {
+    return Char - 'A' + 10;
+  }
+
+  return MAX_UINTN;
+}
+
+/**
+  Copy a JSON string to a CHAR16 buffer, decoding its escape sequences.
+  The server escapes every character that is not ASCII, the other bytes are
+  copied as they are. A character outside of the BMP stays as its two UTF-16
+  surrogates.
+
+  @param[in]   String      The string.
+  @param[out]  Buffer      The NUL terminated string.
+  @param[in]   BufferSize  Size of Buffer in characters.
+
+  @retval  EFI_SUCCESS            The string was copied.
+  @retval  EFI_NOT_FOUND          The member is absent.
+  @retval  EFI_BUFFER_TOO_SMALL   The string does not fit in Buffer.
+  @retval  EFI_INVALID_PARAMETER  The string has an invalid escape sequence.
+**/
+EFI_STATUS
+JsonStringToUnicode (
+  IN  CONST HTTP_DOWNLOAD_JSON_STRING  *String,
+  OUT CHAR16                           *Buffer,
+  IN  UINTN                            BufferSize
+  )
+{
+  CONST CHAR8  *Pos;
+  CONST CHAR8  *End;
+  UINTN        Length;
+  UINTN        Digit;
+  UINTN        Index;
+  CHAR16       Char;
+
+  if (String->Data == NULL) {
+    return EFI_NOT_FOUND;
+  }
+
+  Pos    = String->Data;
+  End    = String->Data + String->Length;
+  Length = 0;
+  while (Pos < End) {
+    Char = (UINT8)*Pos++;
+    if (Char == L'\\') {
+      if (Pos == End) {
+        return EFI_INVALID_PARAMETER;
+      }
+
+      switch (*Pos++) {
+        case '"':
+        case '\\':
+        case '/':
+          Char = (UINT8)Pos[-1];
+          break;
+        case 'b':
+          Char = L'\b';
+          break;
+        case 'f':
+          Char = L'\f';
+          break;
+        case 'n':
+          Char = L'\n';
+          break;
+        case 'r':
+          Char = L'\r';
+          break;
+        case 't':
+          Char = L'\t';
+          break;
+        case 'u':
+          if (End - Pos < 4) {
+            return EFI_INVALID_PARAMETER;
+          }
+
+          Char = 0;
+          for (Index = 0; Index < 4; Index++) {
+            Digit = HexValue (*Pos++);
+            if (Digit == MAX_UINTN) {
+              return EFI_INVALID_PARAMETER;
+            }
+
+            Char = (CHAR16)((Char << 4) | Digit);
+          }
+
+          break;
+        default:
+          return EFI_INVALID_PARAMETER;
+      }
+    }
+
+    if (Length + 1 >= BufferSize) {
+      return EFI_BUFFER_TOO_SMALL;
+    }
+
+    Buffer[Length++] = Char;
+  }
+
+  if (BufferSize == 0) {
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  Buffer[Length] = L'\0';
+  return EFI_SUCCESS;
+}
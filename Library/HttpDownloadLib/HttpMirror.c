@@ -0,0 +1,255 @@
+/** @file
+  Download a file from the fastest of several mirrors.
+
+  Each mirror is first probed with a small range request. The NIC is brought
+  up beforehand, so that its address configuration is not charged to the
+  first mirror. The requests are sent one after the other, the HTTP driver
+  connecting synchronously, then the responses are awaited together. A
+  mirror is ranked by the time to connect and send its request, plus the
+  time to complete its response counted from when all the requests were
+  sent, so that no mirror is charged for the connection of the others. The
+  file is then downloaded from the best mirror, failing over to the next
+  ones with a range request that resumes after the bytes already received.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+#include "Http.h"
+
+//
+// Size of the range requested from each mirror to rank them.
+//
+#define HTTP_MIRROR_PROBE_SIZE  SIZE_4KB
+
+//
+// Latency of a mirror that answered 503: it ranks after the mirrors that
+// answered, and is tried once they failed, waiting for its Retry-After.
+//
+#define HTTP_MIRROR_BUSY  (MAX_UINT64 - 1)
+
+typedef struct {
+  CHAR16                   *Url;
+  HTTP_DOWNLOAD_SESSION    *Session;
+  //
+  // Milliseconds to connect and send the probe.
+  //
+  UINT64                   ConnectMs;
+  //
+  // ConnectMs plus the milliseconds to complete the response, MAX_UINT64 if
+  // the mirror did not answer.
+  //
+  UINT64                   Latency;
+  UINTN                    FileSize;
+} HTTP_MIRROR;
+
+/**
+  Probe all the mirrors and sort them from the fastest to the slowest, then
+  the ones that answered 503, the ones that did not answer last.
+
+  @param[in, out]  Mirrors      The mirrors.
+  @param[in]       MirrorCount  Number of mirrors.
+
+  @retval  EFI_SUCCESS      At least one mirror answered.
+  @retval  EFI_NO_RESPONSE  No mirror answered, or only with 503.
+  @retval  Others           No NIC got an address.
+**/
+STATIC
+EFI_STATUS
+ProbeMirrors (
+  IN OUT HTTP_MIRROR  *Mirrors,
+  IN     UINTN        MirrorCount
+  )
+{
+  EFI_STATUS   Status;
+  UINTN        Index;
+  UINTN        Pending;
+  UINT64       Start;
+  UINT64       ResponseMs;
+  HTTP_MIRROR  Mirror;
+
+  for (Index = 0; Index < MirrorCount; Index++) {
+    Mirrors[Index].Latency = MAX_UINT64;
+  }
+
+  Status = StartHttpNic (Mirrors[0].Url);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "No NIC to probe the mirrors - %r\n", Status));
+    return Status;
+  }
+
+  StartReportClock ();
+
+  Pending = 0;
+  for (Index = 0; Index < MirrorCount; Index++) {
+    Start  = GetReportClock ();
+    Status = StartHttpProbeSession (Mirrors[Index].Url, HTTP_MIRROR_PROBE_SIZE, &Mirrors[Index].Session);
+    Mirrors[Index].ConnectMs = GetReportClock () - Start;
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_INFO, "Mirror %s unreachable - %r\n", Mirrors[Index].Url, Status));
+      Mirrors[Index].Session = NULL;
+      continue;
+    }
+
+    Pending++;
+  }
+
+  Start = GetReportClock ();
+  while (Pending != 0) {
+    for (Index = 0; Index < MirrorCount; Index++) {
+      if (Mirrors[Index].Session == NULL) {
+        continue;
+      }
+
+      Status = PollHttpSession (Mirrors[Index].Session);
+      if (Status == EFI_NOT_READY) {
+        continue;
+      }
+
+      //
+      // A mirror giving no file size, e.g. answering 204, cannot be used.
+      //
+      ResponseMs              = GetReportClock () - Start;
+      Mirrors[Index].FileSize = Mirrors[Index].Session->Context.TotalLength;
+      if (!EFI_ERROR (Status) && (Mirrors[Index].FileSize != 0)) {
+        Mirrors[Index].Latency = Mirrors[Index].ConnectMs + ResponseMs;
+      } else if (Mirrors[Index].Session->Context.ServerBusy) {
+        Mirrors[Index].Latency = HTTP_MIRROR_BUSY;
+      }
+
+      DEBUG ((
+        DEBUG_INFO,
+        "Mirror %s probe - %r, connect %Lu ms, response %Lu ms, 0x%x bytes\n",
+        Mirrors[Index].Url,
+        Status,
+        Mirrors[Index].ConnectMs,
+        ResponseMs,
+        Mirrors[Index].FileSize
+        ));
+
+      FreeHttpSession (Mirrors[Index].Session);
+      Mirrors[Index].Session = NULL;
+      Pending--;
+    }
+  }
+
+  StopReportClock ();
+
+  //
+  // Insertion sort, there are only a few mirrors.
+  //
+  for (Index = 1; Index < MirrorCount; Index++) {
+    CopyMem (&Mirror, &Mirrors[Index], sizeof (HTTP_MIRROR));
+    for (Pending = Index; Pending > 0 && Mirrors[Pending - 1].Latency > Mirror.Latency; Pending--) {
+      CopyMem (&Mirrors[Pending], &Mirrors[Pending - 1], sizeof (HTTP_MIRROR));
+    }
+
+    CopyMem (&Mirrors[Pending], &Mirror, sizeof (HTTP_MIRROR));
+  }
+
+  //
+  // The file size comes from a mirror that answered.
+  //
+  return (Mirrors[0].Latency >= HTTP_MIRROR_BUSY) ? EFI_NO_RESPONSE : EFI_SUCCESS;
+}
+
+/**
+  Download a file from the fastest of several mirrors serving the same file,
+  failing over to the next mirror without downloading again the bytes
+  already received.
+
+  @param[in]   Urls              The URLs of the file on each mirror.
+  @param[in]   UrlCount          Number of URLs.
+  @param[out]  BufferSize        Size of the downloaded file.
+  @param[out]  Buffer            The downloaded file, to be freed by the
+                                 caller with FreePool().
+  @param[in]   ProgressCallback  Reports the progress of the download.
+
+  @retval  EFI_SUCCESS           The file was downloaded.
+  @retval  EFI_NO_RESPONSE       No mirror answered the probe.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                The download failed on every mirror.
+**/
+EFI_STATUS
+DownloadFromMirrors (
+  IN  CHAR16                           **Urls,
+  IN  UINTN                            UrlCount,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback  OPTIONAL
+  )
+{
+  EFI_STATUS             Status;
+  HTTP_MIRROR            *Mirrors;
+  HTTP_DOWNLOAD_SESSION  *Session;
+  UINT8                  *File;
+  UINTN                  FileSize;
+  UINTN                  Received;
+  UINTN                  Index;
+
+  File    = NULL;
+  Mirrors = AllocateZeroPool (UrlCount * sizeof (HTTP_MIRROR));
+  if (Mirrors == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  for (Index = 0; Index < UrlCount; Index++) {
+    Mirrors[Index].Url = Urls[Index];
+  }
+
+  Status = ProbeMirrors (Mirrors, UrlCount);
+  if (EFI_ERROR (Status)) {
+    goto ON_EXIT;
+  }
+
+  FileSize = Mirrors[0].FileSize;
+  File     = AllocatePool (FileSize);
+  if (File == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto ON_EXIT;
+  }
+
+  Received = 0;
+  Status   = EFI_NO_RESPONSE;
+  for (Index = 0; Index < UrlCount && Mirrors[Index].Latency != MAX_UINT64; Index++) {
+    if ((Mirrors[Index].Latency != HTTP_MIRROR_BUSY) && (Mirrors[Index].FileSize != FileSize)) {
+      DEBUG ((DEBUG_WARN, "Mirror %s serves a file of another size\n", Mirrors[Index].Url));
+      continue;
+    }
+
+    DEBUG ((DEBUG_INFO, "Downloading from mirror %s at offset 0x%x\n", Mirrors[Index].Url, Received));
+
+    Status = StartHttpRangeSession (Mirrors[Index].Url, Received, 0, File, FileSize, &Session);
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    Session->Context.ProgressCallback = ProgressCallback;
+
+    do {
+      Status = PollHttpSession (Session);
+    } while (Status == EFI_NOT_READY);
+
+    //
+    // Keep what arrived, the next mirror resumes from there.
+    //
+    Received = Session->Context.ContentDownloaded;
+    FreeHttpSession (Session);
+
+    if (!EFI_ERROR (Status)) {
+      break;
+    }
+
+    DEBUG ((DEBUG_WARN, "Mirror %s failed at offset 0x%x - %r\n", Mirrors[Index].Url, Received, Status));
+  }
+
+ON_EXIT:
+  if (EFI_ERROR (Status)) {
+    LIB_FREE_NON_NULL (File);
+  } else {
+    *Buffer     = File;
+    *BufferSize = FileSize;
+  }
+
+  FreePool (Mirrors);
+  return Status;
+}
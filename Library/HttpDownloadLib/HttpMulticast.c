@@ -0,0 +1,764 @@
+/** @file
+  Receive a file sent to a UDP multicast group, then repair it over HTTP.
+
+  The server sends the file in numbered blocks, in rounds, each group of
+  blocks followed by the XOR of its blocks. The receiver joins the group on
+  the NIC of the last HTTP download and stores every block of the file it
+  hears of, until it has them all, a whole round went by, or the group goes
+  quiet. A group missing a single block gets it back from its parity block.
+  The blocks still missing are then downloaded with HTTP range requests, so
+  that packet loss only costs the bytes lost.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+#include "Http.h"
+
+#define HTTP_MULTICAST_MAGIC    SIGNATURE_32 ('U', 'O', 'T', 'M')
+#define HTTP_MULTICAST_VERSION  1
+#define HTTP_MULTICAST_DATA     0
+#define HTTP_MULTICAST_PARITY   1
+
+//
+// Largest packet accepted, a jumbo frame.
+//
+#define HTTP_MULTICAST_MAX_PACKET  9000
+
+//
+// Time to wait for the first packet of the file, then between two packets.
+//
+#define HTTP_MULTICAST_START_TIMEOUT  EFI_TIMER_PERIOD_SECONDS (5)
+#define HTTP_MULTICAST_IDLE_TIMEOUT   EFI_TIMER_PERIOD_SECONDS (2)
+
+//
+// Missing blocks separated by at most this many received blocks are repaired
+// with one range request.
+//
+#define HTTP_MULTICAST_REPAIR_GAP  16
+
+#pragma pack(1)
+//
+// Header of each packet, in network byte order.
+//
+typedef struct {
+  UINT32    Magic;
+  UINT8     Version;
+  UINT8     Type;
+  UINT16    Length;
+  //
+  // The first 32 bits of the SHA-256 of the file.
+  //
+  UINT32    Session;
+  //
+  // Block number, group number for a parity block.
+  //
+  UINT32    Index;
+  UINT32    BlockCount;
+  UINT16    BlockSize;
+  UINT8     GroupSize;
+  UINT8     Reserved;
+  UINT64    FileSize;
+} HTTP_MULTICAST_HEADER;
+#pragma pack()
+
+typedef struct {
+  UINT32    Session;
+  UINT8     *File;
+  UINTN     FileSize;
+  UINTN     BlockCount;
+  UINTN     BlockSize;
+  UINTN     GroupSize;
+  UINTN     GroupCount;
+  //
+  // One byte per data block, TRUE once received.
+  //
+  UINT8     *HasBlock;
+  UINTN     BlockReceived;
+  //
+  // The parity block of each group and whether it was received.
+  //
+  UINT8     *Parity;
+  UINT8     *HasParity;
+  //
+  // The first data block received, seeing it again ends the round.
+  //
+  UINTN     FirstBlock;
+  BOOLEAN   RoundDone;
+  UINTN     LastPercent;
+} HTTP_MULTICAST_FILE;
+
+/**
+  Record the completion of a receive token.
+
+  @param[in] Event:   The token event.
+  @param[in] Context: The completion flag.
+**/
+STATIC
+VOID
+EFIAPI
+MulticastReceiveCallback (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  *(BOOLEAN *)Context = TRUE;
+}
+
+/**
+  Parse a multicast address like L"239.255.0.1:5001".
+
+  @param[in]   Address  The address.
+  @param[out]  Group    The multicast group.
+  @param[out]  Port     The UDP port.
+
+  @retval  EFI_SUCCESS            The address was parsed.
+  @retval  EFI_INVALID_PARAMETER  The address is malformed or not multicast.
+**/
+STATIC
+EFI_STATUS
+ParseMulticastAddress (
+  IN  CONST CHAR16      *Address,
+  OUT EFI_IPv4_ADDRESS  *Group,
+  OUT UINT16            *Port
+  )
+{
+  CHAR16  GroupStr[16];
+  CHAR16  *Colon;
+  UINTN   PortNumber;
+
+  Colon = StrStr (Address, L":");
+  if ((Colon == NULL) || ((UINTN)(Colon - Address) >= ARRAY_SIZE (GroupStr))) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  StrnCpyS (GroupStr, ARRAY_SIZE (GroupStr), Address, Colon - Address);
+  if (EFI_ERROR (NetLibStrToIp4 (GroupStr, Group)) || !IP4_IS_MULTICAST (NTOHL (*(UINT32 *)Group))) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  PortNumber = StrDecimalToUintn (Colon + 1);
+  if ((PortNumber == 0) || (PortNumber > MAX_UINT16)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  *Port = (UINT16)PortNumber;
+  return EFI_SUCCESS;
+}
+
+/**
+  Find the NIC to receive on: the one of the last HTTP download, which has an
+  address already, else the first one with a link.
+
+  @param[out]  ControllerHandle  The NIC.
+
+  @retval  EFI_SUCCESS    A NIC was found.
+  @retval  EFI_NOT_FOUND  No NIC produces UDP4.
+**/
+STATIC
+EFI_STATUS
+FindMulticastNic (
+  OUT EFI_HANDLE  *ControllerHandle
+  )
+{
+  EFI_STATUS  Status;
+  EFI_HANDLE  *Handles;
+  UINTN       HandleCount;
+  UINTN       Index;
+  BOOLEAN     MediaPresent;
+
+  Status = gBS->LocateHandleBuffer (
+                  ByProtocol,
+                  &gEfiUdp4ServiceBindingProtocolGuid,
+                  NULL,
+                  &HandleCount,
+                  &Handles
+                  );
+  if (EFI_ERROR (Status) || (HandleCount == 0)) {
+    return EFI_NOT_FOUND;
+  }
+
+  *ControllerHandle = Handles[0];
+  for (Index = 0; Index < HandleCount; Index++) {
+    if (Handles[Index] == gPreferredNicHandle) {
+      *ControllerHandle = Handles[Index];
+      break;
+    }
+  }
+
+  if (Index == HandleCount) {
+    for (Index = 0; Index < HandleCount; Index++) {
+      MediaPresent = TRUE;
+      NetLibDetectMedia (Handles[Index], &MediaPresent);
+      if (MediaPresent) {
+        *ControllerHandle = Handles[Index];
+        break;
+      }
+    }
+  }
+
+  FreePool (Handles);
+  return EFI_SUCCESS;
+}
+
+/**
+  Set the file up from the header of its first packet.
+
+  @param[in, out]  File    The file, its session set.
+  @param[in]       Header  The header, in network byte order.
+
+  @retval  EFI_SUCCESS           The file is ready to receive blocks.
+  @retval  EFI_PROTOCOL_ERROR    The header is inconsistent.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+**/
+STATIC
+EFI_STATUS
+StartMulticastFile (
+  IN OUT HTTP_MULTICAST_FILE    *File,
+  IN     HTTP_MULTICAST_HEADER  *Header
+  )
+{
+  UINT64  FileSize;
+
+  FileSize         = SwapBytes64 (Header->FileSize);
+  File->BlockSize  = NTOHS (Header->BlockSize);
+  File->GroupSize  = Header->GroupSize;
+  File->BlockCount = NTOHL (Header->BlockCount);
+  if ((FileSize == 0) || (FileSize > MAX_UINTN) || (File->BlockSize == 0) || (File->GroupSize == 0) ||
+      (File->BlockSize > HTTP_MULTICAST_MAX_PACKET - sizeof (HTTP_MULTICAST_HEADER)) ||
+      (File->BlockCount != DivU64x32 (FileSize + File->BlockSize - 1, (UINT32)File->BlockSize)))
+  {
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  File->FileSize   = (UINTN)FileSize;
+  File->GroupCount = (File->BlockCount + File->GroupSize - 1) / File->GroupSize;
+  File->File       = AllocatePool (File->FileSize);
+  File->HasBlock   = AllocateZeroPool (File->BlockCount);
+  File->Parity     = AllocatePool (File->GroupCount * File->BlockSize);
+  File->HasParity  = AllocateZeroPool (File->GroupCount);
+  if ((File->File == NULL) || (File->HasBlock == NULL) || (File->Parity == NULL) || (File->HasParity == NULL)) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  File->FirstBlock = MAX_UINTN;
+  DEBUG ((DEBUG_INFO, "Multicast file 0x%x bytes, 0x%x blocks of 0x%x\n", File->FileSize, File->BlockCount, File->BlockSize));
+  return EFI_SUCCESS;
+}
+
+/**
+  Get the size of a data block, the last one may be short.
+
+  @param[in]  File   The file.
+  @param[in]  Block  The block number.
+
+  @return  The size of the block.
+**/
+STATIC
+UINTN
+MulticastBlockLength (
+  IN HTTP_MULTICAST_FILE  *File,
+  IN UINTN                Block
+  )
+{
+  return MIN (File->BlockSize, File->FileSize - Block * File->BlockSize);
+}
+
+/**
+  Store the block carried by a packet, ignoring packets of other files and
+  malformed ones.
+
+  @param[in, out]  File        The file.
+  @param[in]       Packet      The packet.
+  @param[in]       PacketSize  Size of the packet.
+
+  @retval  EFI_SUCCESS           The packet was handled.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+**/
+STATIC
+EFI_STATUS
+ReceiveMulticastPacket (
+  IN OUT HTTP_MULTICAST_FILE  *File,
+  IN     UINT8                *Packet,
+  IN     UINTN                PacketSize
+  )
+{
+  EFI_STATUS             Status;
+  HTTP_MULTICAST_HEADER  *Header;
+  UINTN                  Index;
+  UINTN                  Length;
+
+  Header = (HTTP_MULTICAST_HEADER *)Packet;
+  if ((PacketSize < sizeof (HTTP_MULTICAST_HEADER)) ||
+      (Header->Magic != HTTP_MULTICAST_MAGIC) ||
+      (Header->Version != HTTP_MULTICAST_VERSION) ||
+      (NTOHL (Header->Session) != File->Session))
+  {
+    return EFI_SUCCESS;
+  }
+
+  if (File->File == NULL) {
+    Status = StartMulticastFile (File, Header);
+    if (Status == EFI_PROTOCOL_ERROR) {
+      DEBUG ((DEBUG_WARN, "Multicast header inconsistent\n"));
+      return EFI_SUCCESS;
+    }
+
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+  }
+
+  if ((SwapBytes64 (Header->FileSize) != File->FileSize) || (NTOHS (Header->BlockSize) != File->BlockSize) ||
+      (Header->GroupSize != File->GroupSize))
+  {
+    return EFI_SUCCESS;
+  }
+
+  Index  = NTOHL (Header->Index);
+  Length = NTOHS (Header->Length);
+  if (Length > PacketSize - sizeof (HTTP_MULTICAST_HEADER)) {
+    return EFI_SUCCESS;
+  }
+
+  if (Header->Type == HTTP_MULTICAST_PARITY) {
+    if ((Index < File->GroupCount) && (Length == File->BlockSize) && !File->HasParity[Index]) {
+      CopyMem (File->Parity + Index * File->BlockSize, Header + 1, Length);
+      File->HasParity[Index] = TRUE;
+    }
+
+    return EFI_SUCCESS;
+  }
+
+  if ((Header->Type != HTTP_MULTICAST_DATA) || (Index >= File->BlockCount) ||
+      (Length != MulticastBlockLength (File, Index)))
+  {
+    return EFI_SUCCESS;
+  }
+
+  if (File->HasBlock[Index]) {
+    //
+    // The sender came back to where we started listening.
+    //
+    File->RoundDone = (BOOLEAN)(Index == File->FirstBlock);
+    return EFI_SUCCESS;
+  }
+
+  if (File->FirstBlock == MAX_UINTN) {
+    File->FirstBlock = Index;
+  }
+
+  CopyMem (File->File + Index * File->BlockSize, Header + 1, Length);
+  File->HasBlock[Index] = TRUE;
+  File->BlockReceived++;
+  return EFI_SUCCESS;
+}
+
+/**
+  Report the multicast progress, once per percent.
+
+  @param[in, out]  File              The file.
+  @param[in]       ProgressCallback  The callback, NULL for none.
+**/
+STATIC
+VOID
+ReportMulticastProgress (
+  IN OUT HTTP_MULTICAST_FILE              *File,
+  IN     HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback  OPTIONAL
+  )
+{
+  CHAR16  Message[64];
+  UINTN   Percent;
+
+  Percent = File->BlockReceived * 100 / File->BlockCount;
+  if ((ProgressCallback == NULL) || (Percent == File->LastPercent)) {
+    return;
+  }
+
+  File->LastPercent = Percent;
+  UnicodeSPrint (Message, sizeof (Message), L"Multicast: %d%% of %d Kb", Percent, File->FileSize / 1024);
+  ProgressCallback (Message);
+}
+
+/**
+  Receive the packets sent to the group until the file is complete, a round
+  went by, or no packet came for a while.
+
+  @param[in]       Udp4              The UDP4 instance, member of the group.
+  @param[in, out]  File              The file.
+  @param[in]       ProgressCallback  Reports the progress.
+
+  @retval  EFI_SUCCESS           Some or all of the file was received.
+  @retval  EFI_TIMEOUT           No packet of the file came.
+  @retval  Others                The reception failed.
+**/
+STATIC
+EFI_STATUS
+ReceiveMulticastRound (
+  IN     EFI_UDP4_PROTOCOL                *Udp4,
+  IN OUT HTTP_MULTICAST_FILE              *File,
+  IN     HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback  OPTIONAL
+  )
+{
+  EFI_STATUS                 Status;
+  EFI_UDP4_COMPLETION_TOKEN  Token;
+  EFI_UDP4_RECEIVE_DATA      *RxData;
+  EFI_EVENT                  Timer;
+  volatile BOOLEAN           Received;
+  UINT8                      *Packet;
+  UINTN                      PacketSize;
+  UINTN                      Index;
+
+  Timer  = NULL;
+  Packet = AllocatePool (HTTP_MULTICAST_MAX_PACKET);
+  if (Packet == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  ZeroMem (&Token, sizeof (Token));
+  Status = gBS->CreateEvent (
+                  EVT_NOTIFY_SIGNAL,
+                  TPL_CALLBACK,
+                  MulticastReceiveCallback,
+                  (VOID *)&Received,
+                  &Token.Event
+                  );
+  if (EFI_ERROR (Status)) {
+    goto ON_EXIT;
+  }
+
+  Status = gBS->CreateEvent (EVT_TIMER, TPL_CALLBACK, NULL, NULL, &Timer);
+  if (EFI_ERROR (Status)) {
+    goto ON_EXIT;
+  }
+
+  gBS->SetTimer (Timer, TimerRelative, HTTP_MULTICAST_START_TIMEOUT);
+
+  while ((File->File == NULL) || ((File->BlockReceived < File->BlockCount) && !File->RoundDone)) {
+    Received = FALSE;
+    Status   = Udp4->Receive (Udp4, &Token);
+    if (EFI_ERROR (Status)) {
+      goto ON_EXIT;
+    }
+
+    while (!Received && (gBS->CheckEvent (Timer) == EFI_NOT_READY)) {
+      Udp4->Poll (Udp4);
+    }
+
+    if (!Received) {
+      Udp4->Cancel (Udp4, &Token);
+      Status = (File->File == NULL) ? EFI_TIMEOUT : EFI_SUCCESS;
+      DEBUG ((DEBUG_INFO, "Multicast idle, 0x%x of 0x%x blocks\n", File->BlockReceived, File->BlockCount));
+      goto ON_EXIT;
+    }
+
+    if (EFI_ERROR (Token.Status)) {
+      continue;
+    }
+
+    //
+    // Gather the fragments, a packet too big for the buffer is not ours.
+    //
+    RxData     = Token.Packet.RxData;
+    PacketSize = 0;
+    if (RxData->DataLength <= HTTP_MULTICAST_MAX_PACKET) {
+      for (Index = 0; Index < RxData->FragmentCount; Index++) {
+        CopyMem (Packet + PacketSize, RxData->FragmentTable[Index].FragmentBuffer, RxData->FragmentTable[Index].FragmentLength);
+        PacketSize += RxData->FragmentTable[Index].FragmentLength;
+      }
+    }
+
+    gBS->SignalEvent (RxData->RecycleSignal);
+
+    Status = ReceiveMulticastPacket (File, Packet, PacketSize);
+    if (EFI_ERROR (Status)) {
+      goto ON_EXIT;
+    }
+
+    if (File->File != NULL) {
+      gBS->SetTimer (Timer, TimerRelative, HTTP_MULTICAST_IDLE_TIMEOUT);
+      ReportMulticastProgress (File, ProgressCallback);
+    }
+  }
+
+  Status = EFI_SUCCESS;
+
+ON_EXIT:
+  if (Timer != NULL) {
+    gBS->CloseEvent (Timer);
+  }
+
+  if (Token.Event != NULL) {
+    gBS->CloseEvent (Token.Event);
+  }
+
+  FreePool (Packet);
+  return Status;
+}
+
+/**
+  Rebuild the groups missing a single data block from their parity block.
+
+  @param[in, out]  File  The file.
+
+  @return  The number of blocks rebuilt.
+**/
+STATIC
+UINTN
+RecoverMulticastBlocks (
+  IN OUT HTTP_MULTICAST_FILE  *File
+  )
+{
+  UINTN  Group;
+  UINTN  First;
+  UINTN  Last;
+  UINTN  Block;
+  UINTN  Missing;
+  UINTN  MissingCount;
+  UINTN  Offset;
+  UINT8  *Parity;
+  UINT8  *Data;
+  UINTN  Recovered;
+
+  Recovered = 0;
+  for (Group = 0; Group < File->GroupCount; Group++) {
+    if (!File->HasParity[Group]) {
+      continue;
+    }
+
+    First        = Group * File->GroupSize;
+    Last         = MIN (First + File->GroupSize, File->BlockCount);
+    Missing      = 0;
+    MissingCount = 0;
+    for (Block = First; Block < Last; Block++) {
+      if (!File->HasBlock[Block]) {
+        Missing = Block;
+        MissingCount++;
+      }
+    }
+
+    if (MissingCount != 1) {
+      continue;
+    }
+
+    //
+    // XOR the other blocks into the parity block, the short last block
+    // counting as padded with zeros.
+    //
+    Parity = File->Parity + Group * File->BlockSize;
+    for (Block = First; Block < Last; Block++) {
+      if (Block == Missing) {
+        continue;
+      }
+
+      Data = File->File + Block * File->BlockSize;
+      for (Offset = 0; Offset < MulticastBlockLength (File, Block); Offset++) {
+        Parity[Offset] ^= Data[Offset];
+      }
+    }
+
+    CopyMem (File->File + Missing * File->BlockSize, Parity, MulticastBlockLength (File, Missing));
+    File->HasBlock[Missing] = TRUE;
+    File->BlockReceived++;
+    Recovered++;
+  }
+
+  return Recovered;
+}
+
+/**
+  Download the blocks still missing with range requests, a request covering
+  the small gaps between missing blocks too.
+
+  @param[in]       Url   The URL of the file on the HTTP server.
+  @param[in, out]  File  The file.
+
+  @retval  EFI_SUCCESS  The file is complete.
+  @retval  Others       A range request failed.
+**/
+STATIC
+EFI_STATUS
+RepairMulticastBlocks (
+  IN     CHAR16               *Url,
+  IN OUT HTTP_MULTICAST_FILE  *File
+  )
+{
+  EFI_STATUS             Status;
+  HTTP_DOWNLOAD_SESSION  *Session;
+  UINTN                  First;
+  UINTN                  Last;
+  UINTN                  Block;
+  UINTN                  Start;
+  UINTN                  End;
+
+  for (First = 0; First < File->BlockCount; First = Last + 1) {
+    while ((First < File->BlockCount) && File->HasBlock[First]) {
+      First++;
+    }
+
+    if (First == File->BlockCount) {
+      break;
+    }
+
+    Last = First;
+    for (Block = First + 1; Block < File->BlockCount && Block <= Last + HTTP_MULTICAST_REPAIR_GAP + 1; Block++) {
+      if (!File->HasBlock[Block]) {
+        Last = Block;
+      }
+    }
+
+    Start = First * File->BlockSize;
+    End   = Start + (Last - First) * File->BlockSize + MulticastBlockLength (File, Last);
+    DEBUG ((DEBUG_INFO, "Multicast repair of bytes 0x%x-0x%x\n", Start, End - 1));
+
+    //
+    // The buffer given ends with the range, as a session receives up to the
+    // end of its buffer.
+    //
+    Status = StartHttpRangeSession (Url, Start, End - Start, File->File, End, &Session);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    do {
+      Status = PollHttpSession (Session);
+    } while (Status == EFI_NOT_READY);
+
+    //
+    // The blocks are only repaired once all their bytes are in the buffer.
+    //
+    if (!EFI_ERROR (Status) && (Session->Context.ContentDownloaded != End)) {
+      DEBUG ((DEBUG_WARN, "Multicast repair stopped at 0x%x\n", Session->Context.ContentDownloaded));
+      Status = EFI_PROTOCOL_ERROR;
+    }
+
+    FreeHttpSession (Session);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    for (Block = First; Block <= Last; Block++) {
+      File->HasBlock[Block] = TRUE;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+  Receive a file from a multicast group, repairing the missing blocks from
+  the HTTP server.
+
+  @param[in]   Url               The URL of the file on the HTTP server.
+  @param[in]   Address           The multicast group and port, like
+                                 L"239.255.0.1:5001".
+  @param[in]   SessionId         The first 32 bits of the SHA-256 of the
+                                 file.
+  @param[out]  BufferSize        Size of the file.
+  @param[out]  Buffer            The file, to be freed with FreePool().
+  @param[in]   ProgressCallback  Reports the progress.
+
+  @retval  EFI_SUCCESS            The file was received.
+  @retval  EFI_INVALID_PARAMETER  Address is not a multicast address.
+  @retval  EFI_NOT_FOUND          No NIC produces UDP4.
+  @retval  EFI_NO_MAPPING         The NIC has no address yet.
+  @retval  EFI_TIMEOUT            Nothing of the file was sent to the group.
+  @retval  Others                 The reception or a repair failed.
+**/
+EFI_STATUS
+DownloadMulticast (
+  IN  CHAR16                           *Url,
+  IN  CONST CHAR16                     *Address,
+  IN  UINT32                           SessionId,
+  OUT UINTN                            *BufferSize,
+  OUT VOID                             **Buffer,
+  IN  HTTP_DOWNLOAD_PROGRESS_CALLBACK  ProgressCallback  OPTIONAL
+  )
+{
+  EFI_STATUS            Status;
+  EFI_IPv4_ADDRESS      Group;
+  UINT16                Port;
+  EFI_HANDLE            ControllerHandle;
+  EFI_HANDLE            ChildHandle;
+  EFI_UDP4_PROTOCOL     *Udp4;
+  EFI_UDP4_CONFIG_DATA  ConfigData;
+  HTTP_MULTICAST_FILE   File;
+  UINTN                 Recovered;
+
+  Status = ParseMulticastAddress (Address, &Group, &Port);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = FindMulticastNic (&ControllerHandle);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = CreateServiceChildAndOpenProtocol (
+             ControllerHandle,
+             &gEfiUdp4ServiceBindingProtocolGuid,
+             &gEfiUdp4ProtocolGuid,
+             &ChildHandle,
+             (VOID **)&Udp4
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  ZeroMem (&File, sizeof (File));
+  File.Session = SessionId;
+
+  ZeroMem (&ConfigData, sizeof (ConfigData));
+  ConfigData.AllowDuplicatePort = TRUE;
+  ConfigData.TimeToLive         = 1;
+  ConfigData.UseDefaultAddress  = TRUE;
+  ConfigData.StationPort        = Port;
+  Status                        = Udp4->Configure (Udp4, &ConfigData);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "Multicast UDP4 configuration failed - %r\n", Status));
+    goto ON_EXIT;
+  }
+
+  Status = Udp4->Groups (Udp4, TRUE, &Group);
+  if (!EFI_ERROR (Status)) {
+    Status = ReceiveMulticastRound (Udp4, &File, ProgressCallback);
+    Udp4->Groups (Udp4, FALSE, &Group);
+  }
+
+  Udp4->Configure (Udp4, NULL);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "Multicast reception from %s failed - %r\n", Address, Status));
+    goto ON_EXIT;
+  }
+
+  Recovered = RecoverMulticastBlocks (&File);
+  DEBUG ((
+    DEBUG_INFO,
+    "Multicast received 0x%x blocks, 0x%x from parity, 0x%x to repair\n",
+    File.BlockReceived - Recovered,
+    Recovered,
+    File.BlockCount - File.BlockReceived
+    ));
+
+  Status = RepairMulticastBlocks (Url, &File);
+
+ON_EXIT:
+  CloseProtocolAndDestroyServiceChild (
+    ControllerHandle,
+    &gEfiUdp4ServiceBindingProtocolGuid,
+    &gEfiUdp4ProtocolGuid,
+    ChildHandle
+    );
+
+  if (EFI_ERROR (Status)) {
+    LIB_FREE_NON_NULL (File.File);
+  } else {
+    *Buffer     = File.File;
+    *BufferSize = File.FileSize;
+  }
+
+  LIB_FREE_NON_NULL (File.HasBlock);
+  LIB_FREE_NON_NULL (File.Parity);
+  LIB_FREE_NON_NULL (File.HasParity);
+  return Status;
+}
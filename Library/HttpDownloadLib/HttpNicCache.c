@@ -0,0 +1,531 @@
+/** @file
+  Remember the NIC and the IPv4 lease of the last successful download.
+
+  The NIC is identified by its device path, or by its MAC address when the
+  device path changed. While the DHCP lease recorded with it is still valid
+  and was used to reach the same server, the NIC is configured statically
+  with it instead of waiting for a new DHCP exchange.
+
+  Ip4Config2 stores the policy in a variable, so a static lease left there
+  would be used on the next boots too, whether or not the DHCP server still
+  holds it. The NIC keeps the lease for the other downloads of the module,
+  and is put back to DHCP when the module is unloaded or, for a driver, at
+  ReadyToBoot. ExitBootServices would be too late to write the variable.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+#include "Http.h"
+
+//
+// Wait for the static address to be assigned, in steps of 100 milliseconds.
+//
+#define STATIC_ADDRESS_WAIT_STEPS  30
+
+STATIC EFI_HANDLE  mCachedLeaseNic = NULL;
+STATIC EFI_EVENT   mReadyToBoot    = NULL;
+
+/**
+  Get the current time in seconds since the epoch.
+
+  @return  The time, 0 if the real time clock could not be read.
+**/
+UINT64
+GetEpochNow (
+  VOID
+  )
+{
+  EFI_TIME  Time;
+
+  if (EFI_ERROR (gRT->GetTime (&Time, NULL))) {
+    return 0;
+  }
+
+  return EfiTimeToEpoch (&Time);
+}
+
+/**
+  Get the CRC32 identifying a server.
+
+  @param[in]  ServerAddrAndProto  The server, like "http://example.com:5000".
+
+  @return  The CRC32 of the string.
+**/
+STATIC
+UINT32
+GetServerCrc (
+  IN CONST CHAR16  *ServerAddrAndProto
+  )
+{
+  UINT32  Crc;
+
+  Crc = 0;
+  gBS->CalculateCrc32 ((VOID *)ServerAddrAndProto, StrSize (ServerAddrAndProto), &Crc);
+  return Crc;
+}
+
+/**
+  Read the NIC of the last successful download.
+
+  @param[out]  LastNic  The record, to be freed with FreePool().
+
+  @retval  EFI_SUCCESS    LastNic is valid.
+  @retval  EFI_NOT_FOUND  No usable record is stored.
+  @retval  Others         The variable could not be read.
+**/
+EFI_STATUS
+GetLastNic (
+  OUT HTTP_LAST_NIC  **LastNic
+  )
+{
+  EFI_STATUS     Status;
+  HTTP_LAST_NIC  *Record;
+  UINTN          Size;
+
+  *LastNic = NULL;
+
+  Status = GetVariable2 (
+             HTTP_DOWNLOAD_LAST_NIC_VARIABLE_NAME,
+             &gHttpDownloadLastNicVariableGuid,
+             (VOID **)&Record,
+             &Size
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (  (Size <= sizeof (HTTP_LAST_NIC))
+     || (Record->Revision != HTTP_LAST_NIC_REVISION)
+     || !IsDevicePathValid ((EFI_DEVICE_PATH_PROTOCOL *)(Record + 1), Size - sizeof (HTTP_LAST_NIC)))
+  {
+    DEBUG ((DEBUG_INFO, "Ignoring invalid %s variable\n", HTTP_DOWNLOAD_LAST_NIC_VARIABLE_NAME));
+    FreePool (Record);
+    return EFI_NOT_FOUND;
+  }
+
+  *LastNic = Record;
+  return EFI_SUCCESS;
+}
+
+/**
+  Check whether a NIC is the one of the record.
+
+  @param[in]  LastNic           The record.
+  @param[in]  ControllerHandle  The NIC.
+
+  @retval  TRUE   Same device path, or same MAC address.
+  @retval  FALSE  Another NIC.
+**/
+BOOLEAN
+IsLastNic (
+  IN HTTP_LAST_NIC  *LastNic,
+  IN EFI_HANDLE     ControllerHandle
+  )
+{
+  EFI_DEVICE_PATH_PROTOCOL  *DevicePath;
+  EFI_DEVICE_PATH_PROTOCOL  *LastDevicePath;
+  EFI_MAC_ADDRESS           MacAddress;
+  UINTN                     HwAddressSize;
+
+  LastDevicePath = (EFI_DEVICE_PATH_PROTOCOL *)(LastNic + 1);
+  DevicePath     = DevicePathFromHandle (ControllerHandle);
+  if (  (DevicePath != NULL)
+     && (GetDevicePathSize (DevicePath) == GetDevicePathSize (LastDevicePath))
+     && (CompareMem (DevicePath, LastDevicePath, GetDevicePathSize (DevicePath)) == 0))
+  {
+    return TRUE;
+  }
+
+  if (EFI_ERROR (NetLibGetMacAddress (ControllerHandle, &MacAddress, &HwAddressSize))) {
+    return FALSE;
+  }
+
+  return (BOOLEAN)(  (HwAddressSize == LastNic->HwAddressSize)
+                  && (CompareMem (&MacAddress, &LastNic->MacAddress, HwAddressSize) == 0));
+}
+
+/**
+  Check whether the lease of the record can still be used to reach a server
+  without a new DHCP exchange.
+
+  The lease is only trusted up to its renewal time, half of the lease time,
+  and only for the server it was used to reach.
+
+  @param[in]  LastNic             The record.
+  @param[in]  ServerAddrAndProto  The server to download from.
+
+  @retval  TRUE   The NIC can be configured statically with the lease.
+  @retval  FALSE  The NIC has to go through DHCP.
+**/
+BOOLEAN
+IsLastNicLeaseValid (
+  IN HTTP_LAST_NIC  *LastNic,
+  IN CONST CHAR16   *ServerAddrAndProto
+  )
+{
+  UINT64  Now;
+
+  if (  (LastNic->LeaseTime == 0)
+     || EFI_IP4_EQUAL (&LastNic->StationAddress, &mZeroIp4Addr)
+     || (LastNic->ServerCrc != GetServerCrc (ServerAddrAndProto)))
+  {
+    return FALSE;
+  }
+
+  if (LastNic->LeaseTime == MAX_UINT32) {
+    return TRUE;
+  }
+
+  Now = GetEpochNow ();
+  return (BOOLEAN)(  (Now >= LastNic->LeaseStart)
+                  && (Now < LastNic->LeaseStart + LastNic->LeaseTime / 2));
+}
+
+/**
+  Put a NIC configured with the cached lease back to DHCP.
+
+  @param[in]  ControllerHandle  The NIC.
+**/
+STATIC
+VOID
+RestoreDhcpPolicy (
+  IN EFI_HANDLE  ControllerHandle
+  )
+{
+  EFI_STATUS                Status;
+  EFI_IP4_CONFIG2_PROTOCOL  *Ip4Config2;
+  EFI_IP4_CONFIG2_POLICY    Policy;
+  UINTN                     DataSize;
+
+  Status = gBS->HandleProtocol (ControllerHandle, &gEfiIp4Config2ProtocolGuid, (VOID **)&Ip4Config2);
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  //
+  // A failed download may already have gone back to DHCP.
+  //
+  DataSize = sizeof (Policy);
+  Status   = Ip4Config2->GetData (Ip4Config2, Ip4Config2DataTypePolicy, &DataSize, &Policy);
+  if (EFI_ERROR (Status) || (Policy != Ip4Config2PolicyStatic)) {
+    return;
+  }
+
+  //
+  // The idle connections use the static address, which goes away.
+  //
+  FlushHttpConnections (ControllerHandle);
+
+  Policy = Ip4Config2PolicyDhcp;
+  Status = Ip4Config2->SetData (Ip4Config2, Ip4Config2DataTypePolicy, sizeof (Policy), &Policy);
+  DEBUG ((DEBUG_INFO, "Restoring DHCP after the cached lease - %r\n", Status));
+}
+
+/**
+  Put the NIC configured with the cached lease back to DHCP, if any.
+**/
+VOID
+RestoreCachedLeaseNic (
+  VOID
+  )
+{
+  if (mReadyToBoot != NULL) {
+    gBS->CloseEvent (mReadyToBoot);
+    mReadyToBoot = NULL;
+  }
+
+  if (mCachedLeaseNic != NULL) {
+    RestoreDhcpPolicy (mCachedLeaseNic);
+    mCachedLeaseNic = NULL;
+  }
+}
+
+/**
+  Put the NIC configured with the cached lease back to DHCP before the OS
+  boots, for a driver never unloaded.
+
+  @param[in]  Event    The ReadyToBoot event.
+  @param[in]  Context  Unused.
+**/
+STATIC
+VOID
+EFIAPI
+CachedLeaseReadyToBoot (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  RestoreCachedLeaseNic ();
+}
+
+/**
+  Configure a NIC statically with the lease of the record.
+
+  Nothing is changed when the NIC already has an address, e.g. the DHCP
+  exchange started at boot has completed. The NIC is put back to DHCP by
+  RestoreCachedLeaseNic().
+
+  @param[in]  ControllerHandle  The NIC of the record.
+  @param[in]  LastNic           The record.
+
+  @retval  EFI_SUCCESS  The NIC has an address.
+  @retval  EFI_TIMEOUT  The static address was not assigned in time.
+  @retval  Others       The configuration failed.
+**/
+EFI_STATUS
+ApplyLastNicLease (
+  IN EFI_HANDLE     ControllerHandle,
+  IN HTTP_LAST_NIC  *LastNic
+  )
+{
+  EFI_STATUS                      Status;
+  EFI_IP4_CONFIG2_PROTOCOL        *Ip4Config2;
+  EFI_IP4_CONFIG2_POLICY          Policy;
+  EFI_IP4_CONFIG2_MANUAL_ADDRESS  ManualAddress;
+  EFI_IP4_CONFIG2_INTERFACE_INFO  *Ip4Info;
+  UINTN                           DataSize;
+  UINTN                           Step;
+
+  Status = gBS->HandleProtocol (ControllerHandle, &gEfiIp4Config2ProtocolGuid, (VOID **)&Ip4Config2);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  for (Step = 0; ; Step++) {
+    Ip4Info  = NULL;
+    DataSize = 0;
+    Status   = Ip4Config2->GetData (Ip4Config2, Ip4Config2DataTypeInterfaceInfo, &DataSize, NULL);
+    if (Status == EFI_BUFFER_TOO_SMALL) {
+      Ip4Info = AllocateZeroPool (DataSize);
+      if (Ip4Info == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+      }
+
+      Status = Ip4Config2->GetData (Ip4Config2, Ip4Config2DataTypeInterfaceInfo, &DataSize, Ip4Info);
+    }
+
+    if (!EFI_ERROR (Status) && !EFI_IP4_EQUAL (&Ip4Info->StationAddress, &mZeroIp4Addr)) {
+      DEBUG ((
+        DEBUG_INFO,
+        "IP=%d.%d.%d.%d\n",
+        Ip4Info->StationAddress.Addr[0],
+        Ip4Info->StationAddress.Addr[1],
+        Ip4Info->StationAddress.Addr[2],
+        Ip4Info->StationAddress.Addr[3]
+        ));
+      FreePool (Ip4Info);
+      return EFI_SUCCESS;
+    }
+
+    LIB_FREE_NON_NULL (Ip4Info);
+
+    if (Step == STATIC_ADDRESS_WAIT_STEPS) {
+      return EFI_TIMEOUT;
+    }
+
+    if (Step == 0) {
+      DEBUG ((DEBUG_INFO, "Using the cached lease instead of DHCP\n"));
+
+      if (mReadyToBoot == NULL) {
+        EfiCreateEventReadyToBootEx (TPL_CALLBACK, CachedLeaseReadyToBoot, NULL, &mReadyToBoot);
+      }
+
+      mCachedLeaseNic = ControllerHandle;
+      Policy          = Ip4Config2PolicyStatic;
+      Status = Ip4Config2->SetData (Ip4Config2, Ip4Config2DataTypePolicy, sizeof (Policy), &Policy);
+      if (EFI_ERROR (Status)) {
+        return Status;
+      }
+
+      CopyMem (&ManualAddress.Address, &LastNic->StationAddress, sizeof (EFI_IPv4_ADDRESS));
+      CopyMem (&ManualAddress.SubnetMask, &LastNic->SubnetMask, sizeof (EFI_IPv4_ADDRESS));
+      Status = Ip4Config2->SetData (Ip4Config2, Ip4Config2DataTypeManualAddress, sizeof (ManualAddress), &ManualAddress);
+      if (EFI_ERROR (Status) && (Status != EFI_NOT_READY)) {
+        return Status;
+      }
+
+      if (!EFI_IP4_EQUAL (&LastNic->Gateway, &mZeroIp4Addr)) {
+        Status = Ip4Config2->SetData (Ip4Config2, Ip4Config2DataTypeGateway, sizeof (EFI_IPv4_ADDRESS), &LastNic->Gateway);
+        if (EFI_ERROR (Status) && (Status != EFI_NOT_READY)) {
+          return Status;
+        }
+      }
+    }
+
+    gBS->Stall (100 * 1000);
+  }
+}
+
+/**
+  Get the lease time the DHCP client of a NIC was given.
+
+  @param[in]  ControllerHandle  The NIC.
+
+  @return  The lease time in seconds, 0 if the NIC holds no DHCP lease.
+**/
+STATIC
+UINT32
+GetDhcpLeaseTime (
+  IN EFI_HANDLE  ControllerHandle
+  )
+{
+  EFI_STATUS           Status;
+  EFI_HANDLE           Dhcp4Handle;
+  EFI_DHCP4_PROTOCOL   *Dhcp4;
+  EFI_DHCP4_MODE_DATA  ModeData;
+  UINT32               LeaseTime;
+
+  LeaseTime = 0;
+
+  Status = CreateServiceChildAndOpenProtocol (
+             ControllerHandle,
+             &gEfiDhcp4ServiceBindingProtocolGuid,
+             &gEfiDhcp4ProtocolGuid,
+             &Dhcp4Handle,
+             (VOID **)&Dhcp4
+             );
+  if (EFI_ERROR (Status)) {
+    return 0;
+  }
+
+  //
+  // The option list and the reply packet of the mode data point into the
+  // state of the Dhcp4 driver, they are not the caller's to free.
+  //
+  ZeroMem (&ModeData, sizeof (ModeData));
+  Status = Dhcp4->GetModeData (Dhcp4, &ModeData);
+  if (!EFI_ERROR (Status) && (ModeData.State == Dhcp4Bound)) {
+    LeaseTime = ModeData.LeaseTime;
+  }
+
+  CloseProtocolAndDestroyServiceChild (
+    ControllerHandle,
+    &gEfiDhcp4ServiceBindingProtocolGuid,
+    &gEfiDhcp4ProtocolGuid,
+    Dhcp4Handle
+    );
+
+  return LeaseTime;
+}
+
+/**
+  Record the NIC a download has just succeeded on.
+
+  The variable is only written when the NIC, its address or the server
+  changed, or when the recorded lease has expired, so that the lease start
+  time stays the one of the DHCP exchange.
+
+  @param[in]  ControllerHandle    The NIC.
+  @param[in]  ServerAddrAndProto  The server reached through the NIC.
+  @param[in]  LastNic             The current record, NULL if none.
+**/
+VOID
+SaveLastNic (
+  IN EFI_HANDLE     ControllerHandle,
+  IN CONST CHAR16   *ServerAddrAndProto,
+  IN HTTP_LAST_NIC  *LastNic  OPTIONAL
+  )
+{
+  EFI_STATUS                      Status;
+  EFI_IP4_CONFIG2_PROTOCOL        *Ip4Config2;
+  EFI_IP4_CONFIG2_INTERFACE_INFO  *Ip4Info;
+  EFI_DEVICE_PATH_PROTOCOL        *DevicePath;
+  HTTP_LAST_NIC                   *Record;
+  UINTN                           DataSize;
+  UINTN                           DevicePathSize;
+  UINTN                           Index;
+
+  Ip4Info = NULL;
+  Record  = NULL;
+
+  DevicePath = DevicePathFromHandle (ControllerHandle);
+  if (DevicePath == NULL) {
+    return;
+  }
+
+  Status = gBS->HandleProtocol (ControllerHandle, &gEfiIp4Config2ProtocolGuid, (VOID **)&Ip4Config2);
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  DataSize = 0;
+  Status   = Ip4Config2->GetData (Ip4Config2, Ip4Config2DataTypeInterfaceInfo, &DataSize, NULL);
+  if (Status != EFI_BUFFER_TOO_SMALL) {
+    return;
+  }
+
+  Ip4Info = AllocateZeroPool (DataSize);
+  if (Ip4Info == NULL) {
+    return;
+  }
+
+  Status = Ip4Config2->GetData (Ip4Config2, Ip4Config2DataTypeInterfaceInfo, &DataSize, Ip4Info);
+  if (EFI_ERROR (Status)) {
+    goto ON_EXIT;
+  }
+
+  DevicePathSize = GetDevicePathSize (DevicePath);
+  Record         = AllocateZeroPool (sizeof (HTTP_LAST_NIC) + DevicePathSize);
+  if (Record == NULL) {
+    goto ON_EXIT;
+  }
+
+  Record->Revision      = HTTP_LAST_NIC_REVISION;
+  Record->HwAddressSize = Ip4Info->HwAddressSize;
+  CopyMem (&Record->MacAddress, &Ip4Info->HwAddress, sizeof (EFI_MAC_ADDRESS));
+  CopyMem (&Record->StationAddress, &Ip4Info->StationAddress, sizeof (EFI_IPv4_ADDRESS));
+  CopyMem (&Record->SubnetMask, &Ip4Info->SubnetMask, sizeof (EFI_IPv4_ADDRESS));
+  for (Index = 0; Index < Ip4Info->RouteTableSize; Index++) {
+    if (  EFI_IP4_EQUAL (&Ip4Info->RouteTable[Index].SubnetAddress, &mZeroIp4Addr)
+       && EFI_IP4_EQUAL (&Ip4Info->RouteTable[Index].SubnetMask, &mZeroIp4Addr))
+    {
+      CopyMem (&Record->Gateway, &Ip4Info->RouteTable[Index].GatewayAddress, sizeof (EFI_IPv4_ADDRESS));
+      break;
+    }
+  }
+
+  Record->ServerCrc = GetServerCrc (ServerAddrAndProto);
+  CopyMem (Record + 1, DevicePath, DevicePathSize);
+
+  if (  (LastNic != NULL)
+     && IsLastNicLeaseValid (LastNic, ServerAddrAndProto)
+     && (CompareMem (&Record->MacAddress, &LastNic->MacAddress, sizeof (EFI_MAC_ADDRESS)) == 0)
+     && EFI_IP4_EQUAL (&Record->StationAddress, &LastNic->StationAddress)
+     && EFI_IP4_EQUAL (&Record->Gateway, &LastNic->Gateway))
+  {
+    goto ON_EXIT;
+  }
+
+  Record->LeaseTime  = GetDhcpLeaseTime (ControllerHandle);
+  Record->LeaseStart = GetEpochNow ();
+
+  Status = gRT->SetVariable (
+                  HTTP_DOWNLOAD_LAST_NIC_VARIABLE_NAME,
+                  &gHttpDownloadLastNicVariableGuid,
+                  EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                  sizeof (HTTP_LAST_NIC) + DevicePathSize,
+                  Record
+                  );
+  DEBUG ((DEBUG_INFO, "Saving the last NIC - %r\n", Status));
+
+ON_EXIT:
+  LIB_FREE_NON_NULL (Record);
+  LIB_FREE_NON_NULL (Ip4Info);
+}
+
+/**
+  Delete the record, after its lease failed to reach the server.
+**/
+VOID
+ForgetLastNic (
+  VOID
+  )
+{
+  gRT->SetVariable (
+         HTTP_DOWNLOAD_LAST_NIC_VARIABLE_NAME,
+         &gHttpDownloadLastNicVariableGuid,
+         0,
+         0,
+         NULL
+         );
+}
@@ -0,0 +1,202 @@
+/** @file
+  Pool of HTTP connections and NIC preference shared by the downloads of
+  one module.
+
+  In service mode the HTTP child used for a download is kept open once the
+  response has been fully received, keyed by NIC and server, so that the
+  next request to the same server skips the child creation, configuration
+  and TCP handshake.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+#include "Http.h"
+
+//
+// Number of idle connections kept in the pool, the least recently used
+// one is closed beyond that.
+//
+#define HTTP_POOL_MAX_IDLE  4
+
+BOOLEAN  gHttpDownloadServiceMode = FALSE;
+
+//
+// NIC of the last successful download, tried first by the next one.
+//
+EFI_HANDLE  gPreferredNicHandle = NULL;
+
+STATIC LIST_ENTRY  mHttpConnectionPool = INITIALIZE_LIST_HEAD_VARIABLE (mHttpConnectionPool);
+STATIC UINTN       mIdleConnections    = 0;
+
+/**
+  Close the HTTP child of a connection and free it.
+
+  @param[in]  Connection  The connection, not in the pool.
+**/
+STATIC
+VOID
+DestroyHttpConnection (
+  IN HTTP_CONNECTION  *Connection
+  )
+{
+  if (Connection->HttpChildHandle != NULL) {
+    CloseProtocolAndDestroyServiceChild (
+      Connection->ControllerHandle,
+      &gEfiHttpServiceBindingProtocolGuid,
+      &gEfiHttpProtocolGuid,
+      Connection->HttpChildHandle
+      );
+  }
+
+  LIB_FREE_NON_NULL (Connection->ServerAddrAndProto);
+  FreePool (Connection);
+}
+
+/**
+  Get a configured HTTP child on the given NIC for the server of the
+  download context, reusing an idle one from the pool when possible.
+
+  @param[in]   Context           The download context. Context->Http is
+                                 set to the HTTP protocol of the connection.
+  @param[in]   ControllerHandle  The NIC to use.
+  @param[out]  Connection        The connection, to be released with
+                                 ReleaseHttpConnection().
+
+  @retval  EFI_SUCCESS           The connection is ready for a request.
+  @retval  EFI_OUT_OF_RESOURCES  A memory allocation failed.
+  @retval  Others                The HTTP child could not be created or
+                                 configured.
+**/
+EFI_STATUS
+AcquireHttpConnection (
+  IN  HTTP_DOWNLOAD_CONTEXT  *Context,
+  IN  EFI_HANDLE             ControllerHandle,
+  OUT HTTP_CONNECTION        **Connection
+  )
+{
+  EFI_STATUS       Status;
+  LIST_ENTRY       *Entry;
+  HTTP_CONNECTION  *Conn;
+
+  *Connection = NULL;
+
+  BASE_LIST_FOR_EACH (Entry, &mHttpConnectionPool) {
+    Conn = HTTP_CONNECTION_FROM_LINK (Entry);
+    if (  (Conn->ControllerHandle == ControllerHandle)
+       && (StrCmp (Conn->ServerAddrAndProto, Context->ServerAddrAndProto) == 0))
+    {
+      RemoveEntryList (&Conn->Link);
+      mIdleConnections--;
+
+      DEBUG ((DEBUG_INFO, "Reusing HTTP connection to %s\n", Conn->ServerAddrAndProto));
+      Context->Http             = Conn->Http;
+      Context->ControllerHandle = ControllerHandle;
+      *Connection               = Conn;
+      return EFI_SUCCESS;
+    }
+  }
+
+  Conn = AllocateZeroPool (sizeof (HTTP_CONNECTION));
+  if (Conn == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Conn->Signature          = HTTP_CONNECTION_SIGNATURE;
+  Conn->ControllerHandle   = ControllerHandle;
+  Conn->ServerAddrAndProto = AllocateCopyPool (
+                               StrSize (Context->ServerAddrAndProto),
+                               Context->ServerAddrAndProto
+                               );
+  if (Conn->ServerAddrAndProto == NULL) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto ON_EXIT;
+  }
+
+  Status = CreateServiceChildAndOpenProtocol (
+             ControllerHandle,
+             &gEfiHttpServiceBindingProtocolGuid,
+             &gEfiHttpProtocolGuid,
+             &Conn->HttpChildHandle,
+             (VOID **)&Conn->Http
+             );
+  if (EFI_ERROR (Status)) {
+    goto ON_EXIT;
+  }
+
+  Status = Conn->Http->Configure (Conn->Http, &Context->HttpConfigData);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "Unable to configure HTTP protocol - %r\n", Status));
+    goto ON_EXIT;
+  }
+
+ON_EXIT:
+  if (EFI_ERROR (Status)) {
+    DestroyHttpConnection (Conn);
+    return Status;
+  }
+
+  Context->Http             = Conn->Http;
+  Context->ControllerHandle = ControllerHandle;
+  *Connection               = Conn;
+  return EFI_SUCCESS;
+}
+
+/**
+  Give back a connection obtained with AcquireHttpConnection().
+
+  @param[in]  Connection  The connection, NULL is ignored.
+  @param[in]  Reusable    TRUE if the last response was fully received, so
+                          that the connection can serve another request.
+                          It is only kept in service mode.
+**/
+VOID
+ReleaseHttpConnection (
+  IN HTTP_CONNECTION  *Connection  OPTIONAL,
+  IN BOOLEAN          Reusable
+  )
+{
+  HTTP_CONNECTION  *Oldest;
+
+  if (Connection == NULL) {
+    return;
+  }
+
+  if (!Reusable || !gHttpDownloadServiceMode) {
+    DestroyHttpConnection (Connection);
+    return;
+  }
+
+  InsertHeadList (&mHttpConnectionPool, &Connection->Link);
+  mIdleConnections++;
+
+  if (mIdleConnections > HTTP_POOL_MAX_IDLE) {
+    Oldest = HTTP_CONNECTION_FROM_LINK (mHttpConnectionPool.BackLink);
+    RemoveEntryList (&Oldest->Link);
+    mIdleConnections--;
+    DestroyHttpConnection (Oldest);
+  }
+}
+
+/**
+  Close the idle connections of a NIC, before its address changes.
+
+  @param[in]  ControllerHandle  The NIC.
+**/
+VOID
+FlushHttpConnections (
+  IN EFI_HANDLE  ControllerHandle
+  )
+{
+  LIST_ENTRY       *Entry;
+  LIST_ENTRY       *Next;
+  HTTP_CONNECTION  *Conn;
+
+  BASE_LIST_FOR_EACH_SAFE (Entry, Next, &mHttpConnectionPool) {
+    Conn = HTTP_CONNECTION_FROM_LINK (Entry);
+    if (Conn->ControllerHandle == ControllerHandle) {
+      RemoveEntryList (&Conn->Link);
+      mIdleConnections--;
+      DestroyHttpConnection (Conn);
+    }
+  }
+}
@@ -0,0 +1,264 @@
+/** @file
+  Remember the redirections of the servers while they may be cached.
+
+  A server sending each board to its nearest mirror answers the download
+  requests with a redirection carrying "Cache-Control: max-age". Until it
+  expires, the requests for the same directory go to the mirror directly,
+  saving a round trip and a connection to the first server for each file.
+  A redirection without max-age is not remembered. A file at the root of
+  the server only has its own URL redirected, not the other requests to
+  the server like /update.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+#include "Http.h"
+
+//
+// Number of redirections remembered.
+//
+#define HTTP_REDIRECT_CACHE_SIZE  8
+
+typedef struct {
+  //
+  // The URL redirected, or the directory of the file redirected when the
+  // target keeps the file name, and the same on the target. A directory
+  // ends with '/' and covers the URLs it starts, a URL only covers itself.
+  //
+  CHAR16    *From;
+  CHAR16    *To;
+  //
+  // Seconds since the epoch when the redirection expires.
+  //
+  UINT64    Expires;
+} HTTP_REDIRECT;
+
+STATIC HTTP_REDIRECT  mRedirects[HTTP_REDIRECT_CACHE_SIZE];
+
+/**
+  Free a remembered redirection.
+
+  @param[in, out]  Redirect  The redirection.
+**/
+STATIC
+VOID
+DropRedirect (
+  IN OUT HTTP_REDIRECT  *Redirect
+  )
+{
+  LIB_FREE_NON_NULL (Redirect->From);
+  LIB_FREE_NON_NULL (Redirect->To);
+  Redirect->Expires = 0;
+}
+
+/**
+  Find the redirection covering a URL.
+
+  @param[in]  Url  The URL.
+
+  @return  The redirection, or NULL if none covers the URL.
+**/
+STATIC
+HTTP_REDIRECT *
+FindRedirect (
+  IN CONST CHAR16  *Url
+  )
+{
+  UINTN         Index;
+  CONST CHAR16  *From;
+  UINTN         Length;
+
+  for (Index = 0; Index < HTTP_REDIRECT_CACHE_SIZE; Index++) {
+    From = mRedirects[Index].From;
+    if (From == NULL) {
+      continue;
+    }
+
+    Length = StrLen (From);
+    if (  ((From[Length - 1] == L'/') && (StrnCmp (Url, From, Length) == 0))
+       || (StrCmp (Url, From) == 0))
+    {
+      return &mRedirects[Index];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  Get the max-age of a response, from its Cache-Control header.
+
+  @param[in]  Response  The response.
+
+  @return  The max-age in seconds, 0 if none.
+**/
+STATIC
+UINTN
+GetMaxAge (
+  IN EFI_HTTP_MESSAGE  *Response
+  )
+{
+  EFI_HTTP_HEADER  *Header;
+  CHAR8            *MaxAge;
+
+  Header = HttpFindHeader (Response->HeaderCount, Response->Headers, "Cache-Control");
+  if (Header == NULL) {
+    return 0;
+  }
+
+  MaxAge = AsciiStrStr (Header->FieldValue, "max-age=");
+  if (MaxAge == NULL) {
+    return 0;
+  }
+
+  return AsciiStrDecimalToUintn (MaxAge + AsciiStrLen ("max-age="));
+}
+
+/**
+  Remember a redirection for as long as the response allows it to be cached.
+
+  @param[in]  Url       The URL requested.
+  @param[in]  Target    The URL redirected to.
+  @param[in]  Response  The redirection response.
+**/
+VOID
+RememberRedirect (
+  IN CONST CHAR16      *Url,
+  IN CONST CHAR16      *Target,
+  IN EFI_HTTP_MESSAGE  *Response
+  )
+{
+  HTTP_REDIRECT  *Redirect;
+  UINTN          MaxAge;
+  UINT64         Now;
+  UINTN          FromLength;
+  UINTN          ToLength;
+  UINTN          RootLength;
+  CONST CHAR16   *Path;
+  UINTN          Index;
+
+  Redirect = FindRedirect (Url);
+  if (Redirect != NULL) {
+    DropRedirect (Redirect);
+  }
+
+  MaxAge = GetMaxAge (Response);
+  Now    = GetEpochNow ();
+  if ((MaxAge == 0) || (Now == 0)) {
+    return;
+  }
+
+  //
+  // Length of "http://host/", the root of the server.
+  //
+  Path       = StrStr (Url, L"://");
+  Path       = (Path != NULL) ? StrStr (Path + 3, L"/") : NULL;
+  RootLength = (Path != NULL) ? (UINTN)(Path - Url) + 1 : 0;
+
+  //
+  // When the target keeps the file name, the whole directory is redirected,
+  // unless it is the root.
+  //
+  FromLength = StrLen (Url);
+  ToLength   = StrLen (Target);
+  while ((FromLength > 0) && (ToLength > 0) && (Url[FromLength - 1] == Target[ToLength - 1]) &&
+         (Url[FromLength - 1] != L'/'))
+  {
+    FromLength--;
+    ToLength--;
+  }
+
+  if (  (FromLength <= RootLength) || (Url[FromLength - 1] != L'/')
+     || (ToLength == 0) || (Target[ToLength - 1] != L'/'))
+  {
+    FromLength = StrLen (Url);
+    ToLength   = StrLen (Target);
+  }
+
+  //
+  // Take a free slot, else the one expiring first.
+  //
+  Redirect = &mRedirects[0];
+  for (Index = 0; Index < HTTP_REDIRECT_CACHE_SIZE; Index++) {
+    if ((mRedirects[Index].From == NULL) || (mRedirects[Index].Expires < Redirect->Expires)) {
+      Redirect = &mRedirects[Index];
+      if (Redirect->From == NULL) {
+        break;
+      }
+    }
+  }
+
+  DropRedirect (Redirect);
+  Redirect->From = AllocateZeroPool ((FromLength + 1) * sizeof (CHAR16));
+  Redirect->To   = AllocateZeroPool ((ToLength + 1) * sizeof (CHAR16));
+  if ((Redirect->From == NULL) || (Redirect->To == NULL)) {
+    DropRedirect (Redirect);
+    return;
+  }
+
+  CopyMem (Redirect->From, Url, FromLength * sizeof (CHAR16));
+  CopyMem (Redirect->To, Target, ToLength * sizeof (CHAR16));
+  Redirect->Expires = Now + MaxAge;
+  DEBUG ((DEBUG_INFO, "Redirecting %s to %s for %d s\n", Redirect->From, Redirect->To, MaxAge));
+}
+
+/**
+  Apply the remembered redirection covering a URL.
+
+  @param[in]  Url  The URL to download.
+
+  @return  The URL to download instead, to be freed with FreePool(), or NULL
+           if no redirection is remembered for it.
+**/
+CHAR16 *
+ResolveRedirect (
+  IN CONST CHAR16  *Url
+  )
+{
+  HTTP_REDIRECT  *Redirect;
+  CHAR16         *Target;
+  UINTN          TargetSize;
+
+  Redirect = FindRedirect (Url);
+  if (Redirect == NULL) {
+    return NULL;
+  }
+
+  if (GetEpochNow () >= Redirect->Expires) {
+    DropRedirect (Redirect);
+    return NULL;
+  }
+
+  TargetSize = StrSize (Redirect->To) + StrSize (Url) - StrLen (Redirect->From) * sizeof (CHAR16);
+  Target     = AllocatePool (TargetSize);
+  if (Target != NULL) {
+    StrCpyS (Target, TargetSize / sizeof (CHAR16), Redirect->To);
+    StrCatS (Target, TargetSize / sizeof (CHAR16), Url + StrLen (Redirect->From));
+  }
+
+  return Target;
+}
+
+/**
+  Forget the redirection covering a URL, after a download from its target
+  failed.
+
+  @param[in]  Url  The URL requested, or the URL it was redirected to.
+**/
+VOID
+ForgetRedirect (
+  IN CONST CHAR16  *Url
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < HTTP_REDIRECT_CACHE_SIZE; Index++) {
+    if (  (mRedirects[Index].From != NULL)
+       && (  (StrnCmp (Url, mRedirects[Index].From, StrLen (mRedirects[Index].From)) == 0)
+          || (StrnCmp (Url, mRedirects[Index].To, StrLen (mRedirects[Index].To)) == 0)))
+    {
+      DEBUG ((DEBUG_INFO, "Forgetting the redirection of %s\n", mRedirects[Index].From));
+      DropRedirect (&mRedirects[Index]);
+    }
+  }
+}
@@ -0,0 +1,600 @@
+/** @file
+  Report how each download went to the server, for a fleet-wide view of the
+  update performance.
+
+  Once a file is downloaded in a session, a small JSON record is posted to
+  /report on the server the file was asked from: the board, the NIC and its
+  driver, the time to get an address, the time to the first byte, the
+  transfer time and size, the 503 retries and the receive buffer size. The server aggregates the records
+  per board and NIC driver in its /metrics. UEFI has no standard way to read
+  the link speed of a NIC, so it is not reported.
+
+  The report never changes the result of the download, nor delays it: it
+  goes on a connection of its own, closed once the request is sent without
+  waiting for the 204 of the server.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+#include "Http.h"
+
+#include <Protocol/ComponentName2.h>
+#include <Protocol/PciIo.h>
+#include <Protocol/Smbios.h>
+#include <Protocol/Timer.h>
+#include <Protocol/UsbIo.h>
+
+//
+// Longest time to wait for a report to be sent.
+//
+#define HTTP_REPORT_TIMEOUT_MS  1000
+
+#define HTTP_REPORT_SIZE              512
+#define HTTP_REPORT_NAME_LENGTH       64
+#define HTTP_REPORT_CONTENT_LENGTH    8
+
+//
+// System timer period assumed when the Timer Architectural Protocol cannot
+// tell it, 10 ms in 100 ns units.
+//
+#define HTTP_REPORT_DEFAULT_TICK  100000
+
+STATIC EFI_EVENT        mReportClock      = NULL;
+STATIC UINTN            mReportClockUsers = 0;
+STATIC UINT64           mReportClockTick;
+STATIC volatile UINT64  mReportClockTicks = 0;
+
+/**
+  Count the ticks of the download clock.
+
+  @param[in] Event:   The timer event.
+  @param[in] Context: Unused.
+**/
+STATIC
+VOID
+EFIAPI
+ReportTickCallback (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  mReportClockTicks++;
+}
+
+/**
+  Start the clock timing the downloads, or count one more user of it.
+
+  The clock ticks with the system timer: a timer event is signaled at most
+  once per system tick, so a shorter period would lose ticks. It runs on
+  every architecture, to the resolution of the system tick.
+**/
+VOID
+StartReportClock (
+  VOID
+  )
+{
+  EFI_STATUS               Status;
+  EFI_TIMER_ARCH_PROTOCOL  *Timer;
+
+  mReportClockUsers++;
+  if (mReportClock != NULL) {
+    return;
+  }
+
+  mReportClockTick = 0;
+  Status           = gBS->LocateProtocol (&gEfiTimerArchProtocolGuid, NULL, (VOID **)&Timer);
+  if (!EFI_ERROR (Status)) {
+    Timer->GetTimerPeriod (Timer, &mReportClockTick);
+  }
+
+  if (mReportClockTick == 0) {
+    mReportClockTick = HTTP_REPORT_DEFAULT_TICK;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_NOTIFY,
+                  ReportTickCallback,
+                  NULL,
+                  &mReportClock
+                  );
+  if (EFI_ERROR (Status)) {
+    mReportClock = NULL;
+    return;
+  }
+
+  gBS->SetTimer (mReportClock, TimerPeriodic, mReportClockTick);
+}
+
+/**
+  Stop the clock timing the downloads once its last user is done.
+**/
+VOID
+StopReportClock (
+  VOID
+  )
+{
+  ASSERT (mReportClockUsers > 0);
+  mReportClockUsers--;
+  if ((mReportClockUsers == 0) && (mReportClock != NULL)) {
+    gBS->SetTimer (mReportClock, TimerCancel, 0);
+    gBS->CloseEvent (mReportClock);
+    mReportClock = NULL;
+  }
+}
+
+/**
+  Read the clock timing the downloads. Only differences of readings taken
+  while the clock runs are meaningful.
+
+  @return  Milliseconds counted by the clock.
+**/
+UINT64
+GetReportClock (
+  VOID
+  )
+{
+  return DivU64x32 (MultU64x64 (mReportClockTicks, mReportClockTick), 10000);
+}
+
+/**
+  Get the name of the driver managing a device: the first driver having
+  opened Protocol by driver on the device of the path, or on its closest
+  parent having Protocol.
+
+  @param[in]   DevicePath  The device path of the NIC.
+  @param[in]   Protocol    The protocol of the bus the NIC is on.
+  @param[out]  Name        The name of the driver.
+  @param[in]   NameSize    Size of Name in characters.
+
+  @retval  EFI_SUCCESS  Name is filled.
+  @retval  Others       No such device or driver, or the driver has no name.
+**/
+STATIC
+EFI_STATUS
+GetBusDriverName (
+  IN  EFI_DEVICE_PATH_PROTOCOL  *DevicePath,
+  IN  EFI_GUID                  *Protocol,
+  OUT CHAR16                    *Name,
+  IN  UINTN                     NameSize
+  )
+{
+  EFI_STATUS                           Status;
+  EFI_HANDLE                           Device;
+  EFI_OPEN_PROTOCOL_INFORMATION_ENTRY  *OpenInfo;
+  UINTN                                OpenInfoCount;
+  UINTN                                Index;
+  EFI_COMPONENT_NAME2_PROTOCOL         *ComponentName;
+  CHAR16                               *DriverName;
+
+  Status = gBS->LocateDevicePath (Protocol, &DevicePath, &Device);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = gBS->OpenProtocolInformation (Device, Protocol, &OpenInfo, &OpenInfoCount);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Status = EFI_NOT_FOUND;
+  for (Index = 0; Index < OpenInfoCount; Index++) {
+    if ((OpenInfo[Index].Attributes & EFI_OPEN_PROTOCOL_BY_DRIVER) == 0) {
+      continue;
+    }
+
+    Status = gBS->HandleProtocol (
+                    OpenInfo[Index].AgentHandle,
+                    &gEfiComponentName2ProtocolGuid,
+                    (VOID **)&ComponentName
+                    );
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    Status = ComponentName->GetDriverName (ComponentName, "en", &DriverName);
+    if (EFI_ERROR (Status)) {
+      Status = ComponentName->GetDriverName (ComponentName, "en-US", &DriverName);
+    }
+
+    if (!EFI_ERROR (Status)) {
+      StrnCpyS (Name, NameSize, DriverName, NameSize - 1);
+      break;
+    }
+  }
+
+  FreePool (OpenInfo);
+  return Status;
+}
+
+/**
+  Get the name of the driver of a NIC: the USB driver for a USB NIC, else the
+  PCI driver, else the PCI vendor and device ID.
+
+  @param[in]   ControllerHandle  The NIC.
+  @param[out]  Name              The name of the driver, "unknown" if none.
+  @param[in]   NameSize          Size of Name in characters.
+**/
+STATIC
+VOID
+GetNicDriverName (
+  IN  EFI_HANDLE  ControllerHandle,
+  OUT CHAR16      *Name,
+  IN  UINTN       NameSize
+  )
+{
+  EFI_DEVICE_PATH_PROTOCOL  *DevicePath;
+  EFI_DEVICE_PATH_PROTOCOL  *PciPath;
+  EFI_HANDLE                PciHandle;
+  EFI_PCI_IO_PROTOCOL       *PciIo;
+  UINT16                    Ids[2];
+
+  StrCpyS (Name, NameSize, L"unknown");
+
+  DevicePath = DevicePathFromHandle (ControllerHandle);
+  if (DevicePath == NULL) {
+    return;
+  }
+
+  if (  !EFI_ERROR (GetBusDriverName (DevicePath, &gEfiUsbIoProtocolGuid, Name, NameSize))
+     || !EFI_ERROR (GetBusDriverName (DevicePath, &gEfiPciIoProtocolGuid, Name, NameSize)))
+  {
+    return;
+  }
+
+  PciPath = DevicePath;
+  if (  !EFI_ERROR (gBS->LocateDevicePath (&gEfiPciIoProtocolGuid, &PciPath, &PciHandle))
+     && !EFI_ERROR (gBS->HandleProtocol (PciHandle, &gEfiPciIoProtocolGuid, (VOID **)&PciIo))
+     && !EFI_ERROR (PciIo->Pci.Read (PciIo, EfiPciIoWidthUint16, 0, 2, Ids)))
+  {
+    UnicodeSPrint (Name, NameSize * sizeof (CHAR16), L"PCI %04x:%04x", Ids[0], Ids[1]);
+  }
+}
+
+/**
+  Get the product name of the baseboard, or else of the system, from SMBIOS.
+
+  @return  The name, or NULL if SMBIOS has none.
+**/
+STATIC
+CONST CHAR8 *
+GetBoardName (
+  VOID
+  )
+{
+  EFI_SMBIOS_PROTOCOL      *Smbios;
+  EFI_SMBIOS_HANDLE        Handle;
+  EFI_SMBIOS_TYPE          Type;
+  EFI_SMBIOS_TABLE_HEADER  *Record;
+  CONST CHAR8              *String;
+  UINT8                    StringNumber;
+  UINTN                    Index;
+
+  STATIC CONST EFI_SMBIOS_TYPE  Types[] = {
+    EFI_SMBIOS_TYPE_BASEBOARD_INFORMATION,
+    EFI_SMBIOS_TYPE_SYSTEM_INFORMATION
+  };
+  STATIC CONST UINTN  Fields[] = {
+    OFFSET_OF (SMBIOS_TABLE_TYPE2, ProductName),
+    OFFSET_OF (SMBIOS_TABLE_TYPE1, ProductName)
+  };
+
+  if (EFI_ERROR (gBS->LocateProtocol (&gEfiSmbiosProtocolGuid, NULL, (VOID **)&Smbios))) {
+    return NULL;
+  }
+
+  for (Index = 0; Index < ARRAY_SIZE (Types); Index++) {
+    Handle = SMBIOS_HANDLE_PI_RESERVED;
+    Type   = Types[Index];
+    if (  EFI_ERROR (Smbios->GetNext (Smbios, &Handle, &Type, &Record, NULL))
+       || (Record->Length <= Fields[Index]))
+    {
+      continue;
+    }
+
+    StringNumber = ((UINT8 *)Record)[Fields[Index]];
+    if (StringNumber == 0) {
+      continue;
+    }
+
+    //
+    // The strings follow the formatted area, the set ends with an empty one.
+    //
+    String = (CONST CHAR8 *)Record + Record->Length;
+    while (--StringNumber != 0 && *String != '\0') {
+      String += AsciiStrLen (String) + 1;
+    }
+
+    if (*String != '\0') {
+      return String;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  Append a "name":"value" member to a JSON object being built. Quotes,
+  backslashes and control characters are dropped from the value, the
+  names of boards and drivers do not need them.
+
+  @param[in, out]  Json      The JSON text.
+  @param[in]       JsonSize  Size of Json in bytes.
+  @param[in]       Name      Name of the member.
+  @param[in]       Value     The value, CHAR8 or CHAR16 as told by Wide.
+  @param[in]       Wide      TRUE if Value is a CHAR16 string.
+**/
+STATIC
+VOID
+AppendJsonString (
+  IN OUT CHAR8        *Json,
+  IN     UINTN        JsonSize,
+  IN     CONST CHAR8  *Name,
+  IN     CONST VOID   *Value,
+  IN     BOOLEAN      Wide
+  )
+{
+  UINTN   Length;
+  UINTN   Index;
+  UINT16  Char;
+
+  Length  = AsciiStrLen (Json);
+  Length += AsciiSPrint (Json + Length, JsonSize - Length, "%a\"%a\":\"", (Length > 1) ? "," : "", Name);
+  for (Index = 0; Length + 3 < JsonSize; Index++) {
+    Char = Wide ? ((CONST CHAR16 *)Value)[Index] : ((CONST CHAR8 *)Value)[Index];
+    if (Char == 0) {
+      break;
+    }
+
+    if ((Char >= 0x20) && (Char < 0x7F) && (Char != '"') && (Char != '\\')) {
+      Json[Length++] = (CHAR8)Char;
+    }
+  }
+
+  Json[Length++] = '"';
+  Json[Length]   = '\0';
+}
+
+/**
+  Callback to set the completion flag of a report request.
+
+  @param[in] Event:   The event.
+  @param[in] Context: Pointer to the flag.
+**/
+STATIC
+VOID
+EFIAPI
+ReportCallback (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  *(BOOLEAN *)Context = TRUE;
+}
+
+/**
+  Send the request of a report, polling the HTTP child until it is sent or
+  the deadline passes.
+
+  @param[in]  Http     The HTTP protocol of the connection.
+  @param[in]  Message  The request.
+
+  @retval  EFI_SUCCESS  The request was sent.
+  @retval  EFI_TIMEOUT  The deadline passed, the request is cancelled.
+  @retval  Others       The request could not be sent.
+**/
+STATIC
+EFI_STATUS
+SendReportRequest (
+  IN EFI_HTTP_PROTOCOL  *Http,
+  IN EFI_HTTP_MESSAGE   *Message
+  )
+{
+  EFI_STATUS      Status;
+  EFI_HTTP_TOKEN  Token;
+  EFI_EVENT       Deadline;
+  BOOLEAN         Done;
+
+  Status = gBS->CreateEvent (EVT_TIMER, TPL_CALLBACK, NULL, NULL, &Deadline);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  ZeroMem (&Token, sizeof (Token));
+  Token.Message = Message;
+  Done          = FALSE;
+  Status        = gBS->CreateEvent (EVT_NOTIFY_SIGNAL, TPL_CALLBACK, ReportCallback, &Done, &Token.Event);
+  if (EFI_ERROR (Status)) {
+    gBS->CloseEvent (Deadline);
+    return Status;
+  }
+
+  gBS->SetTimer (Deadline, TimerRelative, EFI_TIMER_PERIOD_MILLISECONDS (HTTP_REPORT_TIMEOUT_MS));
+  Status = Http->Request (Http, &Token);
+  if (!EFI_ERROR (Status)) {
+    while (!Done && EFI_ERROR (gBS->CheckEvent (Deadline))) {
+      Http->Poll (Http);
+    }
+
+    if (Done) {
+      Status = Token.Status;
+    } else {
+      Http->Cancel (Http, &Token);
+      Status = EFI_TIMEOUT;
+    }
+  }
+
+  gBS->CloseEvent (Token.Event);
+  gBS->CloseEvent (Deadline);
+  return Status;
+}
+
+/**
+  Get the server of a URL, e.g. "http://10.0.0.1:8080" for
+  "http://10.0.0.1:8080/bios.bin", to report the download of the URL to.
+
+  @param[in]  Url  The URL, "http://" assumed when it has no scheme.
+
+  @return  The server, to be freed with FreePool(), or NULL if out of
+           resources.
+**/
+CHAR16 *
+GetReportServer (
+  IN CONST CHAR16  *Url
+  )
+{
+  CONST CHAR16  *Host;
+  CONST CHAR16  *Path;
+  CHAR16        *Server;
+  UINTN         ServerSize;
+
+  Host = StrStr (Url, L"://");
+  Host = (Host != NULL) ? Host + 3 : Url;
+  Path = Host;
+  while (*Path != L'\0' && *Path != L'/') {
+    Path++;
+  }
+
+  ServerSize = (StrLen (L"http://") + (Path - Url) + 1) * sizeof (CHAR16);
+  Server     = AllocatePool (ServerSize);
+  if (Server == NULL) {
+    return NULL;
+  }
+
+  if (Host == Url) {
+    StrCpyS (Server, ServerSize / sizeof (CHAR16), L"http://");
+  } else {
+    StrnCpyS (Server, ServerSize / sizeof (CHAR16), Url, Host - Url);
+  }
+
+  StrnCatS (Server, ServerSize / sizeof (CHAR16), Host, Path - Host);
+  return Server;
+}
+
+/**
+  Post the report of a completed download to Context->ReportServer, on a
+  connection of its own. The answer of the server is not awaited.
+
+  @param[in]  Context  The download context.
+  @param[in]  NicName  The name of the NIC of the download.
+**/
+VOID
+SendDownloadReport (
+  IN HTTP_DOWNLOAD_CONTEXT  *Context,
+  IN CONST CHAR16           *NicName
+  )
+{
+  EFI_STATUS              Status;
+  HTTP_DOWNLOAD_REPORT    *Report;
+  HTTP_DOWNLOAD_CONTEXT   ReportContext;
+  HTTP_CONNECTION         *Connection;
+  CONST CHAR8             *Board;
+  CHAR16                  Driver[HTTP_REPORT_NAME_LENGTH];
+  CHAR8                   Body[HTTP_REPORT_SIZE];
+  CHAR8                   ContentLength[HTTP_REPORT_CONTENT_LENGTH];
+  CHAR8                   ClientId[HTTP_CLIENT_ID_SIZE];
+  CHAR8                   *Host;
+  CHAR16                  *Url;
+  UINTN                   UrlSize;
+  UINTN                   Length;
+  UINT64                  TransferMs;
+  EFI_HTTP_REQUEST_DATA   RequestData;
+  EFI_HTTP_HEADER         Headers[6];
+  EFI_HTTP_MESSAGE        RequestMessage;
+
+  Report     = &Context->Report;
+  TransferMs = Report->DoneMs - Report->FirstByteMs;
+
+  AsciiStrCpyS (Body, sizeof (Body), "{");
+  Board = GetBoardName ();
+  if (Board != NULL) {
+    AppendJsonString (Body, sizeof (Body), "board", Board, FALSE);
+  }
+
+  GetNicDriverName (Context->ControllerHandle, Driver, ARRAY_SIZE (Driver));
+  AppendJsonString (Body, sizeof (Body), "nic", NicName, TRUE);
+  AppendJsonString (Body, sizeof (Body), "driver", Driver, TRUE);
+  AppendJsonString (Body, sizeof (Body), "lease", Report->CachedLease ? "cached" : "dhcp", FALSE);
+  Length = AsciiStrLen (Body);
+  AsciiSPrint (
+    Body + Length,
+    sizeof (Body) - Length,
+    ",\"dhcp_ms\":%Lu,\"first_byte_ms\":%Lu,\"transfer_ms\":%Lu,\"bytes\":%Lu,\"retries\":%Lu,\"buffer_size\":%Lu}",
+    Report->DhcpMs,
+    Report->FirstByteMs - Report->RequestMs,
+    TransferMs,
+    (UINT64)(Context->ContentDownloaded - Context->RangeStart),
+    (UINT64)Report->Retries,
+    (UINT64)Context->BufferSize
+    );
+  DEBUG ((DEBUG_INFO, "Download report to %s: %a\n", Context->ReportServer, Body));
+
+  //
+  // The host is what follows "://" in ReportServer.
+  //
+  UrlSize = StrSize (Context->ReportServer) + StrSize (L"/report");
+  Url     = AllocatePool (UrlSize);
+  Host    = AllocatePool (StrLen (Context->ReportServer) + 1);
+  if ((Url == NULL) || (Host == NULL)) {
+    LIB_FREE_NON_NULL (Url);
+    LIB_FREE_NON_NULL (Host);
+    return;
+  }
+
+  UnicodeSPrint (Url, UrlSize, L"%s/report", Context->ReportServer);
+  UnicodeStrToAsciiStrS (
+    StrStr (Context->ReportServer, L"://") + 3,
+    Host,
+    StrLen (Context->ReportServer) + 1
+    );
+  AsciiSPrint (ContentLength, sizeof (ContentLength), "%u", (UINT32)AsciiStrLen (Body));
+
+  ZeroMem (Headers, sizeof (Headers));
+  ZeroMem (&RequestMessage, sizeof (RequestMessage));
+  Headers[0].FieldName  = "Host";
+  Headers[0].FieldValue = Host;
+  Headers[1].FieldName  = "Connection";
+  Headers[1].FieldValue = "close";
+  Headers[2].FieldName  = "Content-Type";
+  Headers[2].FieldValue = "application/json";
+  Headers[3].FieldName  = "Content-Length";
+  Headers[3].FieldValue = ContentLength;
+  RequestMessage.HeaderCount = 4;
+  if (!EFI_ERROR (GetClientId (Context->ControllerHandle, ClientId, sizeof (ClientId)))) {
+    Headers[RequestMessage.HeaderCount].FieldName  = "X-Client-Id";
+    Headers[RequestMessage.HeaderCount].FieldValue = ClientId;
+    RequestMessage.HeaderCount++;
+  }
+
+  RequestData.Method          = HttpMethodPost;
+  RequestData.Url             = Url;
+  RequestMessage.Data.Request = &RequestData;
+  RequestMessage.Headers      = Headers;
+  RequestMessage.BodyLength   = AsciiStrLen (Body);
+  RequestMessage.Body         = Body;
+
+  //
+  // The connection of the download may be to a mirror the server redirected
+  // to, and is left to the pool: the report gets its own.
+  //
+  ZeroMem (&ReportContext, sizeof (ReportContext));
+  CopyMem (&ReportContext.HttpConfigData, &Context->HttpConfigData, sizeof (ReportContext.HttpConfigData));
+  ReportContext.ServerAddrAndProto = Context->ReportServer;
+
+  Status = AcquireHttpConnection (&ReportContext, Context->ControllerHandle, &Connection);
+  if (!EFI_ERROR (Status)) {
+    Status = SendReportRequest (ReportContext.Http, &RequestMessage);
+
+    //
+    // The answer is left unread, the connection cannot be reused.
+    //
+    ReleaseHttpConnection (Connection, FALSE);
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "Download report not sent - %r\n", Status));
+  }
+
+  FreePool (Url);
+  FreePool (Host);
+}
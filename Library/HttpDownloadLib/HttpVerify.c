@@ -0,0 +1,191 @@
+/** @file
+  Check a downloaded image block by block.
+
+  The image is cut in the blocks of its manifest. Hashing a block is a job
+  of the worker pool, so the blocks are hashed on every processor at once.
+
+  Sha256HashAll() may allocate its context, which an AP must not do: the
+  context of each block is allocated on the BSP with its job instead.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+#include "Http.h"
+
+#include <Library/BaseCryptLib.h>
+
+typedef struct {
+  CONST UINT8         *Data;
+  UINTN               Size;
+  //
+  // The expected SHA-256 of the block.
+  //
+  CONST UINT8         *Expected;
+  //
+  // The SHA-256 context of the block, NULL when not hashed.
+  //
+  VOID                *HashContext;
+  volatile BOOLEAN    Match;
+} HTTP_BLOCK_JOB;
+
+/**
+  Check the SHA-256 of a block. Runs on an AP.
+
+  @param[in, out]  Argument  The HTTP_BLOCK_JOB of the block.
+**/
+STATIC
+VOID
+EFIAPI
+HashBlock (
+  IN OUT VOID  *Argument
+  )
+{
+  HTTP_BLOCK_JOB  *Job;
+  UINT8           Digest[SHA256_DIGEST_SIZE];
+
+  Job        = Argument;
+  Job->Match = (BOOLEAN)(  Sha256Init (Job->HashContext)
+                        && Sha256Update (Job->HashContext, Job->Data, Job->Size)
+                        && Sha256Final (Job->HashContext, Digest)
+                        && (CompareMem (Digest, Job->Expected, SHA256_DIGEST_SIZE) == 0));
+}
+
+/**
+  Run a job on each block of an image, on all the processors.
+
+  @param[in]   Procedure     The job.
+  @param[in]   Image         The image.
+  @param[in]   ImageSize     Size of the image in bytes.
+  @param[in]   BlockSize     The block size, the last block may be shorter.
+  @param[in]   Expected      What each block is checked against.
+  @param[in]   ExpectedStep  Size of what each block is checked against.
+  @param[in]   ContextSize   Size of the hash context of a job, 0 for none.
+  @param[out]  Jobs          The jobs with their results and contexts, to
+                             be freed at once.
+
+  @retval  EFI_SUCCESS           The jobs have run.
+  @retval  EFI_OUT_OF_RESOURCES  Out of memory.
+**/
+STATIC
+EFI_STATUS
+RunBlockJobs (
+  IN  HTTP_WORKER_PROCEDURE  Procedure,
+  IN  CONST UINT8            *Image,
+  IN  UINTN                  ImageSize,
+  IN  UINTN                  BlockSize,
+  IN  CONST UINT8            *Expected,
+  IN  UINTN                  ExpectedStep,
+  IN  UINTN                  ContextSize,
+  OUT HTTP_BLOCK_JOB         **Jobs
+  )
+{
+  UINTN  BlockCount;
+  UINTN  Index;
+  UINT8  *Contexts;
+
+  //
+  // The contexts follow the jobs in the same allocation.
+  //
+  BlockCount  = (ImageSize + BlockSize - 1) / BlockSize;
+  ContextSize = ALIGN_VALUE (ContextSize, sizeof (UINT64));
+  *Jobs       = AllocateZeroPool (MAX (BlockCount, 1) * (sizeof (HTTP_BLOCK_JOB) + ContextSize));
+  if (*Jobs == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Contexts = (UINT8 *)(*Jobs + MAX (BlockCount, 1));
+
+  StartWorkers ();
+  for (Index = 0; Index < BlockCount; Index++) {
+    (*Jobs)[Index].Data     = Image + Index * BlockSize;
+    (*Jobs)[Index].Size     = MIN (BlockSize, ImageSize - Index * BlockSize);
+    (*Jobs)[Index].Expected = Expected + Index * ExpectedStep;
+    if (ContextSize != 0) {
+      (*Jobs)[Index].HashContext = Contexts + Index * ContextSize;
+    }
+
+    SubmitWork (Procedure, &(*Jobs)[Index]);
+  }
+
+  StopWorkers ();
+  return EFI_SUCCESS;
+}
+
+/**
+  Check an image against its block manifest.
+
+  @param[in]   Image         The image.
+  @param[in]   ImageSize     Size of the image in bytes.
+  @param[in]   Manifest      The manifest.
+  @param[in]   ManifestSize  Size of the manifest in bytes.
+  @param[out]  BadBlock      The first block not matching the manifest.
+
+  @retval  EFI_SUCCESS             Every block matches.
+  @retval  EFI_COMPROMISED_DATA    The manifest is malformed.
+  @retval  EFI_SECURITY_VIOLATION  A block does not match.
+  @retval  EFI_OUT_OF_RESOURCES    Out of memory.
+**/
+EFI_STATUS
+VerifyBlocks (
+  IN  CONST UINT8  *Image,
+  IN  UINTN        ImageSize,
+  IN  CONST CHAR8  *Manifest,
+  IN  UINTN        ManifestSize,
+  OUT UINTN        *BadBlock
+  )
+{
+  EFI_STATUS      Status;
+  UINT8           *Digests;
+  UINTN           MaxBlocks;
+  UINTN           BlockSize;
+  UINTN           BlockCount;
+  UINTN           Index;
+  HTTP_BLOCK_JOB  *Jobs;
+
+  *BadBlock = 0;
+
+  //
+  // A digest takes 64 characters of the manifest, which bounds their count.
+  //
+  MaxBlocks = ManifestSize / (SHA256_DIGEST_SIZE * 2);
+  Digests   = AllocatePool (MAX (MaxBlocks, 1) * SHA256_DIGEST_SIZE);
+  if (Digests == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = ParseManifestJson (Manifest, ManifestSize, &BlockSize, Digests, MaxBlocks, &BlockCount);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "VerifyBlocks() ParseManifestJson - %r\n", Status));
+    goto ON_EXIT;
+  }
+
+  //
+  // A manifest of an image of another size has no block to check the
+  // blocks past its end against.
+  //
+  if (BlockCount != (ImageSize + BlockSize - 1) / BlockSize) {
+    *BadBlock = MIN (BlockCount, (ImageSize + BlockSize - 1) / BlockSize);
+    Status    = EFI_SECURITY_VIOLATION;
+    goto ON_EXIT;
+  }
+
+  Status = RunBlockJobs (HashBlock, Image, ImageSize, BlockSize, Digests, SHA256_DIGEST_SIZE, Sha256GetContextSize (), &Jobs);
+  if (EFI_ERROR (Status)) {
+    goto ON_EXIT;
+  }
+
+  for (Index = 0; Index < BlockCount; Index++) {
+    if (!Jobs[Index].Match) {
+      *BadBlock = Index;
+      Status    = EFI_SECURITY_VIOLATION;
+      break;
+    }
+  }
+
+  FreePool (Jobs);
+
+ON_EXIT:
+  FreePool (Digests);
+  DEBUG ((DEBUG_INFO, "VerifyBlocks() 0x%x bytes - %r\n", ImageSize, Status));
+  return Status;
+}
@@ -0,0 +1,296 @@
+/** @file
+  Run the CPU-heavy stages of an update on the application processors.
+
+  A worker is started on each enabled AP with EFI_MP_SERVICES_PROTOCOL and
+  spins on its own job queue until the pool is stopped. The BSP is the only
+  producer of a queue and its AP the only consumer, so a queue is a ring
+  indexed by two counters, each written by one side only: no lock is taken.
+  The AP releases a slot once its job has run, so the jobs are all done
+  when every queue is empty.
+
+  The jobs run on the APs, where no UEFI service may be called: they only
+  read and write memory. Without MP services, or on a single processor, the
+  jobs run on the BSP as they are submitted.
+
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+#include "Http.h"
+
+#include <Protocol/MpService.h>
+
+#define HTTP_WORKER_MAX_APS  16
+
+//
+// A power of 2, so that the counters can wrap around.
+//
+#define HTTP_WORKER_QUEUE_SIZE  32
+
+//
+// Longest time to wait for MP services to see a stopped worker finished.
+//
+#define HTTP_WORKER_STOP_TIMEOUT_MS  1000
+
+typedef struct {
+  HTTP_WORKER_PROCEDURE    Procedure;
+  VOID                     *Argument;
+} HTTP_WORKER_JOB;
+
+typedef struct {
+  HTTP_WORKER_JOB     Queue[HTTP_WORKER_QUEUE_SIZE];
+  //
+  // Jobs done, written by the AP only.
+  //
+  volatile UINT32     Head;
+  //
+  // Jobs submitted, written by the BSP only.
+  //
+  volatile UINT32     Tail;
+  volatile BOOLEAN    Stop;
+  volatile BOOLEAN    Running;
+  UINTN               ProcessorNumber;
+  //
+  // Signaled by MP services once the AP is back idle.
+  //
+  EFI_EVENT           Finished;
+} HTTP_WORKER;
+
+STATIC EFI_MP_SERVICES_PROTOCOL  *mMpServices = NULL;
+STATIC HTTP_WORKER               mWorkers[HTTP_WORKER_MAX_APS];
+STATIC UINTN                     mWorkerCount = 0;
+STATIC UINTN                     mNextWorker  = 0;
+
+/**
+  Run the jobs of a queue until the pool is stopped. Runs on an AP.
+
+  @param[in] Buffer:  The worker of the AP.
+**/
+STATIC
+VOID
+EFIAPI
+WorkerLoop (
+  IN VOID  *Buffer
+  )
+{
+  HTTP_WORKER      *Worker;
+  HTTP_WORKER_JOB  *Job;
+  UINT32           Head;
+
+  Worker = Buffer;
+  while (!Worker->Stop) {
+    Head = Worker->Head;
+    if (Head == Worker->Tail) {
+      CpuPause ();
+      continue;
+    }
+
+    //
+    // The job is read only once the BSP has published it.
+    //
+    MemoryFence ();
+    Job = &Worker->Queue[Head % HTTP_WORKER_QUEUE_SIZE];
+    Job->Procedure (Job->Argument);
+
+    //
+    // The results of the job are visible before its slot is released.
+    //
+    MemoryFence ();
+    Worker->Head = Head + 1;
+  }
+
+  Worker->Running = FALSE;
+}
+
+/**
+  Start a worker on each enabled AP.
+
+  @return  The number of workers started, 0 when the jobs run on the BSP.
+**/
+UINTN
+StartWorkers (
+  VOID
+  )
+{
+  EFI_STATUS                 Status;
+  UINTN                      ProcessorCount;
+  UINTN                      EnabledCount;
+  UINTN                      BspNumber;
+  UINTN                      Index;
+  EFI_PROCESSOR_INFORMATION  Info;
+  HTTP_WORKER                *Worker;
+
+  ASSERT (mWorkerCount == 0);
+  mNextWorker = 0;
+
+  Status = gBS->LocateProtocol (&gEfiMpServiceProtocolGuid, NULL, (VOID **)&mMpServices);
+  if (EFI_ERROR (Status)) {
+    mMpServices = NULL;
+    return 0;
+  }
+
+  Status = mMpServices->GetNumberOfProcessors (mMpServices, &ProcessorCount, &EnabledCount);
+  if (EFI_ERROR (Status) || (EnabledCount < 2)) {
+    return 0;
+  }
+
+  Status = mMpServices->WhoAmI (mMpServices, &BspNumber);
+  if (EFI_ERROR (Status)) {
+    return 0;
+  }
+
+  for (Index = 0; (Index < ProcessorCount) && (mWorkerCount < HTTP_WORKER_MAX_APS); Index++) {
+    if (Index == BspNumber) {
+      continue;
+    }
+
+    Status = mMpServices->GetProcessorInfo (mMpServices, Index, &Info);
+    if (EFI_ERROR (Status) || ((Info.StatusFlag & PROCESSOR_ENABLED_BIT) == 0)) {
+      continue;
+    }
+
+    Worker = &mWorkers[mWorkerCount];
+    ZeroMem (Worker, sizeof (*Worker));
+    Worker->ProcessorNumber = Index;
+    Worker->Running         = TRUE;
+
+    //
+    // Given a WaitEvent, StartupThisAP() returns at once and leaves the
+    // loop running.
+    //
+    Status = gBS->CreateEvent (0, TPL_CALLBACK, NULL, NULL, &Worker->Finished);
+    if (EFI_ERROR (Status)) {
+      break;
+    }
+
+    Status = mMpServices->StartupThisAP (
+                            mMpServices,
+                            WorkerLoop,
+                            Index,
+                            Worker->Finished,
+                            0,
+                            Worker,
+                            NULL
+                            );
+    if (EFI_ERROR (Status)) {
+      //
+      // The AP is busy with the job of another module.
+      //
+      DEBUG ((DEBUG_INFO, "StartWorkers() StartupThisAP(%d) - %r\n", Index, Status));
+      gBS->CloseEvent (Worker->Finished);
+      continue;
+    }
+
+    mWorkerCount++;
+  }
+
+  DEBUG ((DEBUG_INFO, "StartWorkers() %d workers\n", mWorkerCount));
+  return mWorkerCount;
+}
+
+/**
+  Queue a job to the next worker with room for it.
+
+  When every queue is full, or no worker is running, the job runs on the
+  BSP before returning: the BSP then takes its share of the work instead of
+  waiting.
+
+  @param[in]  Procedure  The job.
+  @param[in]  Argument   Its argument.
+**/
+VOID
+SubmitWork (
+  IN HTTP_WORKER_PROCEDURE  Procedure,
+  IN VOID                   *Argument
+  )
+{
+  UINTN            Tried;
+  HTTP_WORKER      *Worker;
+  HTTP_WORKER_JOB  *Job;
+  UINT32           Tail;
+
+  for (Tried = 0; Tried < mWorkerCount; Tried++) {
+    Worker      = &mWorkers[mNextWorker];
+    mNextWorker = (mNextWorker + 1) % mWorkerCount;
+
+    Tail = Worker->Tail;
+    if ((UINT32)(Tail - Worker->Head) < HTTP_WORKER_QUEUE_SIZE) {
+      Job            = &Worker->Queue[Tail % HTTP_WORKER_QUEUE_SIZE];
+      Job->Procedure = Procedure;
+      Job->Argument  = Argument;
+
+      //
+      // The job is written before it is published.
+      //
+      MemoryFence ();
+      Worker->Tail = Tail + 1;
+      return;
+    }
+  }
+
+  Procedure (Argument);
+}
+
+/**
+  Wait until the workers have run every job submitted.
+**/
+VOID
+WaitForWorkers (
+  VOID
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < mWorkerCount; Index++) {
+    while (mWorkers[Index].Head != mWorkers[Index].Tail) {
+      CpuPause ();
+    }
+  }
+
+  //
+  // The results of the jobs are read after seeing them done.
+  //
+  MemoryFence ();
+}
+
+/**
+  Run the jobs left, then stop the workers and give the APs back to MP
+  services.
+**/
+VOID
+StopWorkers (
+  VOID
+  )
+{
+  UINTN        Index;
+  UINTN        Waited;
+  HTTP_WORKER  *Worker;
+
+  WaitForWorkers ();
+
+  for (Index = 0; Index < mWorkerCount; Index++) {
+    mWorkers[Index].Stop = TRUE;
+  }
+
+  for (Index = 0; Index < mWorkerCount; Index++) {
+    Worker = &mWorkers[Index];
+    while (Worker->Running) {
+      CpuPause ();
+    }
+
+    //
+    // MP services notice the AP idle from a timer, which only runs if the
+    // caller is not at a higher TPL. Should it not run, the event is left
+    // open rather than closed under MP services.
+    //
+    for (Waited = 0; Waited < HTTP_WORKER_STOP_TIMEOUT_MS; Waited++) {
+      if (!EFI_ERROR (gBS->CheckEvent (Worker->Finished))) {
+        gBS->CloseEvent (Worker->Finished);
+        break;
+      }
+
+      gBS->Stall (1000);
+    }
+  }
+
+  mWorkerCount = 0;
+}
@@ -0,0 +1,249 @@
+"""
+UEFIUpdateServer.py 负载测试
+
+模拟 N 个像 HttpDownloadLib 一样工作的客户端: 先 HEAD 再 GET /update,
+然后 HEAD 再 GET 镜像, 默认每个请求都带 Connection: close。另可加入只轮询
+/update 或只下载镜像的客户端。最后按阶段输出 requests/s 与延迟分位数,
+以及总吞吐量。
+
+用法:
+    py -3 LoadTest.py http://127.0.0.1:5000 --clients 200 --think 1 --duration 20
+    py -3 LoadTest.py http://127.0.0.1:5000 --clients 0 --downloaders 50 --pollers 4
+
+服务器需先发布一个镜像。
+"""
+import argparse
+import http.client
+import json
+import random
+import sys
+import threading
+import time
+from urllib.parse import urlencode, urlsplit
+
+CHUNK_SIZE = 64 * 1024
+USER_AGENT = "Mozilla/5.0 (EDK2; Linux) Gecko/20100101 Firefox/79.0"
+# 输出的阶段及顺序
+PHASES = ("HEAD /update", "GET /update", "HEAD image", "GET image")
+
+class Client:
+    """一个模拟的客户端, keep_alive 时复用同一个连接"""
+    def __init__(self, host, port, client_id, keep_alive):
+        self.host = host
+        self.port = port
+        self.keep_alive = keep_alive
+        self.headers = {
+            "User-Agent": USER_AGENT,
+            "X-Client-Id": client_id,
+            "Connection": "keep-alive" if keep_alive else "close"
+        }
+        self.conn = None
+
+    def request(self, method, path, headers=None, sink=None):
+        """发送一个请求, 返回状态码, 响应头与收到的字节数"""
+        # 复用的连接可能已被服务器关闭 (空闲超时或请求数上限), 此时重连一次
+        for attempt in range(2):
+            reused = self.conn is not None
+            if self.conn is None:
+                self.conn = http.client.HTTPConnection(self.host, self.port, timeout=60)
+            try:
+                self.conn.request(method, path, headers=dict(self.headers, **(headers or {})))
+                resp = self.conn.getresponse()
+                size = 0
+                while True:
+                    chunk = resp.read(CHUNK_SIZE)
+                    if not chunk:
+                        break
+                    size += len(chunk)
+                    if sink is not None:
+                        sink.append(chunk)
+                if not self.keep_alive or resp.will_close:
+                    self.close()
+                return resp.status, resp.headers, size
+            except (http.client.RemoteDisconnected, ConnectionResetError, BrokenPipeError):
+                self.close()
+                if not reused or attempt:
+                    raise
+
+    def close(self):
+        if self.conn is not None:
+            self.conn.close()
+            self.conn = None
+
+def percentile(samples, p):
+    if not samples:
+        return 0.0
+    return samples[min(len(samples) - 1, int(len(samples) * p / 100))]
+
+class Phase:
+    def __init__(self):
+        self.latency = []
+        self.errors = 0
+        self.busy = 0
+        self.bytes = 0
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.phases = {name: Phase() for name in PHASES}
+        self.downloads = 0
+
+    def record(self, name, start, status, size, ok):
+        latency = time.monotonic() - start
+        with self.lock:
+            phase = self.phases[name]
+            phase.bytes += size
+            if ok:
+                phase.latency.append(latency)
+            elif status == 503:
+                phase.busy += 1
+            else:
+                phase.errors += 1
+
+def timed(stats, name, client, method, path, expected, headers=None, sink=None):
+    """发送一个请求并记入阶段 name, 返回状态码与响应头, 连接失败时状态码为 0"""
+    start = time.monotonic()
+    try:
+        status, response_headers, size = client.request(method, path, headers, sink)
+    except OSError:
+        client.close()
+        status, response_headers, size = 0, {}, 0
+    stats.record(name, start, status, size, status in expected)
+    return status, response_headers
+
+def back_off(headers, deadline):
+    """服务器忙 (503) 时按 Retry-After 等待, 不超过测试结束时间"""
+    try:
+        delay = int(headers.get("Retry-After", 1))
+    except ValueError:
+        delay = 1
+    time.sleep(max(0, min(delay, deadline - time.monotonic())))
+
+def download_image(client, path, range_size, deadline, stats):
+    """HEAD 取得镜像大小后 GET 镜像, range_size 非 0 时分段请求"""
+    status, headers = timed(stats, "HEAD image", client, "HEAD", path, (200,))
+    if status != 200:
+        if status == 503:
+            back_off(headers, deadline)
+        return
+    image_size = int(headers.get("Content-Length", 0))
+
+    if range_size == 0:
+        status, headers = timed(stats, "GET image", client, "GET", path, (200,))
+    else:
+        for start in range(0, image_size, range_size):
+            end = min(start + range_size, image_size) - 1
+            status, headers = timed(stats, "GET image", client, "GET", path, (206,),
+                                    {"Range": f"bytes={start}-{end}"})
+            if status != 206:
+                break
+    if status in (200, 206):
+        with stats.lock:
+            stats.downloads += 1
+    elif status == 503:
+        back_off(headers, deadline)
+
+def fleet_client(host, port, index, args, deadline, stats):
+    """像 HttpDownloadLib 一样检查更新, 有更新时下载镜像, 每轮之间等待 think time"""
+    client = Client(host, port, "02:00:%02x:%02x:%02x:%02x" % tuple(index.to_bytes(4, "big")), args.keep_alive)
+    query = urlencode({name: value for name, value in (("board", args.board), ("current", args.current)) if value})
+    update = "/update?" + query if query else "/update"
+    # 错开各客户端的起始时间, 避免所有请求同时到达
+    time.sleep(random.uniform(0, args.think))
+    while time.monotonic() < deadline:
+        # 已是发布的版本时服务器回答 204, 客户端到此为止
+        status, _ = timed(stats, "HEAD /update", client, "HEAD", update, (200, 204, 404))
+        if status == 200:
+            body = []
+            status, _ = timed(stats, "GET /update", client, "GET", update, (200,), sink=body)
+            if status == 200:
+                path = urlsplit(json.loads(b"".join(body))["image_url"]).path
+                download_image(client, path, args.range_size, deadline, stats)
+        if args.think:
+            time.sleep(random.uniform(0, 2 * args.think))
+    client.close()
+
+def poller(host, port, index, args, deadline, stats):
+    client = Client(host, port, "02:01:%02x:%02x:%02x:%02x" % tuple(index.to_bytes(4, "big")), args.keep_alive)
+    while time.monotonic() < deadline:
+        timed(stats, "GET /update", client, "GET", "/update", (200,))
+    client.close()
+
+def downloader(host, port, index, args, deadline, stats, path):
+    client = Client(host, port, "02:02:%02x:%02x:%02x:%02x" % tuple(index.to_bytes(4, "big")), args.keep_alive)
+    while time.monotonic() < deadline:
+        status, headers = timed(stats, "GET image", client, "GET", path, (200,))
+        if status == 200:
+            with stats.lock:
+                stats.downloads += 1
+        elif status == 503:
+            back_off(headers, deadline)
+    client.close()
+
+def main():
+    parser = argparse.ArgumentParser(description="Load test of UEFIUpdateServer.py")
+    parser.add_argument("url", help="server base URL, e.g. http://127.0.0.1:5000")
+    parser.add_argument("--clients", type=int, default=50,
+                        help="clients checking /update and downloading like HttpDownloadLib (default: 50)")
+    parser.add_argument("--think", type=float, default=0,
+                        help="mean seconds a client waits between two update checks (default: 0)")
+    parser.add_argument("--keep-alive", action="store_true",
+                        help="reuse one connection per client instead of Connection: close")
+    parser.add_argument("--range-size", type=int, default=0, metavar="BYTES",
+                        help="download the image in Range requests of this size (default: whole file)")
+    parser.add_argument("--board", default="", help="board ID the clients send to /update")
+    parser.add_argument("--current", default="",
+                        help="version the clients report as installed, the server answers 204 when it is published")
+    parser.add_argument("--downloaders", type=int, default=0, help="clients only downloading the image (default: 0)")
+    parser.add_argument("--pollers", type=int, default=0, help="clients only polling /update (default: 0)")
+    parser.add_argument("--duration", type=float, default=20, help="test duration in seconds (default: 20)")
+    args = parser.parse_args()
+
+    server = urlsplit(args.url)
+    host, port = server.hostname, server.port or 80
+
+    # 只下载镜像的客户端从 /update 取得镜像路径, 主机部分以命令行参数为准
+    path = None
+    if args.downloaders:
+        body = []
+        status, _, _ = Client(host, port, "02:ff:00:00:00:00", False).request("GET", "/update", sink=body)
+        if status != 200:
+            print(f"/update returned {status}, publish an image first")
+            sys.exit(1)
+        path = urlsplit(json.loads(b"".join(body))["image_url"]).path
+
+    stats = Stats()
+    start = time.monotonic()
+    deadline = start + args.duration
+    threads = [threading.Thread(target=fleet_client, args=(host, port, i, args, deadline, stats))
+               for i in range(args.clients)]
+    threads += [threading.Thread(target=poller, args=(host, port, i, args, deadline, stats))
+                for i in range(args.pollers)]
+    threads += [threading.Thread(target=downloader, args=(host, port, i, args, deadline, stats, path))
+                for i in range(args.downloaders)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.monotonic() - start
+
+    print(f"{args.clients} clients, {args.downloaders} downloaders, {args.pollers} pollers, "
+          f"{'keep-alive' if args.keep_alive else 'Connection: close'}, think {args.think:g} s, {elapsed:.1f} s")
+    print(f"{'phase':<13} {'requests':>9} {'req/s':>8} {'p50 ms':>8} {'p99 ms':>8} {'p999 ms':>8} "
+          f"{'max ms':>8} {'503':>6} {'errors':>6}")
+    total_requests = total_bytes = 0
+    for name, phase in stats.phases.items():
+        latency = sorted(phase.latency)
+        requests = len(latency) + phase.busy + phase.errors
+        total_requests += requests
+        total_bytes += phase.bytes
+        if requests == 0:
+            continue
+        print(f"{name:<13} {requests:>9} {requests / elapsed:>8.1f} {percentile(latency, 50) * 1000:>8.1f} "
+              f"{percentile(latency, 99) * 1000:>8.1f} {percentile(latency, 99.9) * 1000:>8.1f} "
+              f"{max(latency, default=0) * 1000:>8.1f} {phase.busy:>6} {phase.errors:>6}")
+    print(f"total: {total_requests / elapsed:.1f} req/s, {total_bytes * 8 / elapsed / 1e9:.2f} Gbit/s, "
+          f"{stats.downloads} image downloads")
+
+if __name__ == "__main__":
+    main()
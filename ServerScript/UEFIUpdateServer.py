@@ -1,12 +1,41 @@
 import http.server
+import http.client
 import socketserver
 import json
 import os
 import sys
-from urllib.parse import parse_qs
+from urllib.parse import parse_qs, urlsplit, quote, unquote
+import posixpath
 import threading
-import cgi
 import socket
+import tempfile
+import email.message
+import gzip
+import lzma
+import shutil
+import subprocess
+import signal
+import traceback
+import multiprocessing
+import sqlite3
+import time
+import bisect
+import queue
+import logging
+import logging.handlers
+import argparse
+import hashlib
+import ipaddress
+import re
+import struct
+import uuid
+import contextlib
+from collections import deque
+from concurrent.futures import ThreadPoolExecutor, ProcessPoolExecutor
+try:
+    import fcntl
+except ImportError:
+    fcntl = None
 
 def get_local_ip():
     """获取本机IPv4地址"""
@@ -20,12 +49,41 @@ def get_local_ip():
         return "127.0.0.1"
 
 # 全局变量存储发布状态和IP地址
-published_data = {
-    'is_published': False,
-    'version': None,
-    'file_path': None
-}
+# 已发布的镜像目录 (Catalog), 由 run_server 打开
+catalog = None
+# BIN/ 下的文件经 /BIN/ 提供下载
+BIN_DIR = os.path.join(os.getcwd(), 'BIN')
+# 上传的镜像按内容存放为 BIN/sha256/<SHA-256>, 派生文件在其旁边以它为前缀,
+# 同一地址的内容永不改变, 相同内容的多次发布共用一个文件
+CONTENT_DIR = os.path.join(BIN_DIR, 'sha256')
+# 按内容存放的文件可被客户端与中间缓存一直保存, 不必重新验证
+IMMUTABLE_CACHE_CONTROL = 'public, max-age=31536000, immutable'
+# 客户端不指定发布通道时使用的通道
+DEFAULT_CHANNEL = 'stable'
+# 有 os.sendfile 时由内核直接把文件发送到 socket, 各请求按偏移量读取, 可共用一个文件句柄
+USE_SENDFILE = hasattr(os, 'sendfile')
 LOCAL_IP = get_local_ip()
+# 镜像服务器地址列表, 如 http://10.0.0.2:5000, 需在每个镜像上发布相同的文件
+MIRRORS = []
+# 按客户端子网把 BIN/ 下的下载重定向 (307) 到就近的镜像: [(ip_network, 镜像地址)],
+# 前缀长的在前; 与重定向一起发送的缓存时间 (秒), 客户端在此期间直接访问镜像
+REDIRECTS = []
+REDIRECT_TTL = 300
+# 生成派生文件的进程池, 与签名用的私钥 (PEM), 由命令行参数设置
+artifact_pool = None
+SIGN_KEY = None
+# 同时进行的镜像下载数的限制 (BoundedSemaphore), 不限制时为 None
+download_slots = None
+# 不超过此字节数的 Range 请求 (镜像探测, 缺块修补) 不受下载数限制
+SMALL_RANGE_MAX = 64 * 1024
+# 代理模式下上游服务器文件的本机缓存 (UpstreamCache), 不是代理时为 None
+upstream_cache = None
+# 组播发送线程 (MulticastSender), 未指定 --multicast 时为 None
+multicast_sender = None
+# 按内容存放的镜像的传输计数与清理 (ContentStore), 由 serve 创建
+content_store = None
+# 结构化日志, 经队列由后台线程写出, 不阻塞处理请求的线程
+logger = logging.getLogger('UEFIUpdateServer')
 
 HTML = """
 <!DOCTYPE html>
@@ -116,7 +174,20 @@ HTML = """
             <input type="file" id="fileInput" required>
             <div id="filePath"></div>
         </div>
+        <div class="form-group">
+            <label for="board">Board ID (empty for all boards):</label>
+            <input type="text" id="board" placeholder="SMBIOS baseboard product name">
+        </div>
+        <div class="form-group">
+            <label for="channel">Channel:</label>
+            <input type="text" id="channel" value="stable">
+        </div>
+        <div class="form-group">
+            <label for="rollout">Rollout (% of clients):</label>
+            <input type="number" id="rollout" min="0" max="100" value="100">
+        </div>
         <button id="publishBtn" disabled>Publish</button>
+        <button id="rolloutBtn">Update Rollout</button>
         <button id="stopBtn">Stop Publishing</button>
         <div id="message"></div>
         
@@ -130,6 +201,10 @@ HTML = """
         const fileInput = document.getElementById('fileInput');
         const publishBtn = document.getElementById('publishBtn');
         const stopBtn = document.getElementById('stopBtn');
+        const board = document.getElementById('board');
+        const channel = document.getElementById('channel');
+        const rollout = document.getElementById('rollout');
+        const rolloutBtn = document.getElementById('rolloutBtn');
         const message = document.getElementById('message');
         const filePath = document.getElementById('filePath');
         const currentStatus = document.getElementById('currentStatus');
@@ -138,9 +213,11 @@ HTML = """
             try {
                 const response = await fetch('/status');
                 const status = await response.json();
-                if (status.is_published) {
+                if (status.catalog.length) {
                     currentStatus.classList.remove('no-publish');
-                    currentStatus.innerHTML = `Version: ${status.version}\nFile Path: ${status.file_path}`;
+                    currentStatus.textContent = status.catalog.map(entry =>
+                        `Board: ${entry.board || '(all)'}  Channel: ${entry.channel}\nVersion: ${entry.version}\n` +
+                        `File Path: ${entry.file_path}\nRollout: ${entry.rollout}%`).join('\n\n');
                 } else {
                     currentStatus.classList.add('no-publish');
                     currentStatus.textContent = 'No BIOS currently published';
@@ -170,6 +247,9 @@ HTML = """
         publishBtn.addEventListener('click', async () => {
             const formData = new FormData();
             formData.append('version', version.value);
+            formData.append('board', board.value);
+            formData.append('channel', channel.value);
+            formData.append('rollout', rollout.value);
             formData.append('file', fileInput.files[0]);
 
             try {
@@ -188,11 +268,30 @@ HTML = """
             }
         });
 
+        rolloutBtn.addEventListener('click', async () => {
+            try {
+                const response = await fetch('/rollout', {
+                    method: 'POST',
+                    body: new URLSearchParams({board: board.value, channel: channel.value, percent: rollout.value})
+                });
+                const result = await response.text();
+                message.className = response.ok ? 'message success' : 'message error';
+                message.textContent = result;
+                updateStatus();
+            } catch (error) {
+                message.className = 'message error';
+                message.textContent = 'Error updating rollout';
+            }
+        });
+
         stopBtn.addEventListener('click', async () => {
             try {
-                const response = await fetch('/stop', {method: 'POST'});
+                const response = await fetch('/stop', {
+                    method: 'POST',
+                    body: new URLSearchParams({board: board.value, channel: channel.value})
+                });
                 const result = await response.text();
-                message.className = 'message success';
+                message.className = response.ok ? 'message success' : 'message error';
                 message.textContent = result;
                 // 更新状态显示
                 updateStatus();
@@ -206,113 +305,1900 @@ HTML = """
 </html>
 """
 
+def file_etag(st):
+    """大小与修改时间确定文件内容, 用作强 ETag"""
+    return f'"{st.st_size:x}-{st.st_mtime_ns:x}"'
+
+class PublishedImage:
+    """
+    保持打开的已发布镜像, 文件内容常驻页缓存
+    被替换后, 由最后一个仍在发送它的请求释放引用时关闭
+    """
+    def __init__(self, path, version, sha256, board='', channel=DEFAULT_CHANNEL):
+        self.path = os.path.realpath(path)
+        self.version = version
+        self.sha256 = sha256
+        self.board = board
+        self.channel = channel
+        self.file = open(path, 'rb')
+        st = os.fstat(self.file.fileno())
+        self.size = st.st_size
+        self.mtime = st.st_mtime
+        self.etag = file_etag(st)
+        # 已生成的派生文件, 名称 -> 描述
+        self.artifacts = {}
+        # 可以获得此次更新的客户端百分比
+        self.rollout = 100
+        self.build_update()
+
+    def is_download(self, path):
+        """path 是否为镜像或其压缩版本"""
+        if path == self.path:
+            return True
+        directory = os.path.dirname(self.path)
+        return any('encoding' in info and os.path.join(directory, info['file']) == path
+                   for info in list(self.artifacts.values()))
+
+    def build_update(self):
+        """
+        生成 /update 的响应与其强 ETag, 每个请求直接发送
+        在发布时与每个派生文件就绪时生成, 作为一个元组整体替换
+        """
+        body = json.dumps(build_update_response(self)).encode()
+        self.update = (body, '"' + hashlib.sha256(body).hexdigest()[:32] + '"')
+
+    def describe(self):
+        return {
+            'board': self.board,
+            'channel': self.channel,
+            'version': self.version,
+            'file_path': self.path,
+            'size': self.size,
+            'sha256': self.sha256,
+            'rollout': self.rollout
+        }
+
+CATALOG_SCHEMA = """
+CREATE TABLE IF NOT EXISTS releases (
+    board TEXT NOT NULL,
+    channel TEXT NOT NULL,
+    version TEXT NOT NULL,
+    file_path TEXT NOT NULL,
+    size INTEGER NOT NULL,
+    sha256 TEXT NOT NULL,
+    rollout INTEGER NOT NULL,
+    artifacts TEXT NOT NULL DEFAULT '{}',
+    published REAL NOT NULL,
+    current INTEGER NOT NULL,
+    PRIMARY KEY (board, channel, version)
+);
+CREATE INDEX IF NOT EXISTS current_releases ON releases (current);
+"""
+
+# 多进程时各进程检查其他进程是否修改了发布目录的间隔 (秒)
+CATALOG_POLL_INTERVAL = 0.005
+
+class Catalog:
+    """
+    按 (board, channel) 索引的已发布镜像, 镜像从发布起保持打开
+    /update 只查内存中的字典; 每个版本的发布记录保存在 SQLite 数据库中,
+    服务器重启后恢复当前的发布, 多进程时各进程经由它共享发布状态。
+    board 为空的条目适用于没有专门发布的主板
+    """
+    def __init__(self, db_path):
+        # 发布状态会被多个工作线程同时读写, 数据库连接也由这个锁保护
+        self.lock = threading.Lock()
+        self.images = {}
+        # 每次发布状态改变时加一并通知 changed, 长轮询的 /update 在其上等待
+        self.changed = threading.Condition(self.lock)
+        self.generation = 0
+        # 服务器退出时置位, 结束所有等待
+        self.closed = False
+        self.db = sqlite3.connect(db_path, check_same_thread=False)
+        # WAL 模式下其他进程写入时仍可读取
+        self.db.execute('PRAGMA journal_mode=WAL')
+        self.db.executescript(CATALOG_SCHEMA)
+
+    def load(self):
+        """
+        按数据库中的当前发布更新内存中的字典, 内容未变的镜像沿用原来的对象与文件句柄,
+        文件已不存在或大小已改变的跳过
+        """
+        with self.lock:
+            rows = self.db.execute(
+                'SELECT board, channel, version, file_path, size, sha256, rollout, artifacts '
+                'FROM releases WHERE current').fetchall()
+            images = {}
+            for board, channel, version, file_path, size, sha256, rollout, artifacts in rows:
+                image = self.images.get((board, channel))
+                if image is None or (image.version, image.path, image.sha256) != (version, file_path, sha256):
+                    try:
+                        image = PublishedImage(file_path, version, sha256, board, channel)
+                    except OSError as e:
+                        logger.warning(f"Release {version} of {board or '(all)'}/{channel} not restored: {e}")
+                        continue
+                    if image.size != size:
+                        logger.warning(f"Release {version} of {board or '(all)'}/{channel} not restored: {file_path} changed")
+                        image.file.close()
+                        continue
+                image.rollout = rollout
+                directory = os.path.dirname(image.path)
+                artifacts = {name: info for name, info in json.loads(artifacts).items()
+                             if os.path.isfile(os.path.join(directory, info['file']))}
+                if artifacts != image.artifacts:
+                    image.artifacts = artifacts
+                    image.build_update()
+                images[(board, channel)] = image
+            self.images = images
+            self.notify_changed()
+
+    def watch(self):
+        """
+        在后台线程中执行: 其他进程提交修改后本连接的 data_version 随之改变,
+        此时重新读取当前发布, 一个进程中的发布几毫秒内就在所有进程中生效
+        """
+        version = None
+        while True:
+            with self.lock:
+                changed, version = version, self.db.execute('PRAGMA data_version').fetchone()[0]
+            if changed is not None and changed != version:
+                self.load()
+            time.sleep(CATALOG_POLL_INTERVAL)
+
+    def notify_changed(self):
+        """发布状态已改变, 调用者持有 self.lock"""
+        self.generation += 1
+        self.changed.notify_all()
+
+    def wait_for_change(self, generation, timeout):
+        """等待发布状态自 generation 之后改变, 最多 timeout 秒"""
+        with self.changed:
+            self.changed.wait_for(lambda: self.generation != generation or self.closed, timeout)
+
+    def close(self):
+        with self.changed:
+            self.closed = True
+            self.changed.notify_all()
+
+    def referenced(self):
+        """所有当前发布 (包括其他进程刚发布的) 的镜像 SHA-256"""
+        with self.lock:
+            return {sha256 for sha256, in self.db.execute('SELECT sha256 FROM releases WHERE current')}
+
+    def artifacts_of(self, path):
+        """此前发布同一文件时生成的派生文件, 已被清理的除外"""
+        with self.lock:
+            row = self.db.execute('SELECT artifacts FROM releases WHERE file_path = ? '
+                                  'ORDER BY published DESC LIMIT 1', (path,)).fetchone()
+        if row is None:
+            return {}
+        directory = os.path.dirname(path)
+        return {name: info for name, info in json.loads(row[0]).items()
+                if os.path.isfile(os.path.join(directory, info['file']))}
+
+    def lookup(self, board, channel):
+        """主板在发布通道上的当前发布, 没有专门发布时取 board 为空的条目"""
+        with self.lock:
+            return self.images.get((board, channel)) or self.images.get(('', channel))
+
+    def find_download(self, path):
+        """path 是其镜像或压缩版本的已发布镜像, 没有时返回 None"""
+        with self.lock:
+            images = list(self.images.values())
+        for image in images:
+            if image.path == path:
+                return image
+        for image in images:
+            if image.is_download(path):
+                return image
+        return None
+
+    def publish(self, image):
+        """发布镜像, 替换同一主板与通道上的当前发布"""
+        with self.lock:
+            self.db.execute('UPDATE releases SET current = 0 WHERE board = ? AND channel = ?',
+                            (image.board, image.channel))
+            self.db.execute('INSERT OR REPLACE INTO releases VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, 1)',
+                            (image.board, image.channel, image.version, image.path, image.size, image.sha256,
+                             image.rollout, json.dumps(image.artifacts), time.time()))
+            self.db.commit()
+            self.images[(image.board, image.channel)] = image
+            self.notify_changed()
+
+    def stop(self, board, channel):
+        """停止发布, 返回被停止的镜像, 没有发布时返回 None"""
+        with self.lock:
+            image = self.images.pop((board, channel), None)
+            self.db.execute('UPDATE releases SET current = 0 WHERE board = ? AND channel = ?', (board, channel))
+            self.db.commit()
+            self.notify_changed()
+        return image
+
+    def set_rollout(self, board, channel, percent):
+        """修改放量百分比, 返回对应的镜像, 没有发布时返回 None"""
+        with self.lock:
+            image = self.images.get((board, channel))
+            if image is not None:
+                image.rollout = percent
+                self.db.execute('UPDATE releases SET rollout = ? WHERE board = ? AND channel = ? AND current',
+                                (percent, board, channel))
+                self.db.commit()
+                self.notify_changed()
+        return image
+
+    def add_artifact(self, image, name, info):
+        """加入生成完毕的派生文件, 重新生成 /update 的响应"""
+        with self.lock:
+            image.artifacts[name] = info
+            image.build_update()
+            if self.images.get((image.board, image.channel)) is image:
+                self.db.execute('UPDATE releases SET artifacts = ? WHERE board = ? AND channel = ? AND current',
+                                (json.dumps(image.artifacts), image.board, image.channel))
+                self.db.commit()
+                self.notify_changed()
+
+    def status(self):
+        """
+        发布状态的一致快照, catalog 列出所有当前发布,
+        其余字段描述所有主板在默认通道上的发布
+        """
+        with self.lock:
+            entries = [image.describe() for _, image in sorted(self.images.items())]
+            default = self.images.get(('', DEFAULT_CHANNEL))
+        data = {'is_published': default is not None}
+        for key in ('version', 'file_path', 'size', 'sha256', 'rollout'):
+            data[key] = default.describe()[key] if default is not None else None
+        data['catalog'] = entries
+        return data
+
+def content_digest(path):
+    """BIN/sha256/ 下按内容存放的文件所属镜像的 SHA-256, 其他文件返回 None"""
+    path = os.path.realpath(path)
+    if os.path.dirname(path) != CONTENT_DIR:
+        return None
+    digest = os.path.basename(path).split('.', 1)[0]
+    return digest if re.fullmatch('[0-9a-f]{64}', digest) else None
+
+# 清理不再被引用的镜像的检查间隔 (秒)
+CONTENT_SWEEP_INTERVAL = 60
+
+class ContentStore:
+    """
+    BIN/sha256/ 下按内容存放的镜像: 镜像被替换或停止发布后, 在最后一次传输结束
+    retain 秒之后才删除它及其派生文件, 替换之前开始的下载与续传都能完成。
+    多进程时各进程只知道自己的传输, 但文件在 POSIX 上删除后已打开的传输仍可继续
+    """
+    def __init__(self, retain):
+        self.retain = retain
+        self.lock = threading.Lock()
+        # SHA-256 -> 进行中的传输数
+        self.active = {}
+        # SHA-256 -> 不再被引用或最后一次传输结束的时间
+        self.released = {}
+
+    @contextlib.contextmanager
+    def transfer(self, path):
+        """发送 path 期间它所属的镜像不会被删除"""
+        digest = content_digest(path)
+        if digest is None:
+            yield
+            return
+        with self.lock:
+            self.active[digest] = self.active.get(digest, 0) + 1
+        try:
+            yield
+        finally:
+            with self.lock:
+                self.active[digest] -= 1
+                if not self.active[digest]:
+                    del self.active[digest]
+                    self.released[digest] = time.monotonic()
+
+    def run(self):
+        """在后台线程中执行"""
+        while True:
+            time.sleep(CONTENT_SWEEP_INTERVAL)
+            try:
+                self.sweep()
+            except (OSError, sqlite3.Error) as e:
+                logger.warning(f"Sweeping {CONTENT_DIR} failed: {e}")
+
+    def sweep(self):
+        """删除保留时间已过的镜像与派生文件"""
+        referenced = catalog.referenced()
+        now = time.monotonic()
+        try:
+            names = os.listdir(CONTENT_DIR)
+        except FileNotFoundError:
+            return
+        present = set()
+        for name in names:
+            digest = content_digest(os.path.join(CONTENT_DIR, name))
+            if digest is None:
+                continue
+            present.add(digest)
+            with self.lock:
+                if digest in referenced or digest in self.active:
+                    self.released.pop(digest, None)
+                    continue
+                released = self.released.setdefault(digest, now)
+            if now - released >= self.retain:
+                try:
+                    os.unlink(os.path.join(CONTENT_DIR, name))
+                except FileNotFoundError:
+                    pass
+                logger.info(f"Removed {name}, no longer published")
+        with self.lock:
+            self.released = {digest: at for digest, at in self.released.items() if digest in present}
+
+def release_key(form):
+    """从查询参数或表单取得 (board, channel), SMBIOS 字符串常带的首尾空格不计"""
+    board = form.get('board', [''])[0].strip()
+    channel = form.get('channel', [''])[0].strip() or DEFAULT_CHANNEL
+    return board, channel
+
+def bin_url(base, path):
+    """BIN/ 下文件 path 在服务器 base 上的地址"""
+    return f"{base}/BIN/" + quote(os.path.relpath(path, BIN_DIR).replace(os.sep, '/'))
+
+class JsonFormatter(logging.Formatter):
+    """每条日志输出为一行 JSON, 附加字段取自 extra={'fields': {...}}"""
+    def format(self, record):
+        entry = {
+            'time': self.formatTime(record, '%Y-%m-%dT%H:%M:%S'),
+            'level': record.levelname.lower(),
+            'message': record.getMessage()
+        }
+        entry.update(getattr(record, 'fields', {}))
+        return json.dumps(entry)
+
+def setup_logging(level, log_file):
+    """设置日志级别与输出, 返回写日志的 QueueListener"""
+    handler = logging.FileHandler(log_file) if log_file else logging.StreamHandler()
+    handler.setFormatter(JsonFormatter())
+    log_queue = queue.SimpleQueue()
+    listener = logging.handlers.QueueListener(log_queue, handler)
+    logger.addHandler(logging.handlers.QueueHandler(log_queue))
+    logger.setLevel(logging.CRITICAL + 1 if level == 'off' else level.upper())
+    logger.propagate = False
+    listener.start()
+    return listener
+
+# /update 延迟 (秒) 与单个下载吞吐量 (字节/秒) 直方图的区间上限
+LATENCY_BUCKETS = (0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5)
+THROUGHPUT_BUCKETS = (1e5, 1e6, 1e7, 2.5e7, 5e7, 1e8, 2.5e8, 5e8, 1e9, 2.5e9)
+# 指标中单独统计的路径, BIN/ 下的文件合为一项, 其余为 other, 避免标签数量无限增长
+METRICS_ROUTES = ('/', '/update', '/status', '/metrics', '/publish', '/stop', '/rollout', '/report')
+
+def metrics_path(path):
+    route = urlsplit(path).path
+    if route in METRICS_ROUTES:
+        return route
+    if route.startswith('/BIN/'):
+        return '/BIN/'
+    return 'other'
+
+class Histogram:
+    def __init__(self, buckets):
+        self.buckets = buckets
+        self.counts = [0] * (len(buckets) + 1)
+        self.sum = 0.0
+        self.count = 0
+
+    def observe(self, value):
+        self.counts[bisect.bisect_left(self.buckets, value)] += 1
+        self.sum += value
+        self.count += 1
+
+    def render(self, name, lines):
+        cumulative = 0
+        for bound, count in zip(self.buckets, self.counts):
+            cumulative += count
+            lines.append(f'{name}_bucket{{le="{bound:g}"}} {cumulative}')
+        lines.append(f'{name}_bucket{{le="+Inf"}} {self.count}')
+        lines.append(f'{name}_sum {self.sum:.6f}')
+        lines.append(f'{name}_count {self.count}')
+
+class Metrics:
+    """服务器指标, 以 Prometheus 文本格式输出, 与日志级别无关"""
+    def __init__(self):
+        self.lock = threading.Lock()
+        # (path, code) -> 请求数
+        self.requests = {}
+        # path -> 响应体字节数
+        self.bytes_sent = {}
+        self.downloads_in_flight = 0
+        self.long_polls_waiting = 0
+        self.download_throughput = Histogram(THROUGHPUT_BUCKETS)
+        self.update_latency = Histogram(LATENCY_BUCKETS)
+
+    def request_done(self, path, code, size, duration):
+        with self.lock:
+            self.requests[(path, code)] = self.requests.get((path, code), 0) + 1
+            self.bytes_sent[path] = self.bytes_sent.get(path, 0) + size
+            if path == '/update':
+                self.update_latency.observe(duration)
+
+    def long_poll(self, delta):
+        with self.lock:
+            self.long_polls_waiting += delta
+
+    def download_started(self):
+        with self.lock:
+            self.downloads_in_flight += 1
+
+    def download_done(self, size, duration):
+        with self.lock:
+            self.downloads_in_flight -= 1
+            if size > 0 and duration > 0:
+                self.download_throughput.observe(size / duration)
+
+    def render(self):
+        with self.lock:
+            lines = ['# HELP uefi_update_requests_total Requests answered, by path and status code.',
+                     '# TYPE uefi_update_requests_total counter']
+            for (path, code), count in sorted(self.requests.items()):
+                lines.append(f'uefi_update_requests_total{{path="{path}",code="{code}"}} {count}')
+            lines += ['# HELP uefi_update_response_bytes_total Response body bytes sent, by path.',
+                      '# TYPE uefi_update_response_bytes_total counter']
+            for path, size in sorted(self.bytes_sent.items()):
+                lines.append(f'uefi_update_response_bytes_total{{path="{path}"}} {size}')
+            lines += ['# HELP uefi_update_downloads_in_flight Image downloads in progress.',
+                      '# TYPE uefi_update_downloads_in_flight gauge',
+                      f'uefi_update_downloads_in_flight {self.downloads_in_flight}',
+                      '# HELP uefi_update_long_polls_waiting /update requests held until a publish.',
+                      '# TYPE uefi_update_long_polls_waiting gauge',
+                      f'uefi_update_long_polls_waiting {self.long_polls_waiting}',
+                      '# HELP uefi_update_download_throughput_bytes_per_second Throughput of each image download.',
+                      '# TYPE uefi_update_download_throughput_bytes_per_second histogram']
+            self.download_throughput.render('uefi_update_download_throughput_bytes_per_second', lines)
+            lines += ['# HELP uefi_update_update_latency_seconds Time to answer /update, long-poll waits excluded.',
+                      '# TYPE uefi_update_update_latency_seconds histogram']
+            self.update_latency.render('uefi_update_update_latency_seconds', lines)
+        fleet_reports.render(lines)
+        if multicast_sender is not None:
+            lines += ['# HELP uefi_update_multicast_bytes_total Bytes sent to the multicast group, headers included.',
+                      '# TYPE uefi_update_multicast_bytes_total counter',
+                      f'uefi_update_multicast_bytes_total {multicast_sender.bytes_sent}']
+        return ('\n'.join(lines) + '\n').encode()
+
+metrics = Metrics()
+
+# 客户端下载报告: 请求体上限, 每组保留的样本数, 组数上限 (超出的组合计入 other) 与输出的分位数
+REPORT_MAX_SIZE = 4096
+REPORT_SAMPLES = 1024
+REPORT_MAX_GROUPS = 256
+REPORT_QUANTILES = (0.5, 0.9, 0.99)
+# 小于此大小的下载 (如 /update) 不计入吞吐量
+REPORT_MIN_THROUGHPUT_BYTES = 64 * 1024
+# 输出的分布: 名称, 说明, 每个样本由报告算出的值 (None 表示不计入)
+REPORT_SERIES = (
+    ('dhcp_seconds', 'Time to get an address by DHCP, cached leases excluded.',
+     lambda r: r['dhcp_ms'] / 1000 if r['lease'] == 'dhcp' else None),
+    ('first_byte_seconds', 'Time from the request to the first byte of the response.',
+     lambda r: r['first_byte_ms'] / 1000),
+    ('throughput_bytes_per_second', 'Throughput of the downloads of at least 64 KB.',
+     lambda r: r['bytes'] * 1000 / r['transfer_ms']
+     if r['bytes'] >= REPORT_MIN_THROUGHPUT_BYTES and r['transfer_ms'] > 0 else None),
+    ('retries', 'Requests answered 503 before each download.', lambda r: r['retries']),
+    ('buffer_bytes', 'Receive buffer size of the clients.', lambda r: r['buffer_size']),
+)
+REPORT_NUMBERS = ('dhcp_ms', 'first_byte_ms', 'transfer_ms', 'bytes', 'retries', 'buffer_size')
+
+def label_value(value):
+    """报告中的字符串作为 Prometheus 标签值, 截断并转义"""
+    value = str(value)[:64]
+    return value.replace('\\', '\\\\').replace('"', '\\"').replace('\n', ' ')
+
+def parse_report(body):
+    """解析并检查客户端下载报告, 格式不对时抛出 ValueError"""
+    try:
+        report = json.loads(body)
+    except (UnicodeDecodeError, json.JSONDecodeError) as e:
+        raise ValueError(f"Invalid JSON: {e}")
+    if not isinstance(report, dict):
+        raise ValueError("Report must be a JSON object")
+    for name in REPORT_NUMBERS:
+        value = report.get(name, 0)
+        if not isinstance(value, int) or isinstance(value, bool) or value < 0:
+            raise ValueError(f"Invalid {name}")
+        report[name] = value
+    for name in ('board', 'driver', 'nic', 'lease'):
+        value = report.get(name, 'unknown')
+        if not isinstance(value, str):
+            raise ValueError(f"Invalid {name}")
+        report[name] = value or 'unknown'
+    return report
+
+class FleetReports:
+    """
+    按 (板卡, 网卡驱动) 汇总客户端的下载报告, 每组保留最近 REPORT_SAMPLES 个样本,
+    在 /metrics 中输出各分布的分位数, 找出慢的板卡与驱动
+    """
+    def __init__(self):
+        self.lock = threading.Lock()
+        # (board, driver) -> 报告数
+        self.counts = {}
+        # (board, driver) -> [每个分布一个 deque]
+        self.samples = {}
+
+    def add(self, report):
+        key = (report['board'], report['driver'])
+        with self.lock:
+            if key not in self.counts and len(self.counts) >= REPORT_MAX_GROUPS:
+                key = ('other', 'other')
+            self.counts[key] = self.counts.get(key, 0) + 1
+            samples = self.samples.setdefault(key, [deque(maxlen=REPORT_SAMPLES) for _ in REPORT_SERIES])
+            for series, (_, _, value_of) in zip(samples, REPORT_SERIES):
+                value = value_of(report)
+                if value is not None:
+                    series.append(value)
+
+    def render(self, lines):
+        with self.lock:
+            lines += ['# HELP uefi_update_reports_total Download reports received, by board and NIC driver.',
+                      '# TYPE uefi_update_reports_total counter']
+            groups = sorted(self.counts)
+            labels = {key: f'board="{label_value(key[0])}",driver="{label_value(key[1])}"' for key in groups}
+            for key in groups:
+                lines.append(f'uefi_update_reports_total{{{labels[key]}}} {self.counts[key]}')
+            for index, (name, help_text, _) in enumerate(REPORT_SERIES):
+                name = f'uefi_update_report_{name}'
+                lines += [f'# HELP {name} {help_text} Over the last {REPORT_SAMPLES} reports.',
+                          f'# TYPE {name} summary']
+                for key in groups:
+                    values = sorted(self.samples[key][index])
+                    if not values:
+                        continue
+                    for q in REPORT_QUANTILES:
+                        value = values[min(len(values) - 1, int(len(values) * q))]
+                        lines.append(f'{name}{{{labels[key]},quantile="{q:g}"}} {value:g}')
+                    lines.append(f'{name}_sum{{{labels[key]}}} {sum(values):g}')
+                    lines.append(f'{name}_count{{{labels[key]}}} {len(values)}')
+
+fleet_reports = FleetReports()
+
+def in_rollout(client_id, percent):
+    """
+    按客户端标识的哈希把客户端分为 100 组, 前 percent 组可以获得更新
+    分组与版本无关, 每次发布都是同一批客户端先更新
+    """
+    if percent >= 100:
+        return True
+    bucket = int.from_bytes(hashlib.sha256(client_id.lower().encode()).digest()[:4], 'big') % 100
+    return bucket < percent
+
+def build_update_response(image):
+    """
+    生成 /update 的响应, mirrors 包含本机及所有镜像上的镜像文件地址,
+    artifacts 只包含已经生成完毕的派生文件
+    """
+    image_url = bin_url(f"http://{LOCAL_IP}:{PORT}", image.path)
+    response = {
+        "message": f"New BIOS version available: {image.version}",
+        "version": image.version,
+        "image_url": image_url,
+        "size": image.size,
+        "sha256": image.sha256
+    }
+    if MIRRORS:
+        response["mirrors"] = [image_url] + [bin_url(mirror.rstrip('/'), image.path) for mirror in MIRRORS]
+    if multicast_sender is not None:
+        response["multicast"] = f"{multicast_sender.group}:{multicast_sender.port}"
+    if image.artifacts:
+        directory = os.path.dirname(image.path)
+        response["artifacts"] = {
+            name: dict(info, url=bin_url(f"http://{LOCAL_IP}:{PORT}", os.path.join(directory, info['file'])))
+            for name, info in sorted(image.artifacts.items())
+        }
+    return response
+
+def parse_redirect(value):
+    """--redirect 的 SUBNET=URL"""
+    subnet, sep, url = value.partition('=')
+    if not sep or urlsplit(url).scheme != 'http' or not urlsplit(url).hostname:
+        raise argparse.ArgumentTypeError(f"expected SUBNET=http://HOST[:PORT], got {value!r}")
+    try:
+        return ipaddress.ip_network(subnet, strict=False), url.rstrip('/')
+    except ValueError as e:
+        raise argparse.ArgumentTypeError(str(e))
+
+def redirect_target(client_ip):
+    """客户端所在子网的镜像地址, 没有时返回 None"""
+    try:
+        address = ipaddress.ip_address(client_ip)
+    except ValueError:
+        return None
+    for network, url in REDIRECTS:
+        if address in network:
+            return url
+    return None
+
+class UpstreamError(Exception):
+    """上游服务器以错误状态码回答"""
+    def __init__(self, status, reason):
+        super().__init__(f"Upstream returned {status} {reason}")
+        self.status = status
+
+def file_sha256(path):
+    digest = hashlib.sha256()
+    for block in read_blocks(path):
+        digest.update(block)
+    return digest.hexdigest()
+
+def bin_relpath(url_path):
+    """URL 路径 /BIN/... 在 BIN/ 下的相对路径 (posix 形式), 不在 BIN/ 下时返回 None"""
+    path = posixpath.normpath(unquote(url_path))
+    if not path.startswith('/BIN/'):
+        return None
+    return path[len('/BIN/'):]
+
+class UpstreamCache:
+    """
+    代理模式: 上游服务器 BIN/ 下的文件缓存在本机 BIN/ 的相同位置
+    每个文件只从上游下载一次, 同时请求同一个未缓存文件的客户端等待同一次下载,
+    多进程时以文件锁在进程之间协调。/update 中的 sha256 与缓存的内容不同时
+    (上游重新发布了同名文件) 重新下载
+    """
+    def __init__(self, url):
+        upstream = urlsplit(url)
+        self.url = url.rstrip('/')
+        self.host = upstream.hostname
+        self.port = upstream.port or 80
+        self.lock = threading.Lock()
+        # 相对路径 -> 已缓存内容的 SHA-256
+        self.cached = {}
+        # 相对路径 -> 上游 /update 中给出的 SHA-256
+        self.expected = {}
+        # 相对路径 -> 进行中的下载 (threading.Event)
+        self.fetches = {}
+
+    def connect(self, timeout=60):
+        return http.client.HTTPConnection(self.host, self.port, timeout=timeout)
+
+    def expect(self, rel, sha256):
+        with self.lock:
+            self.expected[rel] = sha256
+
+    def fetch(self, rel):
+        """确保 rel 已缓存在本机, 上游出错时抛出 UpstreamError 或 OSError"""
+        with self.lock:
+            sha256 = self.cached.get(rel)
+            if sha256 is not None and self.expected.get(rel, sha256) == sha256:
+                return
+            fetch = self.fetches.get(rel)
+            if fetch is None:
+                fetch = self.fetches[rel] = threading.Event()
+                fetch.error = None
+                owner = True
+            else:
+                owner = False
+
+        if not owner:
+            fetch.wait()
+            if fetch.error is not None:
+                raise fetch.error
+            return
+
+        try:
+            sha256 = self.load(rel)
+            with self.lock:
+                self.cached[rel] = sha256
+        except Exception as e:
+            fetch.error = e
+            raise
+        finally:
+            with self.lock:
+                del self.fetches[rel]
+            fetch.set()
+
+    def load(self, rel):
+        """本机已有内容相符的文件 (如另一个进程刚下载的) 时直接使用, 否则从上游下载"""
+        local = os.path.join(BIN_DIR, *rel.split('/'))
+        os.makedirs(BIN_DIR, exist_ok=True)
+        # 各进程锁住共用锁文件中由路径哈希决定的一个字节, 不为每个路径创建文件
+        with open(os.path.join(BIN_DIR, '.fetch.lock'), 'w') as lock:
+            if fcntl is not None:
+                offset = int.from_bytes(hashlib.sha256(rel.encode()).digest()[:4], 'big')
+                fcntl.lockf(lock, fcntl.LOCK_EX, 1, offset)
+            if os.path.isfile(local):
+                # 按内容存放的镜像, 文件名就是内容的 SHA-256, 不必重新计算
+                if content_digest(local) == os.path.basename(local):
+                    return os.path.basename(local)
+                sha256 = file_sha256(local)
+                with self.lock:
+                    expected = self.expected.get(rel)
+                if expected in (None, sha256):
+                    return sha256
+            return self.download(rel, local)
+
+    def download(self, rel, local):
+        """从上游下载到临时文件, 同时计算 SHA-256, 完成后改名, 正在发送旧文件的请求不受影响"""
+        start = time.monotonic()
+        conn = self.connect()
+        try:
+            conn.request('GET', '/BIN/' + quote(rel), headers={'Connection': 'close'})
+            resp = conn.getresponse()
+            if resp.status != 200:
+                raise UpstreamError(resp.status, resp.reason)
+            os.makedirs(os.path.dirname(local), exist_ok=True)
+            fd, tmp_path = tempfile.mkstemp(dir=os.path.dirname(local), prefix='.fetch-')
+            try:
+                digest = hashlib.sha256()
+                with os.fdopen(fd, 'wb') as out:
+                    while True:
+                        block = resp.read(MANIFEST_BLOCK_SIZE)
+                        if not block:
+                            break
+                        digest.update(block)
+                        out.write(block)
+                if resp.length:
+                    raise OSError(f"Upstream closed the connection with {resp.length} bytes missing")
+                os.chmod(tmp_path, 0o644)
+                os.replace(tmp_path, local)
+            except BaseException:
+                os.unlink(tmp_path)
+                raise
+        finally:
+            conn.close()
+        logger.info(f"Fetched {rel} from upstream", extra={'fields': {
+            'size': os.path.getsize(local),
+            'duration_ms': round((time.monotonic() - start) * 1000, 3)
+        }})
+        return digest.hexdigest()
+
+    def rewrite_update(self, body):
+        """
+        上游 /update 响应中 BIN/ 下文件的地址改为本机地址, 并记下各文件的 SHA-256;
+        mirrors 不再给出, 机架内的客户端只从本机下载。返回新的响应与镜像的相对路径
+        """
+        response = json.loads(body)
+        local = f"http://{LOCAL_IP}:{PORT}"
+
+        def localize(url, sha256):
+            rel = bin_relpath(urlsplit(url).path)
+            if rel is None:
+                return url, None
+            if sha256:
+                self.expect(rel, sha256)
+            return local + '/BIN/' + quote(rel), rel
+
+        response.pop('mirrors', None)
+        response['image_url'], image = localize(response['image_url'], response.get('sha256'))
+        for info in response.get('artifacts', {}).values():
+            info['url'], _ = localize(info['url'], info.get('sha256'))
+        return json.dumps(response).encode(), image
+
+# 块哈希清单的块大小, 客户端可按块比较或续传
+# 组播包头: 魔数, 协议版本, 类型, 负载长度, 会话 (sha256 的前 32 位), 块号 (校验包为组号),
+# 块数, 块大小, 每组数据块数, 保留, 文件大小, 均为网络字节序
+MULTICAST_HEADER = struct.Struct('!4sBBHIIIHBBQ')
+MULTICAST_MAGIC = b'UOTM'
+MULTICAST_VERSION = 1
+MULTICAST_DATA = 0
+MULTICAST_PARITY = 1
+# 块大小使包在 1500 字节的 MTU 内不分片
+MULTICAST_BLOCK_SIZE = 1024
+# 每组数据块之后发送一个异或校验块, 每组丢失一个块时客户端可自行恢复
+MULTICAST_GROUP_SIZE = 8
+# 最后一次有客户端取得某镜像的 /update 之后继续组播它的时间 (秒)
+MULTICAST_LINGER = 60
+
+class MulticastSender:
+    """
+    以 UDP 组播轮流循环发送近期有客户端请求过的镜像, 整机架同时更新时每个字节只发送一次
+    每个镜像按块编号发送, 每 MULTICAST_GROUP_SIZE 个数据块跟一个异或校验块;
+    客户端收完一轮后, 仍缺的块用普通的 HTTP Range 请求补齐
+    """
+    def __init__(self, address, rate, ttl):
+        self.group, port = address.rsplit(':', 1)
+        self.port = int(port)
+        # 每秒发送的字节数
+        self.rate = rate * 1e6 / 8
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, ttl)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+        if LOCAL_IP != '127.0.0.1':
+            self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(LOCAL_IP))
+        self.condition = threading.Condition()
+        # image -> 最后一次被请求的时间
+        self.requested = {}
+        self.bytes_sent = 0
+
+    def request(self, image):
+        """客户端取得了 image 的 /update, 开始或继续组播它"""
+        with self.condition:
+            self.requested[image] = time.monotonic()
+            self.condition.notify()
+
+    def active_images(self):
+        """近期被请求过且仍是当前发布的镜像, 没有时等待"""
+        with self.condition:
+            while True:
+                now = time.monotonic()
+                with catalog.lock:
+                    current = set(catalog.images.values())
+                self.requested = {image: at for image, at in self.requested.items()
+                                  if image in current and now - at < MULTICAST_LINGER}
+                if self.requested:
+                    return list(self.requested)
+                self.condition.wait()
+
+    def run(self):
+        """在后台线程中执行: 按 rate 限速, 一次发送一个镜像的一整轮"""
+        budget, last = 0.0, time.monotonic()
+        while True:
+            for image in self.active_images():
+                for packet in self.packets(image):
+                    while budget < len(packet):
+                        time.sleep((len(packet) - budget) / self.rate)
+                        now = time.monotonic()
+                        # 空闲之后不累积发送额度, 避免突发
+                        budget = min(budget + (now - last) * self.rate, 64 * 1024)
+                        last = now
+                    budget -= len(packet)
+                    try:
+                        self.sock.sendto(packet, (self.group, self.port))
+                        self.bytes_sent += len(packet)
+                    except OSError as e:
+                        logger.warning(f"Multicast to {self.group}:{self.port} failed: {e}")
+                        time.sleep(1)
+                        break
+
+    @staticmethod
+    def packets(image):
+        """镜像的一轮: 数据块, 每组之后为该组的异或校验块"""
+        session = int(image.sha256[:8], 16)
+        count = (image.size + MULTICAST_BLOCK_SIZE - 1) // MULTICAST_BLOCK_SIZE
+        fd = image.file.fileno()
+        parity = 0
+        for index in range(count):
+            block = os.pread(fd, MULTICAST_BLOCK_SIZE, index * MULTICAST_BLOCK_SIZE)
+            yield MULTICAST_HEADER.pack(MULTICAST_MAGIC, MULTICAST_VERSION, MULTICAST_DATA, len(block), session,
+                                        index, count, MULTICAST_BLOCK_SIZE, MULTICAST_GROUP_SIZE, 0,
+                                        image.size) + block
+            # 最后一个块不足块大小时按补零计算
+            parity ^= int.from_bytes(block.ljust(MULTICAST_BLOCK_SIZE, b'\0'), 'big')
+            if index % MULTICAST_GROUP_SIZE == MULTICAST_GROUP_SIZE - 1 or index == count - 1:
+                yield MULTICAST_HEADER.pack(MULTICAST_MAGIC, MULTICAST_VERSION, MULTICAST_PARITY,
+                                            MULTICAST_BLOCK_SIZE, session, index // MULTICAST_GROUP_SIZE, count,
+                                            MULTICAST_BLOCK_SIZE, MULTICAST_GROUP_SIZE, 0,
+                                            image.size) + parity.to_bytes(MULTICAST_BLOCK_SIZE, 'big')
+                parity = 0
+
+MANIFEST_BLOCK_SIZE = 64 * 1024
+
+def read_blocks(path, block_size=MANIFEST_BLOCK_SIZE):
+    with open(path, 'rb') as f:
+        while True:
+            block = f.read(block_size)
+            if not block:
+                return
+            yield block
+
+def finish_artifact(tmp_path, dst_path, **extra):
+    """把生成完的临时文件改名为最终文件名, 返回派生文件的描述"""
+    digest = hashlib.sha256()
+    for block in read_blocks(tmp_path):
+        digest.update(block)
+    os.replace(tmp_path, dst_path)
+    return dict(extra, file=os.path.basename(dst_path), size=os.path.getsize(dst_path), sha256=digest.hexdigest())
+
+# 以下任务在进程池中执行, 各自读取镜像并计算其 SHA-256 一起返回,
+# 以便发现镜像在生成期间被替换
+def make_gzip(src, dst):
+    source = hashlib.sha256()
+    with open(dst + '.tmp', 'wb') as out, gzip.GzipFile(fileobj=out, mode='wb', filename='', mtime=0) as z:
+        for block in read_blocks(src):
+            source.update(block)
+            z.write(block)
+    return source.hexdigest(), finish_artifact(dst + '.tmp', dst, encoding='gzip')
+
+def make_xz(src, dst):
+    source = hashlib.sha256()
+    with lzma.open(dst + '.tmp', 'wb', preset=6) as z:
+        for block in read_blocks(src):
+            source.update(block)
+            z.write(block)
+    return source.hexdigest(), finish_artifact(dst + '.tmp', dst, encoding='xz')
+
+def make_manifest(src, dst):
+    source = hashlib.sha256()
+    blocks = []
+    for block in read_blocks(src):
+        source.update(block)
+        blocks.append(hashlib.sha256(block).hexdigest())
+    with open(dst + '.tmp', 'w') as out:
+        json.dump({"block_size": MANIFEST_BLOCK_SIZE, "blocks": blocks}, out)
+    return source.hexdigest(), finish_artifact(dst + '.tmp', dst, block_size=MANIFEST_BLOCK_SIZE)
+
+def make_signature(src, dst, key):
+    """用 openssl 生成 RSA/ECDSA-SHA256 分离签名 (DER)"""
+    source = hashlib.sha256()
+    with subprocess.Popen(['openssl', 'dgst', '-sha256', '-sign', key, '-out', dst + '.tmp'],
+                          stdin=subprocess.PIPE) as proc:
+        for block in read_blocks(src):
+            source.update(block)
+            proc.stdin.write(block)
+        proc.stdin.close()
+    if proc.returncode != 0:
+        raise RuntimeError(f"openssl exited with {proc.returncode}")
+    return source.hexdigest(), finish_artifact(dst + '.tmp', dst, algorithm='sha256')
+
+def artifact_done(image, name, future):
+    """派生文件生成完毕, 镜像仍是生成时的内容才加入 /update"""
+    try:
+        source_sha256, info = future.result()
+    except Exception as e:
+        logger.error(f"Artifact {name} of {image.path} failed: {e}")
+        return
+    if source_sha256 != image.sha256:
+        return
+    if 'encoding' in info and info['size'] >= image.size:
+        # 压缩后没有变小, 不值得客户端解压
+        os.unlink(os.path.join(os.path.dirname(image.path), info['file']))
+        return
+    catalog.add_artifact(image, name, info)
+
+def start_artifact_pipeline(image):
+    """
+    在后台并行生成镜像的派生文件, 存放在镜像旁边, 文件名以镜像的文件名 (即其 SHA-256) 为前缀;
+    相同内容此前发布时已生成的派生文件直接沿用
+    """
+    base = image.path
+    image.artifacts = catalog.artifacts_of(image.path)
+    if 'digest' not in image.artifacts:
+        # 摘要在上传时已经算出, 直接写入
+        with open(base + '.sha256.tmp', 'w') as out:
+            out.write(f"{image.sha256}  {os.path.basename(image.path)}\n")
+        image.artifacts['digest'] = finish_artifact(base + '.sha256.tmp', base + '.sha256', algorithm='sha256')
+    image.build_update()
+
+    # 按耗时从少到多提交, CPU 核数少时先完成的先公布
+    tasks = {'manifest': (make_manifest, image.path, base + '.blocks.json')}
+    if SIGN_KEY is not None:
+        tasks['signature'] = (make_signature, image.path, base + '.sig', SIGN_KEY)
+    tasks['gzip'] = (make_gzip, image.path, base + '.gz')
+    tasks['xz'] = (make_xz, image.path, base + '.xz')
+    for name, task in tasks.items():
+        if name in image.artifacts:
+            continue
+        future = artifact_pool.submit(*task)
+        future.add_done_callback(lambda future, name=name: artifact_done(image, name, future))
+
+# /publish 表单中的文本字段及其最大长度
+UPLOAD_FIELDS = {'version': 256, 'rollout': 8, 'board': 64, 'channel': 32}
+
+def parse_rollout(value):
+    """解析放量百分比, 0 到 100"""
+    if not value.strip().isdigit() or int(value) > 100:
+        raise ValueError("Rollout must be a percentage from 0 to 100")
+    return int(value)
+
+class MultipartParser:
+    """
+    流式解析 multipart/form-data 请求体
+    各部分的数据按块交给接收函数, 内存占用与请求体大小无关
+    """
+    block_size = 64 * 1024
+    max_header_size = 16 * 1024
+
+    def __init__(self, rfile, length, boundary):
+        self.rfile = rfile
+        self.remaining = length
+        self.delimiter = b'\r\n--' + boundary
+        # 请求体以分隔符开头, 前面补上 CRLF, 所有分隔符就可以按同样的方式查找
+        self.buffer = bytearray(b'\r\n')
+
+    def fill(self):
+        """读入更多请求体, 已读完时返回 False"""
+        if self.remaining == 0:
+            return False
+        chunk = self.rfile.read(min(self.remaining, self.block_size))
+        if not chunk:
+            raise ValueError("Request body truncated")
+        self.remaining -= len(chunk)
+        self.buffer += chunk
+        return True
+
+    def skip_to_delimiter(self, write=None):
+        """把下一个分隔符之前的数据交给 write (为 None 时丢弃), 并跳过分隔符"""
+        # 缓冲区末尾可能是分隔符的前一部分, 留到下次查找
+        keep = len(self.delimiter) - 1
+        while True:
+            index = self.buffer.find(self.delimiter)
+            if index >= 0:
+                if write is not None and index > 0:
+                    write(bytes(self.buffer[:index]))
+                del self.buffer[:index + len(self.delimiter)]
+                return
+            if len(self.buffer) > keep:
+                if write is not None:
+                    write(bytes(self.buffer[:-keep]))
+                del self.buffer[:-keep]
+            if not self.fill():
+                raise ValueError("Multipart boundary not found")
+
+    def read_headers(self):
+        """读取一个部分的头部, 返回 (name, filename)"""
+        while True:
+            index = self.buffer.find(b'\r\n\r\n')
+            if index >= 0:
+                break
+            if len(self.buffer) > self.max_header_size:
+                raise ValueError("Multipart header too large")
+            if not self.fill():
+                raise ValueError("Request body truncated")
+        lines = self.buffer[:index].decode('utf-8', 'replace').split('\r\n')
+        del self.buffer[:index + 4]
+
+        part = email.message.Message()
+        for line in lines:
+            key, sep, value = line.partition(':')
+            if sep:
+                part[key.strip()] = value.strip()
+        return part.get_param('name', header='content-disposition'), part.get_filename()
+
+    def parse(self, open_part):
+        """
+        解析整个请求体, 每个部分调用 open_part(name, filename),
+        返回接收该部分数据的函数, 返回 None 时丢弃该部分
+        """
+        self.skip_to_delimiter()
+        while True:
+            while len(self.buffer) < 2:
+                if not self.fill():
+                    raise ValueError("Request body truncated")
+            if self.buffer[:2] == b'--':
+                break
+            name, filename = self.read_headers()
+            self.skip_to_delimiter(open_part(name, filename))
+
+        # 丢弃结束分隔符之后的内容, 使连接可以继续使用
+        while self.fill():
+            self.buffer.clear()
+
 class RequestHandler(http.server.SimpleHTTPRequestHandler):
-    def do_HEAD(self):
-        if self.path == '/update':
-            if published_data['is_published']:
-                response = {
-                    "message": f"New BIOS version available: {published_data['version']}",
-                    "image_url": f"http://{LOCAL_IP}:{PORT}/BIN/{os.path.basename(published_data['file_path'])}"
-                }
-                self.send_response(200)
-                self.send_header('Content-type', 'application/json')
-                self.send_header('Content-Length', str(len(json.dumps(response).encode('utf-8'))))
-                self.end_headers()
+    # HTTP/1.1 长连接, 每个响应都必须带 Content-Length
+    protocol_version = "HTTP/1.1"
+    # 等待下一个请求的空闲超时 (秒), 与每个连接最多处理的请求数, 由命令行参数设置
+    idle_timeout = 5
+    max_requests = 100
+    # 处理请求期间的读写超时 (秒)
+    io_timeout = 60
+    # 没有 sendfile 时文件按此大小的块读取发送
+    copy_block_size = 64 * 1024
+    # socket 发送缓冲区大小, 减少大文件发送时的系统调用与唤醒次数
+    send_buffer_size = 4 * 1024 * 1024
+    # 一个请求最多的 Range 数, 超过时发送整个文件
+    max_ranges = 16
+    # 下载数已满时建议客户端等待的秒数, 由命令行参数设置
+    retry_after = 30
+    # 长轮询 /update 最长等待的秒数, 与同时等待的请求数的限制 (BoundedSemaphore), 由命令行参数设置
+    max_wait = 300
+    long_poll_slots = None
+
+    def setup(self):
+        super().setup()
+        self.connection.setsockopt(socket.SOL_SOCKET, socket.SO_SNDBUF, self.send_buffer_size)
+        # 响应头与响应体分两次写出, 关闭 Nagle 以免保持连接时后者等待客户端的延迟 ACK
+        self.connection.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.requests_served = 0
+
+    def handle_one_request(self):
+        self.response_code = None
+        self.connection.settimeout(self.idle_timeout)
+        try:
+            super().handle_one_request()
+        finally:
+            if self.response_code is not None:
+                self.request_done()
+
+    def parse_request(self):
+        # 请求行已收到, 改用读写超时, 避免慢速下载被空闲超时断开
+        self.connection.settimeout(self.io_timeout)
+        self.request_start = time.monotonic()
+        self.bytes_sent = 0
+        # 长轮询等待的秒数, 不计入 /update 的响应时间
+        self.waited = 0
+        return super().parse_request()
+
+    def log_request(self, code='-', size='-'):
+        # 访问日志在请求完成后由 request_done 写出
+        self.response_code = int(code)
+
+    def log_message(self, format, *args):
+        logger.warning(format % args, extra={'fields': {'client': self.client_address[0]}})
+
+    def request_done(self):
+        """记录已完成请求的指标与访问日志"""
+        duration = time.monotonic() - self.request_start
+        metrics.request_done(metrics_path(self.path), self.response_code, self.bytes_sent, duration - self.waited)
+        if logger.isEnabledFor(logging.INFO):
+            logger.info('request', extra={'fields': {
+                'client': self.client_address[0],
+                'method': self.command,
+                'path': self.path,
+                'status': self.response_code,
+                'bytes': self.bytes_sent,
+                'duration_ms': round(duration * 1000, 3)
+            }})
+
+    def write_body(self, data):
+        self.wfile.write(data)
+        self.bytes_sent += len(data)
+
+    def send_response(self, code, message=None):
+        super().send_response(code, message)
+        self.requests_served += 1
+        if self.requests_served >= self.max_requests:
+            self.send_header('Connection', 'close')
+
+    def send_bytes(self, content_type, body, etag=None):
+        """发送 200 响应, HEAD 请求只发送头部"""
+        self.send_response(200)
+        self.send_header('Content-type', content_type)
+        self.send_header('Content-Length', str(len(body)))
+        if etag is not None:
+            self.send_header('ETag', etag)
+        self.end_headers()
+        if self.command != 'HEAD':
+            self.write_body(body)
+
+    def etag_matches(self, etag):
+        """If-None-Match 是否包含 etag, 按弱比较"""
+        header = self.headers.get('If-None-Match')
+        if header is None:
+            return False
+        tags = [tag.strip() for tag in header.split(',')]
+        return '*' in tags or etag in tags or 'W/' + etag in tags
+
+    def receive_upload(self):
+        """
+        接收 /publish 上传的版本号, 主板, 发布通道与镜像文件
+        镜像按块写入 BIN/ 下的临时文件, 同时计算 SHA-256 与大小, 完成后改名为
+        BIN/sha256/<SHA-256>; 已有相同内容的文件时沿用它, 丢弃上传的副本
+        返回 PublishedImage 所需的各项 (dict), 请求无效时抛出 ValueError
+        """
+        content_type = email.message.Message()
+        content_type['Content-Type'] = self.headers.get('Content-Type', '')
+        boundary = content_type.get_param('boundary')
+        if content_type.get_content_type() != 'multipart/form-data' or not boundary:
+            raise ValueError("multipart/form-data expected")
+        length = self.headers.get('Content-Length')
+        if length is None or not length.isdigit():
+            raise ValueError("Content-Length required")
+
+        os.makedirs(BIN_DIR, exist_ok=True)
+        fields = {name: bytearray() for name in UPLOAD_FIELDS}
+        upload = {}
+
+        def open_part(name, filename):
+            if name in fields:
+                value = fields[name]
+
+                def write_field(data):
+                    value.extend(data)
+                    if len(value) > UPLOAD_FIELDS[name]:
+                        raise ValueError(f"{name.capitalize()} too long")
+                return write_field
+            if name != 'file' or 'tmp_path' in upload:
+                return None
+            fd, upload['tmp_path'] = tempfile.mkstemp(dir=BIN_DIR, prefix='.upload-')
+            upload.update(file=os.fdopen(fd, 'wb'), sha256=hashlib.sha256(), size=0)
+
+            def write_file(data):
+                upload['file'].write(data)
+                upload['sha256'].update(data)
+                upload['size'] += len(data)
+            return write_file
+
+        try:
+            MultipartParser(self.rfile, int(length), boundary.encode()).parse(open_part)
+            form = {name: [value.decode('utf-8', 'replace')] for name, value in fields.items()}
+            version = form['version'][0].strip()
+            if 'tmp_path' not in upload or not version:
+                raise ValueError("Version and file required")
+            percent = parse_rollout(form['rollout'][0] or '100')
+            board, channel = release_key(form)
+            upload['file'].close()
+            os.makedirs(CONTENT_DIR, exist_ok=True)
+            file_path = os.path.join(CONTENT_DIR, upload['sha256'].hexdigest())
+            if os.path.isfile(file_path):
+                # 内容已存在, 不替换文件, 正在发送它的请求不受影响
+                os.unlink(upload['tmp_path'])
             else:
-                super().do_HEAD()
-        else:
-            super().do_HEAD()
-    def do_GET(self):
-        if self.path == '/':
-            self.send_response(200)
-            self.send_header('Content-type', 'text/html')
+                # mkstemp 创建的文件只有所有者可读
+                os.chmod(upload['tmp_path'], 0o644)
+                os.replace(upload['tmp_path'], file_path)
+        except BaseException:
+            if 'tmp_path' in upload:
+                upload['file'].close()
+                if os.path.exists(upload['tmp_path']):
+                    os.unlink(upload['tmp_path'])
+            raise
+
+        return {
+            'version': version,
+            'board': board,
+            'channel': channel,
+            'file_path': file_path,
+            'sha256': upload['sha256'].hexdigest(),
+            'rollout': percent
+        }
+
+    def read_form(self):
+        """读取 application/x-www-form-urlencoded 请求体, 超过 1 KB 时返回 None"""
+        length = int(self.headers.get('Content-Length') or 0)
+        if length > 1024:
+            return None
+        return parse_qs(self.rfile.read(length).decode('ascii', 'replace'))
+
+    def receive_report(self):
+        """接收客户端的下载报告 (JSON), 以 204 回答; 客户端发出报告后不等回答即关闭连接"""
+        length = int(self.headers.get('Content-Length') or 0)
+        if length > REPORT_MAX_SIZE:
+            self.close_connection = True
+            self.send_error(413)
+            return
+        try:
+            report = parse_report(self.rfile.read(length))
+        except ValueError as e:
+            self.send_error(400, str(e))
+            return
+        fleet_reports.add(report)
+        self.close_connection = True
+        try:
+            self.send_response(204)
             self.end_headers()
-            self.wfile.write(HTML.encode())
-        elif self.path == '/update':
-            if published_data['is_published']:
-                response = {
-                    "message": f"New BIOS version available: {published_data['version']}",
-                    "image_url": f"http://{LOCAL_IP}:{PORT}/BIN/{os.path.basename(published_data['file_path'])}"
-                }
-                self.send_response(200)
-                self.send_header('Content-type', 'application/json')
-                self.send_header('Content-Length', str(len(json.dumps(response).encode('utf-8'))))
-                self.end_headers()
-                self.wfile.write(json.dumps(response).encode())
+        except (BrokenPipeError, ConnectionResetError):
+            pass
+
+    def discard_body(self):
+        """丢弃未处理的请求体, 使连接可以继续使用"""
+        length = int(self.headers.get('Content-Length') or 0)
+        while length > 0:
+            chunk = self.rfile.read(min(length, 64 * 1024))
+            if not chunk:
+                break
+            length -= len(chunk)
+
+    def parse_range(self, size, etag):
+        """
+        解析 Range 请求头
+        返回 None 表示发送整个文件 (没有 Range, Range 无效, 或 If-Range 与 ETag 不符),
+        返回空列表表示所有 Range 都无法满足, 否则返回 (起始, 结束) 列表, 结束位置包含在内
+        """
+        header = self.headers.get('Range')
+        if header is None:
+            return None
+        # If-Range 只接受强 ETag, 日期或弱 ETag 都视为不符
+        if_range = self.headers.get('If-Range')
+        if if_range is not None and if_range.strip() != etag:
+            return None
+        unit, _, spec = header.partition('=')
+        if unit.strip().lower() != 'bytes':
+            return None
+
+        ranges = []
+        for item in spec.split(','):
+            match = re.fullmatch(r'\s*(\d*)-(\d*)\s*', item)
+            if match is None or match.group(1) == match.group(2) == '':
+                return None
+            first, last = match.groups()
+            if first == '':
+                # 后缀 Range: 最后 N 个字节
+                suffix = int(last)
+                if suffix == 0:
+                    continue
+                start, end = max(0, size - suffix), size - 1
             else:
-                self.send_error(404, "No BIOS update currently published")
-        elif self.path == '/status':
+                start = int(first)
+                if last and int(last) < start:
+                    return None
+                if start >= size:
+                    continue
+                end = min(int(last), size - 1) if last else size - 1
+            ranges.append((start, end))
+
+        if len(ranges) > self.max_ranges:
+            return None
+        return ranges
+
+    def send_range(self, f, start, length):
+        """发送文件的一段数据, 不把整个文件读入内存"""
+        if USE_SENDFILE:
+            self.bytes_sent += self.connection.sendfile(f, start, length)
+            return
+        f.seek(start)
+        while length > 0:
+            chunk = f.read(min(length, self.copy_block_size))
+            if not chunk:
+                break
+            self.write_body(chunk)
+            length -= len(chunk)
+
+    def client_id(self):
+        """客户端标识: X-Client-Id 请求头 (HttpDownloadLib 发送网卡的 MAC 地址), client 查询参数, 或 IP 地址"""
+        query = parse_qs(urlsplit(self.path).query)
+        return self.headers.get('X-Client-Id') or query.get('client', [''])[0] or self.client_address[0]
+
+    def send_busy(self):
+        """下载数已满, 以 503 与 Retry-After 让客户端稍后再试"""
+        body = b"Too many downloads in progress, retry later"
+        self.send_response(503)
+        self.send_header('Retry-After', str(self.retry_after))
+        self.send_header('Content-type', 'text/plain')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.write_body(body)
+
+    def send_file(self, path):
+        """
+        发送文件, 镜像及其压缩版本同时下载的数量受 --max-downloads 限制,
+        并计入下载指标
+        """
+        image = catalog.find_download(os.path.realpath(path))
+        if self.command != 'GET' or image is None:
+            self.send_local_file(path, image)
+            return
+
+        slot = download_slots is not None and not self.is_small_range(image)
+        if slot and not download_slots.acquire(blocking=False):
+            self.send_busy()
+            return
+        metrics.download_started()
+        start, sent = time.monotonic(), self.bytes_sent
+        try:
+            self.send_local_file(path, image)
+        finally:
+            metrics.download_done(self.bytes_sent - sent, time.monotonic() - start)
+            if slot:
+                download_slots.release()
+
+    def is_small_range(self, image):
+        """请求只取镜像的一小段 (镜像探测, 缺块修补), 不占用下载名额"""
+        ranges = self.parse_range(image.size, image.etag)
+        return bool(ranges) and sum(end - start + 1 for start, end in ranges) <= SMALL_RANGE_MAX
+
+    def send_local_file(self, path, image):
+        """
+        发送文件, 已发布的镜像直接从常驻的文件句柄发送;
+        按内容存放的文件带永久缓存的 Cache-Control, 发送期间不会被清理
+        """
+        cache_control = IMMUTABLE_CACHE_CONTROL if content_digest(path) is not None else None
+        with content_store.transfer(path):
+            if USE_SENDFILE and image is not None and os.path.realpath(path) == image.path:
+                self.send_file_object(image.file, image.size, image.mtime, image.etag, self.guess_type(path),
+                                      cache_control)
+                return
+
+            try:
+                f = open(path, 'rb')
+            except OSError:
+                self.send_error(404, "File not found")
+                return
+
+            with f:
+                st = os.fstat(f.fileno())
+                self.send_file_object(f, st.st_size, st.st_mtime, file_etag(st), self.guess_type(path),
+                                      cache_control)
+
+    def send_file_object(self, f, size, mtime, etag, ctype, cache_control=None):
+        """发送打开的文件, 支持单个与多个 Range (multipart/byteranges) 以及 If-Range"""
+        ranges = self.parse_range(size, etag)
+
+        if ranges == []:
+            self.send_response(416)
+            self.send_header('Content-Range', f'bytes */{size}')
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            return
+
+        if ranges is None:
             self.send_response(200)
-            self.send_header('Content-type', 'application/json')
+            self.send_header('Content-type', ctype)
+            self.send_header('Content-Length', str(size))
+        elif len(ranges) == 1:
+            start, end = ranges[0]
+            self.send_response(206)
+            self.send_header('Content-type', ctype)
+            self.send_header('Content-Range', f'bytes {start}-{end}/{size}')
+            self.send_header('Content-Length', str(end - start + 1))
+        else:
+            boundary = uuid.uuid4().hex
+            parts = [((f'\r\n--{boundary}\r\nContent-Type: {ctype}\r\n'
+                       f'Content-Range: bytes {start}-{end}/{size}\r\n\r\n').encode(), start, end)
+                     for start, end in ranges]
+            trailer = f'\r\n--{boundary}--\r\n'.encode()
+            length = sum(len(head) + end - start + 1 for head, start, end in parts) + len(trailer)
+            self.send_response(206)
+            self.send_header('Content-type', f'multipart/byteranges; boundary={boundary}')
+            self.send_header('Content-Length', str(length))
+        self.send_header('Accept-Ranges', 'bytes')
+        self.send_header('ETag', etag)
+        self.send_header('Last-Modified', self.date_time_string(mtime))
+        if cache_control is not None:
+            self.send_header('Cache-Control', cache_control)
+        self.end_headers()
+
+        if self.command == 'HEAD':
+            return
+        if ranges is None:
+            self.send_range(f, 0, size)
+        elif len(ranges) == 1:
+            self.send_range(f, start, end - start + 1)
+        else:
+            for head, start, end in parts:
+                self.write_body(head)
+                self.send_range(f, start, end - start + 1)
+            self.write_body(trailer)
+
+    def proxy_update(self):
+        """
+        代理模式: 把 /update 连同查询参数与客户端标识转发给上游, 镜像地址改为本机的缓存,
+        并在后台开始缓存镜像, 客户端随后的下载多半不必等待上游
+        """
+        # 长轮询时上游会保持请求直到有更新
+        try:
+            wait = max(float(parse_qs(urlsplit(self.path).query).get('wait', ['0'])[0]), 0)
+        except ValueError:
+            wait = 0
+        conn = upstream_cache.connect(60 + wait)
+        try:
+            conn.request('GET', self.path, headers={'Connection': 'close', 'X-Client-Id': self.client_id()})
+            resp = conn.getresponse()
+            body = resp.read()
+        except OSError as e:
+            self.send_error(502, f"Upstream unreachable: {e}")
+            return
+        finally:
+            conn.close()
+
+        if resp.status == 204:
+            self.send_response(204)
+            self.end_headers()
+            return
+        if resp.status != 200:
+            self.send_error(resp.status, resp.reason)
+            return
+
+        try:
+            body, image = upstream_cache.rewrite_update(body)
+        except (ValueError, KeyError, AttributeError):
+            self.send_error(502, "Invalid /update response from upstream")
+            return
+        if image is not None:
+            threading.Thread(target=self.prefetch, args=(image,), daemon=True).start()
+        etag = '"' + hashlib.sha256(body).hexdigest()[:32] + '"'
+        if self.etag_matches(etag):
+            self.send_response(304)
+            self.send_header('ETag', etag)
             self.end_headers()
-            self.wfile.write(json.dumps(published_data).encode())
         else:
-            super().do_GET()
+            self.send_bytes('application/json', body, etag)
 
-    def do_POST(self):
-        if self.path == '/publish':
-            form = cgi.FieldStorage(
-                fp=self.rfile,
-                headers=self.headers,
-                environ={'REQUEST_METHOD': 'POST',
-                        'CONTENT_TYPE': self.headers['Content-Type']}
-            )
-
-            version = form['version'].value
-            file_item = form['file']
-            
-            # 保存上传的文件
-            file_path = os.path.join(os.getcwd(), 'BIN', file_item.filename)
-            os.makedirs(os.path.join(os.getcwd(), 'BIN'), exist_ok=True)
-            with open(file_path, 'wb') as f:
-                f.write(file_item.file.read())
-
-            published_data.update({
-                'is_published': True,
-                'version': version,
-                'file_path': file_path
-            })
+    @staticmethod
+    def prefetch(rel):
+        try:
+            upstream_cache.fetch(rel)
+        except Exception as e:
+            logger.warning(f"Prefetch of {rel} failed: {e}")
 
-            self.send_response(200)
-            self.send_header('Content-type', 'text/plain')
+    def send_cached_file(self):
+        """代理模式: 发送 BIN/ 下的文件, 未缓存或已过期时先从上游取得"""
+        rel = bin_relpath(urlsplit(self.path).path)
+        try:
+            upstream_cache.fetch(rel)
+        except UpstreamError as e:
+            self.send_error(404 if e.status == 404 else 502, str(e))
+            return
+        except OSError as e:
+            self.send_error(502, f"Upstream unreachable: {e}")
+            return
+        self.send_file(self.translate_path(self.path))
+
+    def check_update(self, query):
+        """
+        /update 对此客户端的回答: (状态码, 镜像)
+        客户端可以带上主板 (board), 发布通道 (channel) 与当前版本 (current)
+        """
+        image = catalog.lookup(*release_key(query))
+        if image is None:
+            return 404, None
+        if query.get('current', [''])[0].strip() == image.version:
+            # 已是发布的版本, 客户端无需再做任何事
+            return 204, image
+        if not in_rollout(self.client_id(), image.rollout):
+            return 404, image
+        if self.etag_matches(image.update[1]):
+            return 304, image
+        return 200, image
+
+    def send_update(self):
+        """
+        回答 /update; 带 wait=N 时为长轮询: 没有此客户端可以获得的更新时保持请求,
+        直到发布状态改变后有了更新, 或 N 秒 (不超过 --max-wait) 后按当时的状态回答
+        """
+        query = parse_qs(urlsplit(self.path).query)
+        try:
+            wait = min(max(float(query.get('wait', ['0'])[0]), 0), self.max_wait)
+        except ValueError:
+            wait = 0
+        # 同时等待的请求数有上限, 超过时立即回答, 总有工作线程处理其他请求
+        if wait > 0 and not self.long_poll_slots.acquire(blocking=False):
+            wait = 0
+        deadline = time.monotonic() + wait
+        remaining = wait
+        if wait > 0:
+            metrics.long_poll(1)
+        try:
+            while True:
+                # 先取版本号再检查, 检查之后的改变不会错过
+                generation = catalog.generation
+                code, image = self.check_update(query)
+                remaining = deadline - time.monotonic()
+                if code == 200 or remaining <= 0 or catalog.closed:
+                    break
+                catalog.wait_for_change(generation, remaining)
+        finally:
+            if wait > 0:
+                self.waited = wait - max(remaining, 0)
+                metrics.long_poll(-1)
+                self.long_poll_slots.release()
+
+        if code == 204:
+            self.send_response(204)
             self.end_headers()
-            self.wfile.write(b"BIOS update published successfully")
-
-        elif self.path == '/stop':
-            published_data.update({
-                'is_published': False,
-                'version': None,
-                'file_path': None
-            })
-            
-            self.send_response(200)
-            self.send_header('Content-type', 'text/plain')
+        elif code == 404:
+            self.send_error(404, "No BIOS update currently published" if image is None
+                            else "No BIOS update for this client yet")
+        elif code == 304:
+            self.send_response(304)
+            self.send_header('ETag', image.update[1])
             self.end_headers()
-            self.wfile.write(b"BIOS update service stopped")
+        else:
+            body, etag = image.update
+            self.send_bytes('application/json', body, etag)
+            if multicast_sender is not None and self.command == 'GET':
+                multicast_sender.request(image)
+
+    def send_redirect(self, route):
+        """
+        客户端所在子网有就近的镜像时, 以 307 把 BIN/ 下的下载重定向过去并返回 True
+        重定向带 Cache-Control, 客户端在缓存期间对同一目录的请求直接发往镜像
+        """
+        target = redirect_target(self.client_address[0])
+        if target is None or bin_relpath(route) is None:
+            return False
+        self.send_response(307)
+        self.send_header('Location', target + self.path)
+        self.send_header('Cache-Control', f'max-age={REDIRECT_TTL}')
+        self.send_header('Content-Length', '0')
+        self.end_headers()
+        return True
+
+    def do_HEAD(self):
+        route = urlsplit(self.path).path
+        if REDIRECTS and self.send_redirect(route):
+            return
+        if route in ('/', '/update', '/status', '/metrics'):
+            self.do_GET()
+        elif upstream_cache is not None and bin_relpath(route):
+            self.send_cached_file()
+        elif os.path.isfile(self.translate_path(self.path)):
+            self.send_file(self.translate_path(self.path))
+        else:
+            super().do_HEAD()
+
+    def do_GET(self):
+        route = urlsplit(self.path).path
+        if REDIRECTS and self.send_redirect(route):
+            return
+        if upstream_cache is not None:
+            if route == '/update':
+                self.proxy_update()
+                return
+            if route == '/status':
+                self.send_bytes('application/json', json.dumps({'upstream': upstream_cache.url}).encode())
+                return
+            if bin_relpath(route):
+                self.send_cached_file()
+                return
+
+        if route == '/':
+            self.send_bytes('text/html', HTML.encode())
+        elif route == '/update':
+            self.send_update()
+        elif route == '/status':
+            self.send_bytes('application/json', json.dumps(catalog.status()).encode())
+        elif route == '/metrics':
+            self.send_bytes('text/plain; version=0.0.4', metrics.render())
+        elif os.path.isfile(self.translate_path(self.path)):
+            self.send_file(self.translate_path(self.path))
+        else:
+            super().do_GET()
+
+    def do_POST(self):
+        if self.path == '/report':
+            # 缓存代理也接受报告, 汇总本机架的客户端
+            self.receive_report()
+        elif upstream_cache is not None:
+            self.discard_body()
+            self.send_error(403, f"Caching proxy, publish on {upstream_cache.url}")
+        elif self.path == '/publish':
+            try:
+                release = self.receive_upload()
+            except ValueError as e:
+                # 请求体可能没有读完, 不能继续使用这个连接
+                self.close_connection = True
+                self.send_error(400, str(e))
+                return
+
+            image = PublishedImage(release['file_path'], release['version'], release['sha256'],
+                                   release['board'], release['channel'])
+            image.rollout = release['rollout']
+            start_artifact_pipeline(image)
+            catalog.publish(image)
+
+            self.send_bytes('text/plain', b"BIOS update published successfully")
+
+        elif self.path in ('/stop', '/rollout'):
+            form = self.read_form()
+            if form is None:
+                self.close_connection = True
+                self.send_error(413)
+                return
+            board, channel = release_key(form)
+
+            if self.path == '/stop':
+                if catalog.stop(board, channel) is None:
+                    self.send_error(404, "No BIOS update currently published")
+                else:
+                    self.send_bytes('text/plain', b"BIOS update service stopped")
+                return
+
+            try:
+                percent = parse_rollout(form.get('percent', [''])[0])
+            except ValueError as e:
+                self.send_error(400, str(e))
+                return
+            if catalog.set_rollout(board, channel, percent) is None:
+                self.send_error(404, "No BIOS update currently published")
+            else:
+                self.send_bytes('text/plain', f"Rollout set to {percent}% of clients".encode())
+
+        else:
+            self.discard_body()
+            self.send_error(404)
+
+class ThreadPoolHTTPServer(socketserver.TCPServer):
+    """
+    线程池 HTTP 服务器
+    最多 workers 个连接同时处理, 其余连接留在监听队列中等待, 内存占用因此有上限;
+    文件以固定大小的块发送, 每个连接的内存占用也有上限
+    """
+    allow_reuse_address = True
+    request_queue_size = 128
+
+    def __init__(self, server_address, handler, workers, reuse_port=False):
+        # 多个进程各自监听同一端口, 由内核分配新连接
+        self.reuse_port = reuse_port
+        super().__init__(server_address, handler)
+        self.executor = ThreadPoolExecutor(max_workers=workers)
+        self.slots = threading.BoundedSemaphore(workers)
+
+    def server_bind(self):
+        if self.reuse_port:
+            self.socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+        super().server_bind()
+
+    def process_request(self, request, client_address):
+        # 没有空闲线程时不再 accept, 新连接留在内核队列中
+        self.slots.acquire()
+        self.executor.submit(self.process_request_thread, request, client_address)
 
-def run_server(port):
-    global PORT
+    def process_request_thread(self, request, client_address):
+        try:
+            self.finish_request(request, client_address)
+        except Exception:
+            self.handle_error(request, client_address)
+        finally:
+            self.shutdown_request(request)
+            self.slots.release()
+
+    def server_close(self):
+        super().server_close()
+        self.executor.shutdown(wait=False)
+
+def serve(port, workers, catalog_path, log_settings, reuse_port, retain):
+    """在当前进程中运行服务器, 直到 Ctrl+C 或 (多进程时) SIGTERM"""
+    global artifact_pool, catalog, content_store
+    log_listener = setup_logging(*log_settings)
+    artifact_pool = ProcessPoolExecutor()
+    catalog = Catalog(catalog_path)
+    catalog.load()
+    if reuse_port:
+        threading.Thread(target=catalog.watch, daemon=True).start()
+    content_store = ContentStore(retain)
+    # 代理缓存的文件不清理
+    if upstream_cache is None:
+        threading.Thread(target=content_store.run, daemon=True).start()
+    if multicast_sender is not None:
+        threading.Thread(target=multicast_sender.run, daemon=True).start()
+
+    try:
+        with ThreadPoolHTTPServer(("", port), RequestHandler, workers, reuse_port) as httpd:
+            try:
+                httpd.serve_forever()
+            except KeyboardInterrupt:
+                catalog.close()
+                httpd.shutdown()
+                httpd.server_close()
+                artifact_pool.shutdown(cancel_futures=True)
+    finally:
+        log_listener.stop()
+
+def raise_keyboard_interrupt(signum, frame):
+    raise KeyboardInterrupt
+
+def start_worker(port, workers, catalog_path, log_settings, retain):
+    """fork 一个工作进程, 返回其 pid"""
+    pid = os.fork()
+    if pid != 0:
+        return pid
+    # 由主进程统一处理 Ctrl+C, 再以 SIGTERM 通知各工作进程退出
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+    signal.signal(signal.SIGTERM, raise_keyboard_interrupt)
+    try:
+        serve(port, workers, catalog_path, log_settings, True, retain)
+    except Exception:
+        traceback.print_exc()
+        os._exit(1)
+    os._exit(0)
+
+def run_server(port, workers, idle_timeout, max_requests, max_downloads, retry_after, max_wait, catalog_path,
+               log_settings, processes, retain):
+    global PORT, download_slots
     PORT = port
-    
+    if max_downloads > 0:
+        # 多进程时用进程间共享的信号量, 限制的是所有进程的下载总数
+        semaphore = multiprocessing.BoundedSemaphore if processes > 1 else threading.BoundedSemaphore
+        download_slots = semaphore(max_downloads)
+
     handler = RequestHandler
-    with socketserver.TCPServer(("", port), handler) as httpd:
-        print(f"Server started at http://{LOCAL_IP}:{port}")
-        print("Press Ctrl+C to stop the server")
-        try:
-            httpd.serve_forever()
-        except KeyboardInterrupt:
-            print("\nShutting down server...")
-            httpd.shutdown()
-            httpd.server_close()
+    handler.idle_timeout = idle_timeout
+    handler.max_requests = max_requests
+    handler.retry_after = retry_after
+    handler.max_wait = max_wait
+    # 长轮询最多占用一半的工作线程
+    handler.long_poll_slots = threading.BoundedSemaphore(max(workers // 2, 1))
+    if processes == 1:
+        print(f"Server started at http://{LOCAL_IP}:{port} with {workers} workers")
+    else:
+        print(f"Server started at http://{LOCAL_IP}:{port} with {processes} processes of {workers} workers")
+    print("Press Ctrl+C to stop the server")
+    if processes == 1:
+        serve(port, workers, catalog_path, log_settings, False, retain)
+        print("\nShutting down server...")
+        return
 
-if __name__ == "__main__":
-    if len(sys.argv) != 2:
-        print("Usage: python3 server.py <port>")
-        sys.exit(1)
-        
+    # 工作进程之间除了监听端口与下载数的信号量, 只通过发布目录的数据库共享状态,
+    # fork 之前主进程不能有其他线程或打开的数据库连接
+    signal.signal(signal.SIGTERM, raise_keyboard_interrupt)
+    # pid -> 启动时间
+    started = {}
     try:
-        port = int(sys.argv[1])
-        run_server(port)
-    except ValueError:
-        print("Error: Port must be a number")
-        sys.exit(1)
\ No newline at end of file
+        for _ in range(processes):
+            started[start_worker(port, workers, catalog_path, log_settings, retain)] = time.monotonic()
+        while True:
+            pid, status = os.wait()
+            if time.monotonic() - started.pop(pid) < 1:
+                # 启动即退出, 如端口被占用, 重启也无济于事
+                print(f"Worker {pid} failed to start, exit status {status}")
+                raise KeyboardInterrupt
+            print(f"Worker {pid} exited with status {status}, restarting it")
+            started[start_worker(port, workers, catalog_path, log_settings, retain)] = time.monotonic()
+    except KeyboardInterrupt:
+        print("\nShutting down server...")
+        for pid in started:
+            os.kill(pid, signal.SIGTERM)
+        for pid in started:
+            os.waitpid(pid, 0)
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="UEFI BIOS Update Server")
+    parser.add_argument("port", type=int, help="listening port")
+    parser.add_argument("mirrors", nargs="*", metavar="mirror_url",
+                        help="base URL of a mirror serving the same BIN/ files")
+    parser.add_argument("--workers", type=int, default=64,
+                        help="number of connections served at the same time by each process (default: 64)")
+    parser.add_argument("--processes", type=int, default=1,
+                        help="server processes sharing the port with SO_REUSEPORT (default: 1)")
+    parser.add_argument("--idle-timeout", type=float, default=5,
+                        help="seconds a kept-alive connection may wait for its next request (default: 5)")
+    parser.add_argument("--max-requests", type=int, default=100,
+                        help="requests served on one connection before closing it (default: 100)")
+    parser.add_argument("--max-downloads", type=int, default=0,
+                        help="image downloads served at the same time, others get 503 (default: 0, no limit)")
+    parser.add_argument("--retry-after", type=int, default=30,
+                        help="seconds sent in Retry-After when downloads are full (default: 30)")
+    parser.add_argument("--max-wait", type=int, default=300,
+                        help="longest seconds a long-poll /update?wait=N is held (default: 300)")
+    parser.add_argument("--catalog", metavar="PATH", default="catalog.db",
+                        help="SQLite database keeping the releases across restarts (default: catalog.db)")
+    parser.add_argument("--retain", type=int, default=3600, metavar="SECONDS",
+                        help="seconds a replaced image is kept after its last transfer (default: 3600)")
+    parser.add_argument("--log-level", choices=("debug", "info", "warning", "error", "off"), default="info",
+                        help="info logs every request, warning only errors (default: info)")
+    parser.add_argument("--log-file", metavar="PATH",
+                        help="write the JSON log lines to a file instead of stderr")
+    parser.add_argument("--upstream", metavar="URL",
+                        help="run as a caching proxy of the server at this base URL")
+    parser.add_argument("--sign-key", metavar="PEM",
+                        help="private key to sign published images with, requires openssl")
+    parser.add_argument("--redirect", type=parse_redirect, action="append", default=[], metavar="SUBNET=URL",
+                        help="redirect downloads from clients in SUBNET to the mirror at URL, e.g. "
+                             "10.1.0.0/16=http://10.1.0.2:5000 (repeatable)")
+    parser.add_argument("--redirect-ttl", type=int, default=300, metavar="SECONDS",
+                        help="seconds clients may cache a redirect (default: 300)")
+    parser.add_argument("--multicast", metavar="GROUP:PORT",
+                        help="also send the requested images to this UDP multicast group, e.g. 239.255.0.1:5001")
+    parser.add_argument("--multicast-rate", type=float, default=100, metavar="MBIT",
+                        help="multicast sending rate in Mbit/s (default: 100)")
+    parser.add_argument("--multicast-ttl", type=int, default=1,
+                        help="multicast TTL, 1 stays on the local network (default: 1)")
+    args = parser.parse_args()
+
+    if args.workers < 1:
+        parser.error("--workers must be at least 1")
+    if args.idle_timeout <= 0:
+        parser.error("--idle-timeout must be positive")
+    if args.max_requests < 1:
+        parser.error("--max-requests must be at least 1")
+    if args.sign_key is not None:
+        if shutil.which('openssl') is None:
+            parser.error("--sign-key requires openssl in PATH")
+        SIGN_KEY = os.path.abspath(args.sign_key)
+
+    if args.processes < 1:
+        parser.error("--processes must be at least 1")
+    if args.processes > 1 and not (hasattr(os, 'fork') and hasattr(socket, 'SO_REUSEPORT')):
+        parser.error("--processes requires fork() and SO_REUSEPORT")
+
+    if args.upstream is not None:
+        if urlsplit(args.upstream).scheme != 'http' or not urlsplit(args.upstream).hostname:
+            parser.error("--upstream must be an http:// URL")
+        upstream_cache = UpstreamCache(args.upstream)
+
+    if args.multicast is not None:
+        group, _, group_port = args.multicast.rpartition(':')
+        try:
+            multicast = socket.inet_aton(group)[0] in range(224, 240) and 0 < int(group_port) < 65536
+        except (OSError, ValueError):
+            multicast = False
+        if not multicast:
+            parser.error("--multicast must be an IPv4 multicast GROUP:PORT")
+        if args.multicast_rate <= 0:
+            parser.error("--multicast-rate must be positive")
+        if args.processes > 1 or args.upstream is not None:
+            parser.error("--multicast cannot be used with --processes or --upstream")
+        multicast_sender = MulticastSender(args.multicast, args.multicast_rate, args.multicast_ttl)
+
+    MIRRORS.extend(args.mirrors)
+    # 最长前缀优先
+    REDIRECTS.extend(sorted(args.redirect, key=lambda redirect: redirect[0].prefixlen, reverse=True))
+    if args.redirect_ttl < 0:
+        parser.error("--redirect-ttl must not be negative")
+    REDIRECT_TTL = args.redirect_ttl
+    if args.max_downloads < 0:
+        parser.error("--max-downloads must not be negative")
+    if args.retry_after < 0:
+        parser.error("--retry-after must not be negative")
+    if args.max_wait < 0:
+        parser.error("--max-wait must not be negative")
+    if args.retain < 0:
+        parser.error("--retain must not be negative")
+    run_server(args.port, args.workers, args.idle_timeout, args.max_requests, args.max_downloads, args.retry_after,
+               args.max_wait, os.path.abspath(args.catalog), (args.log_level, args.log_file), args.processes,
+               args.retain)
\ No newline at end of file